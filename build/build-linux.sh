@@ -3,12 +3,16 @@
 # export DISPLAY=$(awk '/nameserver / {print $2; exit}' /etc/resolv.conf 2>/dev/null):0
 
 # Compile the emulator
+# Add -DTIMELINE_ENABLED to record host thread timelines (run with timeline=<file.json>)
 cd ..
 c++ -c risc64.cc -o build/risc64.o -std=c++2a -Ofast -m64 -I"emulator/" -Wno-format
 
 # Link everything into a neat little file, also link OpenGL and X11
 c++ build/risc64.o build/imgui.o build/imgui_draw.o build/imgui_widgets.o build/imgui-SFML.o -o risc64-e -Ofast -m64 -std=c++2a -lsfml-graphics -lsfml-window -lsfml-system -lGL -lX11
 
+# Build the offline trace decoder
+c++ risc64-trace.cc -o risc64-trace -std=c++2a -O2 -m64 -Wno-format
+
 # Cleanup
 cd build
 rm "risc64.o"
@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <vector>
+
+#include "risc64/trace.hpp"
+#include "risc64/cache.hpp"
+#include "risc64/elf.hpp"
+#include "risc64/cpu/decoder.hpp"
+#include "risc64/cli.hpp"
+
+// Offline decoder for risc64 instruction traces
+// Usage: risc64-trace file=<trace> [pc=<lo>-<hi>] [class=alu|lsu|bnj|sys] [reg=<n>] [mem=<addr>] [last=<n>] [elf=<program>]
+//        [cache_l1i=<cfg>] [cache_l1d=<cfg>] [cache_l2=<cfg>] [cache_region_shift=<n>]
+// When any cache_* level is given the filtered records are fed to the cache
+// model and its report is printed instead of the records
+// elf= annotates each record with the symbol and source line of its pc
+
+namespace trace_tool {
+    using namespace machine;
+
+    const char* class_names[] = { "alu", "lsu", "bnj", "sys" };
+
+    const char* subclass_names[] = {
+        "t_operand_register_all",
+        "t_operand_single_const",
+        "d_operand_register_all",
+        "d_operand_single_const",
+        "d_operand_double_const",
+        "s_operand_register",
+        "s_operand_const",
+        "no_operand"
+    };
+
+    struct filter {
+        u64 pc_lo = 0, pc_hi = 0xffffffffffffffff;
+        int cls = -1, reg = -1;
+        bool mem = false;
+        u64 mem_addr = 0;
+        u64 last = 0;
+
+        bool matches(const trace::record& r, decoder::instruction& i) const {
+            if ((r.pc < pc_lo) || (r.pc > pc_hi)) return false;
+            if ((cls >= 0) && (decoder::get_class(i) != cls)) return false;
+            if ((reg >= 0) && (!(r.flags & trace::rf_reg_write) || (r.reg != reg))) return false;
+            if (mem) {
+                if (!(r.flags & (trace::rf_mem_read | trace::rf_mem_write))) return false;
+                if ((mem_addr < r.mem_addr) || (mem_addr >= (r.mem_addr + r.mem_size))) return false;
+            }
+            return true;
+        }
+    };
+
+    // Read every record in chronological order, base is the index of the oldest one
+    bool load(const std::string& name, std::vector <trace::record>& records, u64& base) {
+        std::FILE* f = std::fopen(name.c_str(), "rb");
+        if (!f) {
+            _log(error, "Couldn't open trace file \"%s\"", name.c_str());
+            return false;
+        }
+
+        trace::header h;
+        if ((std::fread(&h, sizeof(h), 1, f) != 1) || std::memcmp(h.magic, trace::magic, 8) || (h.record_size != sizeof(trace::record))) {
+            _log(error, "\"%s\" is not a risc64 trace file", name.c_str());
+            std::fclose(f);
+            return false;
+        }
+
+        if (h.capacity) {
+            // Ring, unroll starting at the oldest record
+            std::vector <trace::record> ring(h.capacity);
+            size_t n = std::fread(ring.data(), sizeof(trace::record), h.capacity, f);
+            u64 count = std::min<u64>(h.head, n),
+                first = h.head - count;
+
+            base = first;
+            records.reserve(count);
+            for (u64 i = first; i < h.head; i++) {
+                records.push_back(ring[i % h.capacity]);
+            }
+        } else {
+            base = 0;
+
+            trace::record r;
+            while (std::fread(&r, sizeof(r), 1, f) == 1) {
+                records.push_back(r);
+            }
+        }
+
+        std::fclose(f);
+        return true;
+    }
+
+    void print(u64 index, const trace::record& r, decoder::instruction& i) {
+        std::printf("%10llu  %016llx  %016llx  %s %-22s id=0x%02x %c%llu",
+            (unsigned long long)index,
+            (unsigned long long)r.pc,
+            (unsigned long long)r.opcode,
+            class_names[decoder::get_class(i)],
+            subclass_names[decoder::get_subclass(i) >> 2],
+            (unsigned)i.id,
+            i.operand_sign ? 's' : 'u',
+            (unsigned long long)decoder::get_operand_sizeof(i.operand_size) * 8
+        );
+
+        if (r.flags & trace::rf_skipped) std::printf("  (skipped)");
+        if (r.flags & trace::rf_reg_write) std::printf("  r%u <- 0x%llx", (unsigned)r.reg, (unsigned long long)r.reg_value);
+        if (r.flags & trace::rf_mem_read) std::printf("  [0x%llx]:%u -> 0x%llx", (unsigned long long)r.mem_addr, (unsigned)r.mem_size, (unsigned long long)r.mem_value);
+        if (r.flags & trace::rf_mem_write) std::printf("  [0x%llx]:%u <- 0x%llx", (unsigned long long)r.mem_addr, (unsigned)r.mem_size, (unsigned long long)r.mem_value);
+
+        std::string sym = symbols::global.symbolize(r.pc), file;
+        u32 line;
+        if (sym.size()) std::printf("  <%s>", sym.c_str());
+        if (symbols::global.lookup_line(r.pc, file, line)) std::printf("  %s:%u", file.c_str(), (unsigned)line);
+
+        std::printf("\n");
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    using namespace trace_tool;
+
+    cli::init(argc, argv);
+    cli::parse();
+
+    if (!cli::settings.contains("file")) {
+        std::printf("usage: risc64-trace file=<trace> [pc=<lo>-<hi>] [class=alu|lsu|bnj|sys] [reg=<n>] [mem=<addr>] [last=<n>] [elf=<program>]\n");
+        std::printf("                    [cache_l1i=<size>,<assoc>,<line>,<lru|fifo|random>] [cache_l1d=...] [cache_l2=...]\n");
+        return 1;
+    }
+
+    filter flt;
+
+    if (cli::settings.contains("pc")) {
+        std::string s = cli::settings["pc"];
+        size_t d = s.find_first_of('-');
+        flt.pc_lo = std::stoull(s.substr(0, d), nullptr, 0);
+        flt.pc_hi = (d == std::string::npos) ? flt.pc_lo : std::stoull(s.substr(d+1), nullptr, 0);
+    }
+
+    if (cli::settings.contains("class")) {
+        auto it = std::find_if(std::begin(class_names), std::end(class_names), [](const char* n) {
+            return cli::settings["class"] == n;
+        });
+        if (it != std::end(class_names)) flt.cls = it - std::begin(class_names);
+    }
+
+    if (cli::settings.contains("reg")) flt.reg = std::stoi(cli::settings["reg"], nullptr, 0);
+    if (cli::settings.contains("mem")) { flt.mem = true; flt.mem_addr = std::stoull(cli::settings["mem"], nullptr, 0); }
+    if (cli::settings.contains("last")) flt.last = std::stoull(cli::settings["last"], nullptr, 0);
+
+    std::vector <machine::trace::record> records;
+    u64 base = 0;
+    if (!load(cli::settings["file"], records, base)) return 1;
+
+    if (cli::settings.contains("elf")) {
+        machine::elf::file program;
+        if (!program.open(cli::settings["elf"])) return 1;
+        program.import_symbols(symbols::global);
+        program.import_lines(symbols::global);
+        symbols::global.finalize();
+    }
+
+    machine::cache::hierarchy model;
+    bool simulate = machine::cache::init_from_settings(model, cli::settings);
+
+    u64 first = (flt.last && (flt.last < records.size())) ? records.size() - flt.last : 0;
+
+    for (u64 n = first; n < records.size(); n++) {
+        auto& r = records[n];
+
+        machine::decoder::instruction i(r.opcode, r.ext64);
+        machine::decoder::decode(i);
+
+        if (!flt.matches(r, i)) continue;
+
+        if (simulate) {
+            model.fetch(r.pc, r.pci);
+            if (r.flags & (trace::rf_mem_read | trace::rf_mem_write)) {
+                model.data(r.pc, r.mem_addr, r.mem_size, r.flags & trace::rf_mem_write);
+            }
+        } else {
+            print(base + n, r, i);
+        }
+    }
+
+    if (simulate) model.report(std::cout);
+
+    return 0;
+}
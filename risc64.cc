@@ -5,6 +5,34 @@
 #include "risc64/global.hpp"
 
 namespace machine {
+    // Place an ELF program's segments on the bus, import its symbols
+    // and line tables, and point cpu0 at its entry
+    bool load_elf(const std::string& name) {
+        TIMELINE_SCOPE("load_elf");
+
+        elf::file f;
+        if (!f.open(name)) return false;
+
+        for (auto& s : f.get_segments()) {
+            if (!bus::load(s.addr, s.data, s.filesz) ||
+                !bus::load(s.addr + s.filesz, nullptr, s.memsz - s.filesz)) {
+                _log(error, "ELF segment @ 0x%llx (0x%llx bytes) isn't backed by RAM or ROM", s.addr, s.memsz);
+                return false;
+            }
+        }
+
+        symbols::global.clear();
+        size_t syms = f.import_symbols(symbols::global),
+               lines = f.import_lines(symbols::global);
+        symbols::global.finalize();
+
+        dev_proc.get_pc() = f.get_entry();
+        dev_proc.publish();
+
+        _log(ok, "Loaded ELF program \"%s\", entry 0x%llx, %zu symbols, %zu line rows", name.c_str(), f.get_entry(), syms, lines);
+        return true;
+    }
+
     void init(const std::string bios_file) {
         #ifdef __linux__
 	        if (!XInitThreads()) {
@@ -14,22 +42,177 @@ namespace machine {
         #endif
 
         // Initialize BIOS
-        dev_bios.load_binary(bios_file);
-        _log(ok, "Initialized BIOS");
+        u64 bios_base = cli::settings.contains("bios_base") ? std::stoull(cli::settings["bios_base"], nullptr, 0) : 0,
+            bios_size = cli::settings.contains("bios_size") ? utility::parse_size(cli::settings["bios_size"]) : 0;
+        // An ELF program can boot without a BIOS image
+        if (bios_file.size() || !cli::settings.contains("elf")) {
+            if (!dev_bios.load_binary(bios_file, bios_base, bios_size)) {
+                std::exit(1);
+            }
+            _log(ok, "Initialized BIOS");
+        }
+
+        // Initialize main memory, sizes accept K, M and G suffixes
+        // Pages are only committed on first touch, so the 1M default costs nothing
+        u64 mem_size = cli::settings.contains("memory") ? utility::parse_size(cli::settings["memory"]) : 0x100000;
+        dev_memory_t::page_mode pm = dev_memory_t::pm_normal;
+        if (cli::settings.contains("memory_pages")) {
+            if (cli::settings["memory_pages"] == "huge") pm = dev_memory_t::pm_transparent;
+            if (cli::settings["memory_pages"] == "hugetlb") pm = dev_memory_t::pm_hugetlb;
+        }
+        if (!dev_mmem.init(mem_size, pm)) {
+            std::exit(1);
+        }
+        _log(ok, "Initialized main memory (0x%llx bytes)", mem_size);
 
         // Attach devices
         machine::bus::attach_device(dev_proc);
         machine::bus::attach_device(dev_bios);
         machine::bus::attach_device(dev_ioctl);
+        // VRAM shadows main memory in its range, so it's attached first
+        if (cli::settings.contains("vga") && (cli::settings["vga"] != "0")) {
+            machine::bus::attach_device(dev_vga);
+        }
         machine::bus::attach_device(dev_mmem);
+        machine::bus::attach_device(dev_pic);
+        machine::bus::attach_device(dev_dma);
+        machine::bus::attach_device(dev_disk);
+        machine::bus::attach_device(dev_timer);
+        machine::bus::attach_device(dev_pmu);
+        dev_proc.attach_interrupt_controller(&dev_pic);
+        dev_proc.attach_pmu(dev_pmu.get_bank(dev_proc.get_thread_id()));
+
+        // Machine time, timer_mode=deterministic ties it to retired instructions
+        // at a nominal timer_hz instructions per second
+        if (cli::settings.contains("timer_mode") && (cli::settings["timer_mode"] == "deterministic")) {
+            u64 hz = cli::settings.contains("timer_hz") ? std::stoull(cli::settings["timer_hz"], nullptr, 0) : 10000000;
+            events.set_mode(scheduler::sm_deterministic, hz);
+        } else {
+            events.set_mode(scheduler::sm_realtime);
+        }
+        dev_timer.reset_rtc();
+        dev_proc.attach_scheduler(&events);
+
+        // Guest clock, clock=turbo (default), input (run until the guest waits for keys) or <Hz>
+        if (cli::settings.contains("clock")) {
+            if (!cpu_governor.parse(cli::settings["clock"])) {
+                std::exit(1);
+            }
+        }
+        dev_proc.attach_governor(&cpu_governor);
+        dev_ioctl.attach_governor(&cpu_governor);
         _log(ok, "Attached devices to bus");
 
+        // Load an ELF program into RAM/ROM
+        if (cli::settings.contains("elf")) {
+            if (!load_elf(cli::settings["elf"])) {
+                std::exit(1);
+            }
+        }
+
+        // Attach a disk image, disk_overlay=<file> keeps the image itself read-only
+        if (cli::settings.contains("disk")) {
+            std::string overlay = cli::settings.contains("disk_overlay") ? cli::settings["disk_overlay"] : "";
+            bool read_only = cli::settings.contains("disk_readonly") && (cli::settings["disk_readonly"] != "0");
+            size_t threads = cli::settings.contains("disk_threads") ? std::stoul(cli::settings["disk_threads"]) : BLOCK_IO_THREADS;
+
+            if (!dev_disk.open(cli::settings["disk"], overlay, read_only, threads)) {
+                std::exit(1);
+            }
+            _log(ok, "Attached disk image \"%s\"", cli::settings["disk"].c_str());
+        }
+
+        // Scripted keyboard input
+        if (cli::settings.contains("input")) {
+            if (!dev_ioctl.start_input_script(cli::settings["input"])) {
+                std::exit(1);
+            }
+        }
+
+        // Semihosting, guest argv is the program name followed by everything after "--"
+        semihost::files_enabled = cli::settings.contains("semihosting") && (cli::settings["semihosting"] != "0");
+        semihost::args.push_back(cli::settings.contains("elf") ? cli::settings["elf"] : bios_file);
+        semihost::args.insert(semihost::args.end(), cli::guest_args.begin(), cli::guest_args.end());
+
+        // Initialize bus access heatmap
+        if (cli::settings.contains("heatmap")) {
+            size_t shift = cli::settings.contains("heatmap_shift") ? std::stoul(cli::settings["heatmap_shift"]) : 12,
+                   interval = cli::settings.contains("heatmap_interval") ? std::stoul(cli::settings["heatmap_interval"]) : 100;
+
+            heatmap::init(bus::devices, shift, interval, cli::settings["heatmap"]);
+            _log(ok, "Initialized bus access heatmap");
+        }
+
+        // Capture VGA or terminal frames, capture=<prefix>
+        if (cli::settings.contains("capture")) {
+            std::string format = cli::settings.contains("capture_format") ? cli::settings["capture_format"] : "png",
+                        source = cli::settings.contains("capture_source") ? cli::settings["capture_source"] :
+                                 (bus::get_device<vga>(0xa) ? "vga" : "terminal"),
+                        golden = cli::settings.contains("capture_golden") ? cli::settings["capture_golden"] : "";
+            // Golden comparisons default to the final frame only
+            size_t interval = cli::settings.contains("capture_interval") ? std::stoul(cli::settings["capture_interval"]) : (golden.size() ? 0 : 100);
+
+            if (!capture::init(bus::get_device<vga>(0xa), &dev_ioctl, cli::settings["capture"], format, source, interval, golden)) {
+                std::exit(1);
+            }
+            _log(ok, "Initialized frame capture (%s, %s)", source.c_str(), format.c_str());
+        }
+
+        // Initialize instruction tracer
+        if (cli::settings.contains("trace")) {
+            trace::mode mode = trace::get_mode(cli::settings.contains("trace_mode") ? cli::settings["trace_mode"] : "last");
+            u64 records = cli::settings.contains("trace_size") ? std::stoull(cli::settings["trace_size"], nullptr, 0) : 0x100000;
+
+            if (cpu_tracer.open(cli::settings["trace"], mode, records)) {
+                dev_proc.attach_tracer(&cpu_tracer);
+                _log(ok, "Initialized instruction tracer (%s)", mode == trace::m_full ? "full" : "last");
+            }
+        }
+
+        // Initialize cache model
+        if (cache::init_from_settings(cpu_cache, cli::settings)) {
+            cpu_cache.report_file = cli::settings.contains("cache_report") ? cli::settings["cache_report"] : "cache.txt";
+            dev_proc.attach_cache_model(&cpu_cache);
+            _log(ok, "Initialized cache model");
+        }
+
+        // Presentation, display=none runs without windows and echoes the terminal to stdout
+        if (cli::settings.contains("display")) {
+            if (!display::parse(cli::settings["display"])) {
+                std::exit(1);
+            }
+        }
+        if (!display::enabled()) {
+            dev_ioctl.set_echo(true);
+            _log(info, "Running without a display");
+        }
+
+        // Cycle-cost timing model, timing=<table file>
+        if (cli::settings.contains("timing")) {
+            if (!cpu_timing.load(cli::settings["timing"], bus::devices)) {
+                std::exit(1);
+            }
+            dev_proc.attach_timing_model(&cpu_timing);
+            _log(ok, "Initialized timing model");
+        }
+
+        // Vector kernels, simd=scalar|sse2|avx2 caps the instruction set used
+        std::string simd = cli::settings.contains("simd") ? cli::settings["simd"] : "avx2";
+        if ((simd != "scalar") && (simd != "sse2") && (simd != "avx2")) {
+            _log(error, "Invalid simd setting \"%s\" (scalar, sse2 or avx2)", simd.c_str());
+            std::exit(1);
+        }
+        _log(ok, "Initialized vector unit (%s kernels)", vector::select(simd).c_str());
+
         // Initialize CPU loop threads
         machine::cpu_thread_sp_array[0] = std::make_shared<sf::Thread>(&cpu_loop, &dev_proc);
         _log(ok, "Initialized CPU loop threads");
 
 #ifdef _WIN32
-        dev_ioctl.init_display();
+        if (display::enabled()) {
+            dev_ioctl.init_display();
+            if (machine::bus::get_device<machine::vga>(0xa)) dev_vga.init_display();
+        }
 #endif
 
         machine::cpu_thread_sp_array[0]->launch();
@@ -44,17 +227,43 @@ int main(int argc, const char* argv[]) {
     ::ShowWindow(::GetConsoleWindow(), SW_HIDE);
 #endif
 
+    TIMELINE_THREAD("main");
+
     cli::init(argc, argv);
 
     cli::parse();
 
     _log::log::init("risc64", cli::settings.contains("log") ? cli::settings["log"] : "main.log");
 
-    machine::init(cli::settings["bios"]);
+    machine::init(cli::settings.contains("bios") ? cli::settings["bios"] : "");
+
+    // Without a display the machine runs until the CPU halts
+    if (machine::display::enabled()) {
+        cw.start();
+    } else {
+        machine::cpu_thread_sp_array[0]->wait();
+    }
+
+    // Stop the CPU loop and join it, so nothing writes to the tracer or the
+    // cache model while they're torn down below
+    machine::dev_proc.request_stop();
+    machine::cpu_thread_sp_array[0]->wait();
+
+    machine::dev_dma.close();
+    machine::dev_ioctl.stop_input_script();
+    machine::dev_disk.close();
+    machine::semihost::close_all();
+    bool capture_ok = machine::capture::close();
 
-    cw.start();
+    machine::cpu_tracer.close();
+    machine::heatmap::close();
+    machine::cpu_cache.close();
 
-    machine::cpu_thread_sp_array[0]->terminate();
+    if (cli::settings.contains("timeline")) {
+        TIMELINE_EXPORT(cli::settings["timeline"]);
+    }
 
-    return 0;
+    // A failed golden capture comparison fails the run even if the guest passed
+    int status = machine::semihost::process_status();
+    return (!capture_ok && !status) ? 1 : status;
 }
@@ -1,53 +1,238 @@
 #pragma once
 
 #include <algorithm>
+#include <cstring>
 #include <vector>
 #include <memory>
 
+#define BUS_MAX_DEVICES 20
+
 #include "device.hpp"
 #include "aliases.hpp"
+#include "heatmap.hpp"
+#include "timeline.hpp"
+#include "perf.hpp"
 #include "devices/bios.hpp"
 
 #include "log.hpp"
 
-#define BUS_MAX_DEVICES 20
-
 namespace machine {
     namespace bus {
         size_t hid_count = 0;
 
         std::vector <machine::device*> devices;
 
-        inline u64 read(u64 addr, size_t size) {
-            for (auto d : devices) {
+        namespace detail {
+            // Profiling hooks for an access that hit device i
+            inline void on_access(size_t i, machine::device* d, u64 offset, heatmap::access a) {
+#ifdef BUS_HEATMAP_ENABLED
+                if (d->get_heatmap()) d->get_heatmap()->touch(offset, a);
+#endif
+#ifdef PERF_COUNTERS_ENABLED
+                if (a == heatmap::h_write) perf::count_write(i); else perf::count_read(i);
+#endif
+            }
+
+            // Same for a block access, every heatmap cell in the block is touched
+            // once and the block counts as a single bus access
+            inline void on_block_access(size_t i, machine::device* d, u64 offset, u64 len, heatmap::access a) {
+#ifdef BUS_HEATMAP_ENABLED
+                if (auto h = d->get_heatmap()) {
+                    u64 s = h->get_shift();
+                    for (u64 c = offset >> s; c <= ((offset + len - 1) >> s); c++) h->touch(c << s, a);
+                }
+#endif
+#ifdef PERF_COUNTERS_ENABLED
+                if (a == heatmap::h_write) perf::count_write(i); else perf::count_read(i);
+#endif
+            }
+
+            // Index of the device containing addr, or devices.size()
+            inline size_t find(u64 addr) {
+                for (size_t i = 0; i < devices.size(); i++) {
+                    auto d = devices[i];
+                    if ((addr >= d->get_base()) && (addr - d->get_base() < d->get_size())) return i;
+                }
+                return devices.size();
+            }
+        }
+
+        // hit, when given, receives the index of the device that took the
+        // access, or devices.size() if none did
+        inline u64 read(u64 addr, size_t size, size_t* hit = nullptr) {
+            for (size_t i = 0; i < devices.size(); i++) {
+                auto d = devices[i];
                 u64 base_addr = d->get_base(),
                     end_addr = base_addr + d->get_size();
-                if ((addr >= base_addr) && (addr <= end_addr)) {
+                if ((addr >= base_addr) && (addr < end_addr)) {
+                    if (hit) *hit = i;
                     if (!(d->get_access_mode() & device::access_mode::a_r)) {
+                        TIMELINE_SCOPE("bus_invalid_read");
                         _log(warning, "Invalid read on device %s @ 0x%llx, addr = 0x%llx, size = 0x%llx (RISC64_SIGSEGV)", d->get_name().c_str(), base_addr, addr, size);
                         return 0xffffffffffffffff;
                     }
+                    detail::on_access(i, d, addr - base_addr, heatmap::h_read);
                     return d->read(addr, size);
                 }
             }
+            if (hit) *hit = devices.size();
+            TIMELINE_SCOPE("bus_unmapped_read");
             _log(warning, "Read on unmapped memory, addr = 0x%llx, size = 0x%llx (RISC64_ENOENT)", addr, size);
             return 0xffffffffffffffff;
         }
 
-        inline void write(u64 addr, u64 value, size_t size) {
-            for (auto d : devices) {
+        inline void write(u64 addr, u64 value, size_t size, size_t* hit = nullptr) {
+            for (size_t i = 0; i < devices.size(); i++) {
+                auto d = devices[i];
                 u64 base_addr = d->get_base(),
                     end_addr = base_addr + d->get_size();
-                if ((addr >= base_addr) && (addr <= end_addr)) {
+                if ((addr >= base_addr) && (addr < end_addr)) {
+                    if (hit) *hit = i;
                     if (!(d->get_access_mode() & device::access_mode::a_w)) {
+                        TIMELINE_SCOPE("bus_invalid_write");
                         _log(warning, "Invalid write on device %s @ 0x%llx, addr = 0x%llx, size = 0x%llx (RISC64_SIGSEGV)", d->get_name().c_str(), base_addr, addr, size);
                     }
+                    detail::on_access(i, d, addr - base_addr, heatmap::h_write);
                     return d->write(addr, value, size);
                 }
             }
+            if (hit) *hit = devices.size();
+            TIMELINE_SCOPE("bus_unmapped_write");
             _log(warning, "Write on unmapped memory, addr = 0x%llx, size = 0x%llx (RISC64_ENOENT)", addr, size);
         }
-        
+
+        // Instruction fetch, same as read but counted as an execute access
+        inline u64 fetch(u64 addr, size_t size) {
+            for (size_t i = 0; i < devices.size(); i++) {
+                auto d = devices[i];
+                u64 base_addr = d->get_base(),
+                    end_addr = base_addr + d->get_size();
+                if ((addr >= base_addr) && (addr < end_addr)) {
+                    if (!(d->get_access_mode() & device::access_mode::a_r)) {
+                        TIMELINE_SCOPE("bus_invalid_fetch");
+                        _log(warning, "Invalid fetch on device %s @ 0x%llx, addr = 0x%llx, size = 0x%llx (RISC64_SIGSEGV)", d->get_name().c_str(), base_addr, addr, size);
+                        return 0xffffffffffffffff;
+                    }
+                    detail::on_access(i, d, addr - base_addr, heatmap::h_exec);
+                    return d->read(addr, size);
+                }
+            }
+            TIMELINE_SCOPE("bus_unmapped_fetch");
+            _log(warning, "Fetch on unmapped memory, addr = 0x%llx, size = 0x%llx (RISC64_ENOENT)", addr, size);
+            return 0xffffffffffffffff;
+        }
+
+        // Read len bytes starting at addr into dst, the block may span devices
+        // Unmapped or unreadable bytes read as 0xff, returns false if there were any
+        inline bool read_block(u64 addr, u8* dst, u64 len) {
+            bool ok = true;
+            while (len) {
+                size_t i = detail::find(addr);
+                if (i == devices.size()) {
+                    TIMELINE_SCOPE("bus_unmapped_read");
+                    _log(warning, "Block read on unmapped memory, addr = 0x%llx, size = 0x%llx (RISC64_ENOENT)", addr, len);
+                    std::memset(dst, 0xff, len);
+                    return false;
+                }
+
+                auto d = devices[i];
+                u64 offset = addr - d->get_base(),
+                    n = std::min(len, d->get_size() - offset);
+
+                if (!(d->get_access_mode() & device::access_mode::a_r)) {
+                    TIMELINE_SCOPE("bus_invalid_read");
+                    _log(warning, "Invalid block read on device %s @ 0x%llx, addr = 0x%llx, size = 0x%llx (RISC64_SIGSEGV)", d->get_name().c_str(), d->get_base(), addr, n);
+                    std::memset(dst, 0xff, n);
+                    ok = false;
+                } else {
+                    detail::on_block_access(i, d, offset, n, heatmap::h_read);
+                    d->read_block(addr, dst, n);
+                }
+
+                addr += n; dst += n; len -= n;
+            }
+            return ok;
+        }
+
+        // Write len bytes from src starting at addr, the block may span devices
+        // Returns false if part of it was unmapped or not writable
+        inline bool write_block(u64 addr, const u8* src, u64 len) {
+            bool ok = true;
+            while (len) {
+                size_t i = detail::find(addr);
+                if (i == devices.size()) {
+                    TIMELINE_SCOPE("bus_unmapped_write");
+                    _log(warning, "Block write on unmapped memory, addr = 0x%llx, size = 0x%llx (RISC64_ENOENT)", addr, len);
+                    return false;
+                }
+
+                auto d = devices[i];
+                u64 offset = addr - d->get_base(),
+                    n = std::min(len, d->get_size() - offset);
+
+                if (!(d->get_access_mode() & device::access_mode::a_w)) {
+                    TIMELINE_SCOPE("bus_invalid_write");
+                    _log(warning, "Invalid block write on device %s @ 0x%llx, addr = 0x%llx, size = 0x%llx (RISC64_SIGSEGV)", d->get_name().c_str(), d->get_base(), addr, n);
+                    ok = false;
+                } else {
+                    detail::on_block_access(i, d, offset, n, heatmap::h_write);
+                    d->write_block(addr, src, n);
+                }
+
+                addr += n; src += n; len -= n;
+            }
+            return ok;
+        }
+
+        // True if all of [addr, addr+len) belongs to devices that allow block
+        // transfers from device threads (device::is_concurrent), DMA and block
+        // I/O check this instead of running register handlers off the CPU thread
+        inline bool is_concurrent(u64 addr, u64 len) {
+            while (len) {
+                size_t i = detail::find(addr);
+                if (i == devices.size()) return false;
+
+                auto d = devices[i];
+                u64 n = std::min(len, d->get_size() - (addr - d->get_base()));
+                if (!d->is_concurrent(addr, n)) return false;
+                addr += n; len -= n;
+            }
+            return true;
+        }
+
+        // Host memory backing [addr, addr+len) if it lies within a single
+        // memory-backed device, nullptr otherwise (use read_block/write_block)
+        inline u8* get_host_pointer(u64 addr, u64 len, size_t* hit = nullptr) {
+            size_t i = detail::find(addr);
+            if (hit) *hit = i;
+            if (i == devices.size()) return nullptr;
+            return devices[i]->get_host_pointer(addr, len);
+        }
+
+        // Whether an access that hit device i at addr went to host memory,
+        // classifies an access without scanning the bus again
+        inline bool is_memory(size_t i, u64 addr, u64 len) {
+            return (i < devices.size()) && devices[i]->get_host_pointer(addr, len);
+        }
+
+        // Program [addr, addr+len) through the devices' load hooks, used by
+        // program loaders so access modes don't apply, data == nullptr zero-fills
+        // Returns false if part of the range isn't backed by a loadable device
+        inline bool load(u64 addr, const u8* data, u64 len) {
+            while (len) {
+                size_t i = detail::find(addr);
+                if (i == devices.size()) return false;
+
+                auto d = devices[i];
+                u64 n = std::min(len, d->get_size() - (addr - d->get_base()));
+                if (!d->load(addr, data, n)) return false;
+
+                addr += n;
+                len -= n;
+                if (data) data += n;
+            }
+            return true;
+        }
 
         template <class Device> inline void attach_device(Device& d) {
             devices.push_back(&d);
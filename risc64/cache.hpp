@@ -0,0 +1,254 @@
+#pragma once
+
+#include <unordered_map>
+#include <algorithm>
+#include <ostream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <memory>
+#include <string>
+
+#include "aliases.hpp"
+#include "utility.hpp"
+#include "log.hpp"
+
+namespace machine {
+    namespace cache {
+        // Replacement policies
+        enum policy {
+            p_lru,
+            p_fifo,
+            p_random
+        };
+
+        // Cache level geometry, parsed from "<size>,<assoc>,<line>,<policy>"
+        // e.g. "32K,8,64,lru", sizes accept K, M and G suffixes
+        struct config {
+            u64 size = 0, assoc = 1, line = 64;
+            policy repl = p_lru;
+        };
+
+        namespace detail {
+            using utility::parse_size;
+
+            inline bool is_pow2(u64 v) { return v && !(v & (v - 1)); }
+        }
+
+        inline bool parse_config(const std::string& s, config& c) {
+            std::vector <std::string> f;
+            size_t p = 0, n;
+            while ((n = s.find_first_of(',', p)) != std::string::npos) {
+                f.push_back(s.substr(p, n - p));
+                p = n + 1;
+            }
+            f.push_back(s.substr(p));
+
+            try {
+                if (f.size() > 0) c.size  = detail::parse_size(f[0]);
+                if (f.size() > 1) c.assoc = detail::parse_size(f[1]);
+                if (f.size() > 2) c.line  = detail::parse_size(f[2]);
+            } catch (...) {
+                return false;
+            }
+            if (f.size() > 3) c.repl = (f[3] == "fifo") ? p_fifo : (f[3] == "random") ? p_random : p_lru;
+
+            if (!detail::is_pow2(c.line) || !c.assoc || (c.size < c.line * c.assoc) || !detail::is_pow2(c.size / (c.line * c.assoc))) {
+                _log(warning, "Invalid cache configuration \"%s\" (size/(line*assoc) and line must be powers of 2)", s.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        // Hit/miss counters
+        struct stats {
+            u64 hits = 0, misses = 0;
+
+            inline void count(bool hit) { if (hit) hits++; else misses++; }
+            double miss_rate() const { return (hits + misses) ? (double)misses / (hits + misses) : 0.0; }
+        };
+
+        // A single set-associative, write-back, write-allocate cache level
+        class level {
+            std::string name;
+            config cfg;
+            u64 sets = 0, line_shift = 0, tick = 0, seed = 0x2545f4914f6cdd1dull;
+
+            // tag + 1 per way, 0 means invalid
+            std::vector <u64> tags;
+            std::vector <u64> stamps;
+            std::vector <bool> dirty;
+
+            level* next = nullptr;
+
+        public:
+            stats total;
+            u64 writebacks = 0;
+
+            level(const std::string& name, const config& c, level* next = nullptr) :
+                name(name), cfg(c), next(next) {
+                sets = c.size / (c.line * c.assoc);
+                while ((1ull << line_shift) < c.line) line_shift++;
+                tags.assign(sets * c.assoc, 0);
+                stamps.assign(sets * c.assoc, 0);
+                dirty.assign(sets * c.assoc, false);
+            }
+
+            const std::string& get_name() const { return name; }
+            const config& get_config() const { return cfg; }
+            u64 get_line_shift() const { return line_shift; }
+
+            // Access a single line, returns whether it hit
+            bool access(u64 addr, bool write) {
+                u64 l = addr >> line_shift,
+                    set = l & (sets - 1),
+                    tag = l + 1;
+
+                size_t first = set * cfg.assoc, victim = first;
+                tick++;
+
+                for (size_t w = first; w < first + cfg.assoc; w++) {
+                    if (tags[w] == tag) {
+                        if (cfg.repl == p_lru) stamps[w] = tick;
+                        if (write) dirty[w] = true;
+                        total.count(true);
+                        return true;
+                    }
+                    // Prefer invalid ways, then the oldest stamp
+                    if (!tags[victim]) continue;
+                    if (!tags[w] || (stamps[w] < stamps[victim])) victim = w;
+                }
+
+                if ((cfg.repl == p_random) && tags[victim]) {
+                    seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+                    victim = first + (seed % cfg.assoc);
+                }
+
+                total.count(false);
+
+                if (tags[victim] && dirty[victim]) {
+                    writebacks++;
+                    if (next) next->access((tags[victim] - 1) << line_shift, true);
+                }
+
+                if (next) next->access(addr, false);
+
+                tags[victim] = tag;
+                stamps[victim] = tick;
+                dirty[victim] = write;
+                return false;
+            }
+        };
+
+        // L1I/L1D with an optional shared L2, plus per-PC and per-region statistics
+        class hierarchy {
+            std::unique_ptr<level> l1i, l1d, l2;
+
+            std::unordered_map <u64, stats> pc_fetch, pc_data, regions;
+            u64 region_shift = 12;
+
+            // Access every line covered by [addr, addr+size)
+            static bool access_lines(level* l, u64 addr, size_t size, bool write) {
+                bool hit = true;
+                u64 s = l->get_line_shift(),
+                    last = (addr + (size ? size : 1) - 1) >> s;
+                for (u64 line = addr >> s; line <= last; line++) {
+                    hit &= l->access(line << s, write);
+                }
+                return hit;
+            }
+
+            void report_map(std::ostream& os, const char* title, const char* key, std::unordered_map <u64, stats>& m, size_t top) {
+                std::vector <std::pair<u64, stats>> v(m.begin(), m.end());
+                std::sort(v.begin(), v.end(), [](auto& a, auto& b) { return a.second.misses > b.second.misses; });
+
+                os << "\n" << title << " (top " << std::min(top, v.size()) << " of " << v.size() << " by misses)\n";
+                os << std::setw(18) << key << std::setw(14) << "accesses" << std::setw(14) << "misses" << std::setw(10) << "miss%" << "\n";
+                for (size_t i = 0; (i < v.size()) && (i < top); i++) {
+                    auto& s = v[i].second;
+                    os << "0x" << std::setw(16) << std::setfill('0') << std::hex << v[i].first << std::dec << std::setfill(' ')
+                       << std::setw(14) << (s.hits + s.misses)
+                       << std::setw(14) << s.misses
+                       << std::setw(9) << std::fixed << std::setprecision(2) << s.miss_rate() * 100.0 << "%\n";
+                }
+            }
+
+        public:
+            std::string report_file;
+
+            hierarchy() = default;
+
+            // Any of the configs may be nullptr to leave that level out
+            void init(const config* i, const config* d, const config* shared, u64 region_shift = 12) {
+                if (shared) l2 = std::make_unique<level>("L2", *shared);
+                if (i) l1i = std::make_unique<level>("L1I", *i, l2.get());
+                if (d) l1d = std::make_unique<level>("L1D", *d, l2.get());
+                this->region_shift = region_shift;
+            }
+
+            bool is_enabled() const { return l1i || l1d || l2; }
+
+            // Instruction fetch of size bytes at pc
+            inline void fetch(u64 pc, size_t size) {
+                level* l = l1i ? l1i.get() : l2.get();
+                if (!l) return;
+                pc_fetch[pc].count(access_lines(l, pc, size, false));
+            }
+
+            // Data load or store issued by the instruction at pc
+            inline void data(u64 pc, u64 addr, size_t size, bool write) {
+                level* l = l1d ? l1d.get() : l2.get();
+                if (!l) return;
+                bool hit = access_lines(l, addr, size, write);
+                pc_data[pc].count(hit);
+                regions[addr >> region_shift].count(hit);
+            }
+
+            void report(std::ostream& os, size_t top = 32) {
+                os << "risc64 cache model report\n\n";
+                for (level* l : { l1i.get(), l1d.get(), l2.get() }) {
+                    if (!l) continue;
+                    auto& c = l->get_config();
+                    os << std::setw(4) << l->get_name() << ": "
+                       << c.size << " bytes, " << c.assoc << "-way, " << c.line << " byte lines, "
+                       << ((c.repl == p_lru) ? "lru" : (c.repl == p_fifo) ? "fifo" : "random") << "\n      "
+                       << (l->total.hits + l->total.misses) << " accesses, "
+                       << l->total.misses << " misses ("
+                       << std::fixed << std::setprecision(2) << l->total.miss_rate() * 100.0 << "%), "
+                       << l->writebacks << " writebacks\n";
+                }
+
+                report_map(os, "Instruction fetches per PC", "pc", pc_fetch, top);
+                report_map(os, "Data accesses per PC", "pc", pc_data, top);
+                report_map(os, "Data accesses per region", "region", regions, top);
+            }
+
+            void close() {
+                if (!is_enabled() || !report_file.size()) return;
+
+                std::ofstream f(report_file);
+                if (!f.is_open()) {
+                    _log(warning, "Couldn't open cache report file \"%s\"", report_file.c_str());
+                    return;
+                }
+                report(f);
+                _log(info, "Wrote cache model report to \"%s\"", report_file.c_str());
+                report_file.clear();
+            }
+        };
+
+        // Set up a hierarchy from cache_l1i, cache_l1d and cache_l2 style settings
+        template <class Settings> bool init_from_settings(hierarchy& h, Settings& settings) {
+            config i, d, s;
+            bool has_i = settings.contains("cache_l1i") && parse_config(settings["cache_l1i"], i),
+                 has_d = settings.contains("cache_l1d") && parse_config(settings["cache_l1d"], d),
+                 has_s = settings.contains("cache_l2")  && parse_config(settings["cache_l2"], s);
+
+            if (!(has_i || has_d || has_s)) return false;
+
+            u64 region_shift = settings.contains("cache_region_shift") ? std::stoull(settings["cache_region_shift"]) : 12;
+            h.init(has_i ? &i : nullptr, has_d ? &d : nullptr, has_s ? &s : nullptr, region_shift);
+            return true;
+        }
+    }
+}
@@ -0,0 +1,361 @@
+#pragma once
+
+#include <condition_variable>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <deque>
+
+#include <SFML/Graphics.hpp>
+
+#include "aliases.hpp"
+#include "pixel.hpp"
+#include "timeline.hpp"
+#include "perf.hpp"
+#include "log.hpp"
+#include "devices/vga.hpp"
+#include "devices/ioctl.hpp"
+
+// Frames waiting for the encoder before new ones are dropped
+#define CAPTURE_QUEUE_SIZE 8
+
+namespace machine {
+    // Frame capture for regression tests of graphical guests
+    // A sampler thread copies the VGA framebuffer (or the ioctl terminal) every
+    // interval into a bounded queue, an encoder thread converts, writes and
+    // hashes them. Neither touches the CPU thread, so capture works the same
+    // with display=none. VGA bitmap frames are written as a PNG sequence, a
+    // Y4M video or raw RGBA, text frames (terminal, VGA text mode) as text.
+    // Every frame's FNV-1a hash goes to <prefix>.hashes, which can be given
+    // back as capture_golden to compare runs. Sampled frames depend on host
+    // timing, so golden runs only capture the final frame (interval 0) and
+    // any difference from the golden file fails the run
+    namespace capture {
+        enum format {
+            cf_png,
+            cf_y4m,
+            cf_raw
+        };
+
+        enum source {
+            cs_vga,
+            cs_terminal
+        };
+
+        struct frame {
+            u64 index, time_ns;
+            bool text;
+            u8 control;
+            std::vector <u8> data;
+        };
+
+        bool enabled = false;
+        format fmt = cf_png;
+        source src = cs_vga;
+        size_t interval_ms = 100;
+        std::string prefix;
+
+        vga* vga_dev = nullptr;
+        ioctl* ioctl_dev = nullptr;
+
+        namespace detail {
+            std::deque <frame> queue;
+            std::mutex queue_mtx;
+            std::condition_variable queue_cv;
+            bool closing = false;
+
+            std::thread sampler, encoder;
+            std::atomic<bool> sampler_running = false;
+            std::chrono::steady_clock::time_point start;
+
+            u64 next_index = 0, dropped = 0, written = 0, mismatches = 0, compared = 0;
+
+            std::ofstream hashes, video, text;
+            std::unordered_map <u64, u64> golden;
+            std::vector <u32> rgba;
+
+            inline u64 fnv1a(const u8* p, size_t n, u64 h = 0xcbf29ce484222325) {
+                for (size_t i = 0; i < n; i++) { h ^= p[i]; h *= 0x100000001b3; }
+                return h;
+            }
+
+            // Copy the current frame, called by the sampler and once more on close,
+            // the final frame is always queued
+            void grab(bool final = false) {
+                frame f;
+                f.index = next_index++;
+                f.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+                if (src == cs_vga) {
+                    f.control = vga_dev->get_control();
+                    f.text = f.control & 0x4;
+                    f.data.resize(f.text ? VGA_TEXT_COLUMNS * VGA_TEXT_ROWS * 2 : VGA_STRIDE * VGA_MAX_LINES);
+                    std::memcpy(f.data.data(), vga_dev->get_vram(), f.data.size());
+                } else {
+                    f.control = 0;
+                    f.text = true;
+                    f.data.resize(TERMINAL_COLUMNS * TERMINAL_ROWS, ' ');
+
+                    terminal_buffer& t = ioctl_dev->get_terminal();
+                    t.flush();
+                    auto v = t.get_view();
+                    u64 top = std::max<u64>((v.last + 1 > TERMINAL_ROWS) ? v.last + 1 - TERMINAL_ROWS : 0, v.first);
+                    for (u64 l = top; l <= v.last; l++) {
+                        u32 version = ~0u;
+                        t.copy_line(l, version, (char*)&f.data[(l - top) * TERMINAL_COLUMNS]);
+                    }
+                }
+
+                std::lock_guard <std::mutex> lock(queue_mtx);
+                if (!final && (queue.size() >= CAPTURE_QUEUE_SIZE)) { dropped++; return; }
+                queue.push_back(std::move(f));
+                queue_cv.notify_one();
+            }
+
+            // VGA bitmap frames are always 640x480, 320x240 is doubled like on screen
+            void to_rgba(const frame& f) {
+                rgba.resize(640 * 480);
+                if ((f.control & 3) == 1) {
+                    u32 line[320];
+                    for (size_t y = 0; y < 240; y++) {
+                        pixel::convert_rgb565(&f.data[y * VGA_STRIDE], line, 320);
+                        u32* d = &rgba[y * 2 * 640];
+                        for (size_t x = 0; x < 320; x++) d[x * 2] = d[x * 2 + 1] = line[x];
+                        std::memcpy(d + 640, d, 640 * 4);
+                    }
+                } else {
+                    for (size_t y = 0; y < 480; y++) pixel::convert_rgb332(&f.data[y * VGA_STRIDE], &rgba[y * 640], 640);
+                }
+            }
+
+            // BT.601 full range 4:2:0
+            void write_y4m() {
+                static std::vector <u8> planes(640 * 480 * 3 / 2);
+                u8 *y = planes.data(), *u = y + 640 * 480, *v = u + 320 * 240;
+
+                for (size_t i = 0; i < 640 * 480; i++) {
+                    u32 p = rgba[i];
+                    int r = p & 0xff, g = (p >> 8) & 0xff, b = (p >> 16) & 0xff;
+                    y[i] = (77 * r + 150 * g + 29 * b) >> 8;
+                }
+                for (size_t cy = 0; cy < 240; cy++) {
+                    for (size_t cx = 0; cx < 320; cx++) {
+                        int r = 0, g = 0, b = 0;
+                        for (size_t k = 0; k < 4; k++) {
+                            u32 p = rgba[(cy * 2 + (k >> 1)) * 640 + cx * 2 + (k & 1)];
+                            r += p & 0xff; g += (p >> 8) & 0xff; b += (p >> 16) & 0xff;
+                        }
+                        r >>= 2; g >>= 2; b >>= 2;
+                        u[cy * 320 + cx] = std::clamp((-43 * r - 85 * g + 128 * b + 0x8000) >> 8, 0, 255);
+                        v[cy * 320 + cx] = std::clamp((128 * r - 107 * g - 21 * b + 0x8000) >> 8, 0, 255);
+                    }
+                }
+
+                video << "FRAME\n";
+                video.write((const char*)planes.data(), planes.size());
+            }
+
+            void encode(const frame& f) {
+                TIMELINE_SCOPE("capture_encode");
+                u64 h;
+
+                if (f.text) {
+                    // VGA text cells are written as their characters, the hash covers attributes too
+                    h = fnv1a(f.data.data(), f.data.size());
+                    size_t cols = (src == cs_vga) ? VGA_TEXT_COLUMNS : TERMINAL_COLUMNS,
+                           stride = (src == cs_vga) ? 2 : 1,
+                           rows = f.data.size() / (cols * stride);
+
+                    text << "--- frame " << f.index << " t=" << f.time_ns << "\n";
+                    std::string line(cols, ' ');
+                    for (size_t r = 0; r < rows; r++) {
+                        for (size_t c = 0; c < cols; c++) {
+                            char ch = f.data[(r * cols + c) * stride];
+                            line[c] = ((ch < 0x20) || (ch > 0x7e)) ? ' ' : ch;
+                        }
+                        text << line << "\n";
+                    }
+                } else {
+                    to_rgba(f);
+                    h = fnv1a((const u8*)rgba.data(), rgba.size() * 4);
+
+                    switch (fmt) {
+                        case cf_png: {
+                            char name[32];
+                            std::snprintf(name, sizeof(name), "_%06llu.png", (unsigned long long)f.index);
+
+                            sf::Image img;
+                            img.create(640, 480, (const sf::Uint8*)rgba.data());
+                            if (!img.saveToFile(prefix + name)) _log(warning, "Couldn't write capture frame \"%s%s\"", prefix.c_str(), name);
+                        } break;
+                        case cf_y4m: write_y4m(); break;
+                        case cf_raw: {
+                            // Frame header: width, height (u32), index, timestamp in ns (u64)
+                            u32 dim[2] = { 640, 480 };
+                            u64 stamp[2] = { f.index, f.time_ns };
+                            video.write((const char*)dim, sizeof(dim));
+                            video.write((const char*)stamp, sizeof(stamp));
+                            video.write((const char*)rgba.data(), rgba.size() * 4);
+                        } break;
+                    }
+                }
+
+                char hex[17];
+                std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h);
+                hashes << f.index << " " << f.time_ns << " " << hex << "\n";
+
+                if (golden.size()) {
+                    auto it = golden.find(f.index);
+                    if (it == golden.end()) {
+                        mismatches++;
+                        _log(warning, "Capture frame %llu isn't in the golden hashes", (unsigned long long)f.index);
+                    } else {
+                        compared++;
+                        if (it->second != h) {
+                            mismatches++;
+                            _log(warning, "Capture frame %llu doesn't match the golden hash", (unsigned long long)f.index);
+                        }
+                    }
+                }
+                written++;
+            }
+
+            void encoder_loop() {
+                TIMELINE_THREAD("capture_encoder");
+#ifdef PERF_COUNTERS_ENABLED
+                perf::set_thread_name("capture_encoder");
+#endif
+                while (true) {
+                    frame f;
+                    {
+                        std::unique_lock <std::mutex> lock(queue_mtx);
+                        queue_cv.wait(lock, [] { return closing || !queue.empty(); });
+                        if (queue.empty()) return;
+
+                        f = std::move(queue.front());
+                        queue.pop_front();
+                    }
+                    encode(f);
+                }
+            }
+
+            void sampler_loop() {
+                TIMELINE_THREAD("capture_sampler");
+                while (sampler_running.load(std::memory_order_relaxed)) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+                    if (sampler_running.load(std::memory_order_relaxed)) grab();
+                }
+            }
+
+            bool load_golden(const std::string& file) {
+                std::ifstream f(file);
+                if (!f.is_open()) {
+                    _log(error, "Couldn't open golden hash file \"%s\"", file.c_str());
+                    return false;
+                }
+
+                u64 index, time;
+                std::string hex;
+                while (f >> index >> time >> hex) golden[index] = std::stoull(hex, nullptr, 16);
+                return true;
+            }
+        }
+
+        // interval_ms = 0 only captures the final frame on close, which is
+        // what golden comparisons of headless runs usually want
+        bool init(vga* v, ioctl* t, const std::string& file_prefix, const std::string& format_name,
+                  const std::string& source_name, size_t interval, const std::string& golden_file = "") {
+            vga_dev = v;
+            ioctl_dev = t;
+            prefix = file_prefix;
+            interval_ms = interval;
+
+            if (format_name == "png") fmt = cf_png;
+            else if (format_name == "y4m") fmt = cf_y4m;
+            else if (format_name == "raw") fmt = cf_raw;
+            else {
+                _log(error, "Unknown capture format \"%s\" (png, y4m or raw)", format_name.c_str());
+                return false;
+            }
+
+            if (source_name == "vga") src = cs_vga;
+            else if (source_name == "terminal") src = cs_terminal;
+            else {
+                _log(error, "Unknown capture source \"%s\" (vga or terminal)", source_name.c_str());
+                return false;
+            }
+            if ((src == cs_vga) && !vga_dev) {
+                _log(error, "VGA capture needs the VGA device (vga=1)");
+                return false;
+            }
+
+            if (golden_file.size()) {
+                if (interval) {
+                    _log(error, "Golden capture comparisons need capture_interval=0");
+                    return false;
+                }
+                if (!detail::load_golden(golden_file)) return false;
+            }
+
+            detail::hashes.open(prefix + ".hashes");
+            detail::text.open(prefix + ".txt");
+            if (fmt != cf_png) {
+                detail::video.open(prefix + ((fmt == cf_y4m) ? ".y4m" : ".raw"), std::ios::binary);
+                if (fmt == cf_y4m) detail::video << "YUV4MPEG2 W640 H480 F" << (interval ? 1000 : 1) << ":" << (interval ? interval : 1) << " Ip A1:1 C420jpeg\n";
+            }
+            if (!detail::hashes.is_open() || !detail::text.is_open() || ((fmt != cf_png) && !detail::video.is_open())) {
+                _log(error, "Couldn't open capture files \"%s.*\"", prefix.c_str());
+                return false;
+            }
+
+            detail::start = std::chrono::steady_clock::now();
+            detail::encoder = std::thread(&detail::encoder_loop);
+            if (interval_ms) {
+                detail::sampler_running = true;
+                detail::sampler = std::thread(&detail::sampler_loop);
+            }
+
+            enabled = true;
+            return true;
+        }
+
+        // Take the final frame and drain the queue
+        // Returns false if a golden comparison failed
+        bool close() {
+            if (!enabled) return true;
+
+            detail::sampler_running = false;
+            if (detail::sampler.joinable()) detail::sampler.join();
+            detail::grab(true);
+
+            {
+                std::lock_guard <std::mutex> lock(detail::queue_mtx);
+                detail::closing = true;
+            }
+            detail::queue_cv.notify_one();
+            if (detail::encoder.joinable()) detail::encoder.join();
+
+            _log(info, "Captured %llu frames to \"%s\" (%llu dropped)",
+                (unsigned long long)detail::written, prefix.c_str(), (unsigned long long)detail::dropped);
+            enabled = false;
+            if (!detail::golden.size()) return true;
+
+            u64 missing = detail::golden.size() - detail::compared;
+            if (detail::mismatches || missing) {
+                _log(error, "%llu of %llu frames differ from the golden hashes, %llu golden frames weren't captured",
+                    (unsigned long long)detail::mismatches, (unsigned long long)detail::written, (unsigned long long)missing);
+                return false;
+            }
+            _log(ok, "All %llu frames match the golden hashes", (unsigned long long)detail::written);
+            return true;
+        }
+    }
+}
@@ -6,6 +6,9 @@
 
 namespace cli {
     std::vector <std::string> cli;
+
+    // Arguments after "--" are passed to the guest untouched
+    std::vector <std::string> guest_args;
     std::unordered_map <std::string, std::string> settings;
 
     namespace detail {
@@ -31,9 +34,13 @@ namespace cli {
     void init(size_t argc, const char* argv[]) {
         cli.reserve(argc-1);
 
-        for (int i = 1; i < argc; i++) {
+        int i = 1;
+        for (; (i < argc) && std::string(argv[i]) != "--"; i++) {
             cli.push_back(std::string(argv[i]));
         }
+        for (i++; i < argc; i++) {
+            guest_args.push_back(std::string(argv[i]));
+        }
     }
 
     void parse() {
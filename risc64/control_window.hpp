@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <string>
+#include <cmath>
 
 #define LGW_OPTIMIZE
 //#define LGW_ENABLE_MUTEXES
@@ -17,6 +18,10 @@
 #include "bus.hpp"
 #include "machine.hpp"
 #include "memory_editor.hpp"
+#include "heatmap.hpp"
+#include "timeline.hpp"
+#include "perf.hpp"
+#include "display.hpp"
 
 #include "utility.hpp"
 
@@ -31,6 +36,30 @@ namespace machine {
 
         std::vector <std::string> device_names;
 
+        // Device selected in the Address Space panel
+        int memory_item = 0;
+        memory_editor editor;
+
+        // Show counts for the last sampling interval instead of totals
+        bool heatmap_live = true;
+
+#ifdef PERF_COUNTERS_ENABLED
+        perf::monitor perf_monitor;
+#endif
+
+        // Register labels are only reformatted when the CPU publishes a new state
+        std::array <std::string, 3 + 32 + 32> register_labels;
+        u64 register_labels_seq = ~0ull;
+
+        machine::device* get_selected_device() {
+            switch (memory_item) {
+                case 0: return bios;
+                case 1: return ioctl;
+                case 2: return memory;
+            }
+            return nullptr;
+        }
+
         inline void cpu_menu() {
             std::string file = "";
             using namespace ImGui;
@@ -59,6 +88,11 @@ namespace machine {
                 if (Button("Turn on display")) {
                     machine::dev_ioctl.init_display();
                 } SameLine();
+                if (machine::bus::get_device<machine::vga>(0xa)) {
+                    if (Button("Turn on VGA display")) {
+                        machine::dev_vga.init_display();
+                    } SameLine();
+                }
 #endif
                 //if (Button("Turn off display")) {
                 //    machine::dev_ioctl.on_close();
@@ -84,40 +118,94 @@ namespace machine {
                 }
                 TreePop();
             }
+
+            SetNextItemOpen(true);
+            if (TreeNode("Speed")) {
+                Separator();
+                governor* g = cpu->get_governor();
+                if (!g) {
+                    TextDisabled("No governor attached");
+                    TreePop();
+                    return;
+                }
+
+                governor::mode m = g->get_mode();
+                if (RadioButton("Turbo", m == governor::gm_turbo)) {
+                    g->set_mode(governor::gm_turbo);
+                } SameLine();
+                if (RadioButton("Throttled", m == governor::gm_throttled)) {
+                    g->set_mode(governor::gm_throttled);
+                } SameLine();
+                if (RadioButton("Run until input", m == governor::gm_input)) {
+                    g->set_mode(governor::gm_input);
+                }
+
+                float mhz = g->get_target() / 1e6f;
+                PushItemWidth(120);
+                if (InputFloat("Target (MHz)", &mhz, 0.1f, 1.0f, "%.3f", ImGuiInputTextFlags_EnterReturnsTrue) && (mhz > 0.0f)) {
+                    g->set_target((u64)(mhz * 1e6f));
+                }
+                PopItemWidth();
+
+                double achieved = g->get_achieved() / 1e6;
+                if (m == governor::gm_throttled) {
+                    Text("Achieved: %.3f MHz (%.1f%% of target)", achieved, achieved * 100.0 / (g->get_target() / 1e6));
+                } else {
+                    Text("Achieved: %.3f MHz", achieved);
+                }
+                TreePop();
+            }
+        }
+
+        // Refresh the cached register labels if the CPU published a new state
+        void update_register_labels() {
+            u64 seq = cpu->get_state_sequence();
+            if (seq == register_labels_seq) return;
+
+            machine::cpu::state s;
+            register_labels_seq = cpu->get_state(s);
+
+            char label[48];
+            sprintf(label, "pc: 0x%llx", (unsigned long long)s.pc); register_labels[0] = label;
+            std::string sym = symbols::global.symbolize(s.pc);
+            if (sym.size()) register_labels[0] += " <" + sym + ">";
+            sprintf(label, "sp: 0x%llx", (unsigned long long)s.sp); register_labels[1] = label;
+            sprintf(label, "pci: 0x%llx (%llu)", (unsigned long long)s.pci, (unsigned long long)s.pci); register_labels[2] = label;
+            if (cpu->timing) { sprintf(label, "  cycles: %llu", (unsigned long long)s.cycles); register_labels[2] += label; }
+            for (int r = 0; r < 32; r++) {
+                sprintf(label, "r%-2i: 0x%llx", r, (unsigned long long)s.gpr[r]); register_labels[3 + r] = label;
+                sprintf(label, "f%-2i: %+f", r, s.fpr[r]); register_labels[35 + r] = label;
+            }
         }
 
         inline void cpu_registers_tab() {
             using namespace ImGui;
             SetNextItemOpen(true);
-            bool b = false;
             if (TreeNode("Registers")) {
-                char label[32], inp[32];
+                update_register_labels();
                 Separator();
                 Text("Main:");
                 Columns(3, "main_table", true);
                 Separator();
-                sprintf(label, "pc: 0x%x", cpu->pc); if (Selectable(label)) {}; NextColumn();
-                sprintf(label, "sp: 0x%x", cpu->sp); if (Selectable(label)) {}; NextColumn();
-                sprintf(label, "pci: 0x%x (%i)", cpu->pci, cpu->pci); if (Selectable(label)) {};
+                if (Selectable(register_labels[0].c_str())) {}; NextColumn();
+                if (Selectable(register_labels[1].c_str())) {}; NextColumn();
+                if (Selectable(register_labels[2].c_str())) {};
                 Columns(1);
                 Separator();
                 Text("GPRs:");
                 Columns(4, "gpr_table", true);
                 Separator();
                 for (int r = 0; r < 32; r++) {
-                    sprintf(label, "r%-2i: 0x%x", r, cpu->gpr[r]);
-                    if (Selectable(label)) {}
+                    if (Selectable(register_labels[3 + r].c_str())) {}
                     NextColumn();
                 }
-                b = false;
                 Columns(1);
                 Separator();
                 Text("FPRs:");
                 Columns(4, "fpr_table", true);
                 Separator();
                 for (int r = 0; r < 32; r++) {
-                    sprintf(label, "f%-2i: %+f", r, cpu->fpr[r]);
-                    if (Selectable(label)) {}
+                    if (Selectable(register_labels[35 + r].c_str())) {}
                     NextColumn();
                 }
                 Columns(1);
@@ -126,12 +214,62 @@ namespace machine {
             }
         }
 
-        inline void cpu_panel() {
-            enum class cpu_panel_tab {
-                t_control,
-                t_registers,
-            } selected_tab = cpu_panel_tab::t_registers;
+        inline void cpu_performance_tab() {
+            using namespace ImGui;
+#ifdef PERF_COUNTERS_ENABLED
+            auto& m = perf_monitor;
+            char label[64];
+
+            SetNextItemOpen(true);
+            if (TreeNode("Guest")) {
+                Separator();
+                Text("Instructions retired: %llu", (unsigned long long)m.instructions);
+                Text("Guest MIPS: %.2f", m.mips.last());
+                sprintf(label, "max %.2f", m.mips.max());
+                PlotLines("##mips", m.mips.values.data(), PERF_HISTORY_SIZE, m.mips.offset, label, 0.0f, m.mips.max() * 1.1f + 0.01f, ImVec2(700, 80));
+                Separator();
+                TreePop();
+            }
 
+            SetNextItemOpen(true);
+            if (TreeNode("Bus")) {
+                Separator();
+                Columns(3, "perf_bus_table", true);
+                Text("Device"); NextColumn();
+                Text("Reads/s"); NextColumn();
+                Text("Writes/s"); NextColumn();
+                Separator();
+                for (size_t d = 0; (d < bus::devices.size()) && (d < BUS_MAX_DEVICES); d++) {
+                    Text("%s", bus::devices[d]->get_name().c_str()); NextColumn();
+                    Text("%.0f", m.read_rate[d]); NextColumn();
+                    Text("%.0f", m.write_rate[d]); NextColumn();
+                }
+                Columns(1);
+                Separator();
+                TreePop();
+            }
+
+            SetNextItemOpen(true);
+            if (TreeNode("Host threads")) {
+                Separator();
+                for (auto& t : m.threads) {
+                    if (t.frame_ms > 0.0f) {
+                        Text("%-16s CPU %5.1f%%  frame %6.2f ms", t.name.c_str(), t.cpu_usage, t.frame_ms);
+                    } else {
+                        Text("%-16s CPU %5.1f%%", t.name.c_str(), t.cpu_usage);
+                    }
+                    sprintf(label, "##cpu_%s", t.name.c_str());
+                    PlotLines(label, t.cpu.values.data(), PERF_HISTORY_SIZE, t.cpu.offset, nullptr, 0.0f, 100.0f, ImVec2(700, 40));
+                }
+                Separator();
+                TreePop();
+            }
+#else
+            Text("Performance counters are disabled (PERF_COUNTERS_ENABLED)");
+#endif
+        }
+
+        inline void cpu_panel() {
             using namespace ImGui;
 
             SetNextWindowPos(ImVec2(0, 0));
@@ -148,8 +286,19 @@ namespace machine {
             );
 
             cpu_menu();
-            cpu_control_tab();
-            cpu_registers_tab();
+
+            if (BeginTabBar("cpu_tabs")) {
+                if (BeginTabItem("State")) {
+                    cpu_control_tab();
+                    cpu_registers_tab();
+                    EndTabItem();
+                }
+                if (BeginTabItem("Performance")) {
+                    cpu_performance_tab();
+                    EndTabItem();
+                }
+                EndTabBar();
+            }
 
             End();
         }
@@ -157,8 +306,7 @@ namespace machine {
         inline void memory_panel() {
             using namespace ImGui;
 
-            static int item = 0;
-            static memory_editor editor;
+            int& item = memory_item;
 
             #define memory_editor_window(t, px, py, sx, sy, c, sz, b) \
                 SetNextWindowPos(ImVec2(px, py)); \
@@ -167,7 +315,7 @@ namespace machine {
                     ImGuiWindowFlags_NoResize   | \
                     ImGuiWindowFlags_NoMove \
                 ); \
-                    editor.DrawContents(c, sz+1, b); \
+                    editor.DrawContents(c, sz, b); \
                     SameLine(); \
                     if (BeginCombo(device_names[item].c_str(), device_names[item].c_str(), ImGuiComboFlags_NoPreview)) { \
                         for (int n = 0; n < device_names.size(); n++) { \
@@ -181,9 +329,16 @@ namespace machine {
                     } \
                 End();
 
+            // ROM edits go through the BIOS patch path (copy-on-write)
+            if (item == 0) {
+                editor.WriteFn = [] (memory_editor::u8*, size_t off, memory_editor::u8 d) { machine::dev_bios.patch(off, d); };
+            } else {
+                editor.WriteFn = nullptr;
+            }
+
             switch (item) {
                 case 0: {
-                    memory_editor_window(device_names[item], 750, 0, 600, 600, bios->get_binary().data(), bios->get_size(), bios->get_base());
+                    memory_editor_window(device_names[item], 750, 0, 600, 600, (void*)bios->get_memory(), bios->get_image_size(), bios->get_base());
                 } break;
                 case 1: {
                     memory_editor_window(device_names[item], 750, 0, 600, 600, ioctl->get_memory(), ioctl->get_size(), ioctl->get_base());
@@ -194,17 +349,116 @@ namespace machine {
             }
         }
 
+        inline void heatmap_panel() {
+            using namespace ImGui;
+
+            SetNextWindowPos(ImVec2(0, 600));
+            SetNextWindowSize(ImVec2(1350, 220));
+            Begin("Access Heatmap", NULL,
+                ImGuiWindowFlags_NoResize   |
+                ImGuiWindowFlags_NoMove
+            );
+
+            heatmap::region* r = nullptr;
+            if (auto d = get_selected_device()) r = d->get_heatmap();
+
+            if (!r) {
+                Text("Heatmap is disabled, run with heatmap=<file.csv> to enable it");
+                End();
+                return;
+            }
+
+            size_t shift = r->get_shift(),
+                   cells = r->get_cell_count(),
+                   ws = r->get_working_set();
+
+            if (RadioButton("Live", heatmap_live)) { heatmap_live = true; } SameLine();
+            if (RadioButton("Total", !heatmap_live)) { heatmap_live = false; } SameLine();
+            Text("| %s | %llu byte cells | working set: %llu cells (%llu bytes) | red = read, green = write, blue = execute",
+                device_names[memory_item].c_str(),
+                (unsigned long long)(1ull << shift),
+                (unsigned long long)ws,
+                (unsigned long long)(ws << shift)
+            );
+
+            // Merge cells so the whole device fits the panel
+            const float cell_px = 8.0f;
+            size_t columns = 1350 / (size_t)cell_px - 2,
+                   slots = columns * 18,
+                   stride = (cells + slots - 1) / slots;
+
+            size_t squares = (cells + stride - 1) / stride;
+
+            auto value = [&] (size_t i, int a) -> u32 {
+                u32 v = 0;
+                for (size_t c = i * stride; (c < (i + 1) * stride) && (c < cells); c++) {
+                    auto& cl = r->get_cell(c);
+                    v += heatmap_live ? cl.delta[a].load(std::memory_order_relaxed) : cl.count[a].load(std::memory_order_relaxed);
+                }
+                return v;
+            };
+
+            u32 max = 1;
+            for (size_t i = 0; i < squares; i++) {
+                for (int a = 0; a < heatmap::h_count; a++) max = std::max(max, value(i, a));
+            }
+
+            auto scale = [&] (u32 v) -> u8 {
+                return v ? (u8)(64 + 191 * (std::log2((float)v + 1) / std::log2((float)max + 1))) : 0;
+            };
+
+            ImDrawList* dl = GetWindowDrawList();
+            ImVec2 origin = GetCursorScreenPos(),
+                   mouse = GetMousePos();
+
+            for (size_t i = 0; i < squares; i++) {
+                ImVec2 p0(origin.x + (i % columns) * cell_px, origin.y + (i / columns) * cell_px),
+                       p1(p0.x + cell_px - 1, p0.y + cell_px - 1);
+
+                u32 rd = value(i, heatmap::h_read),
+                    wr = value(i, heatmap::h_write),
+                    ex = value(i, heatmap::h_exec);
+
+                dl->AddRectFilled(p0, p1, IM_COL32(scale(rd), scale(wr), scale(ex), 255));
+
+                if ((mouse.x >= p0.x) && (mouse.x < p1.x + 1) && (mouse.y >= p0.y) && (mouse.y < p1.y + 1)) {
+                    u64 lo = (i * stride) << shift,
+                        hi = std::min<u64>(((i + 1) * stride) << shift, r->get_device()->get_size());
+                    SetTooltip("0x%llx-0x%llx\nr: %u\nw: %u\nx: %u",
+                        (unsigned long long)(r->get_device()->get_base() + lo),
+                        (unsigned long long)(r->get_device()->get_base() + hi - 1),
+                        rd, wr, ex
+                    );
+                    if (IsMouseClicked(0)) editor.GotoAddrAndHighlight(lo, hi);
+                }
+            }
+
+            Dummy(ImVec2(columns * cell_px, ((squares + columns - 1) / columns) * cell_px));
+
+            End();
+        }
+
     protected:
         void on_event(sf::Event& event) override {
             ImGui::SFML::ProcessEvent(event);
         }
 
         void setup() override {
+            TIMELINE_THREAD("control_window");
+#ifdef PERF_COUNTERS_ENABLED
+            perf::set_thread_name("control_window");
+#endif
             ImGui::CreateContext();
             ImGui::SFML::Init(*get_window());
+            display::apply(get_window());
         }
 
         void draw() override {
+            TIMELINE_SCOPE("control_window_draw");
+#ifdef PERF_COUNTERS_ENABLED
+            perf::frame();
+            perf_monitor.update();
+#endif
             using namespace ImGui;
             auto w = get_window();
             ImGui::SFML::Update(*w, delta.restart());
@@ -212,8 +466,12 @@ namespace machine {
 
             cpu_panel();
             memory_panel();
+            heatmap_panel();
 
             ImGui::SFML::Render(*w);
+
+            // The guest asked to exit through semihosting
+            if (semihost::exited) on_close();
         }
 
         void on_close() override {
@@ -236,7 +494,7 @@ namespace machine {
             device_names.push_back(ioctl->get_name() + " @ 0x" + utility::hexnzf(ioctl->get_base()));
             device_names.push_back(memory->get_name() + " @ 0x" + utility::hexnzf(memory->get_base()));
             
-            init(1350, 600, "risc64 Control Window", sf::Style::Default, false, false);
+            init(1350, 820, "risc64 Control Window", sf::Style::Default, false, false);
         }
     };
 }
\ No newline at end of file
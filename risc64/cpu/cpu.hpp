@@ -11,7 +11,20 @@
 #include "../device.hpp"
 #include "../bus.hpp"
 
+#include "../trace.hpp"
+#include "../cache.hpp"
+#include "../timeline.hpp"
+#include "../seqlock.hpp"
+#include "../devices/pic.hpp"
+#include "../devices/pmu.hpp"
+#include "../semihost.hpp"
+#include "../scheduler.hpp"
+#include "../governor.hpp"
+#include "../timing.hpp"
+
 #include "decoder.hpp"
+#include "fpu.hpp"
+#include "vector.hpp"
 
 // Macro defining how many CPU threads might be created
 #define CPU_THREAD_COUNT 8
@@ -19,6 +32,12 @@
 // Define this so the control window CPU controls work
 #define CPU_STEPPING_ENABLED
 
+// Comment this out to compile the instruction tracer out
+#define CPU_TRACE_ENABLED
+
+// Comment this out to compile the cache model hooks out
+#define CPU_CACHE_MODEL_ENABLED
+
 // Will probably remove this in the future
 #define ALU_OPERATION_COUNT 0xc
 
@@ -49,6 +68,17 @@ namespace machine {
         typedef std::array <u64, 32> gpr_array_t;
         typedef std::array <float, 32> fpr_array_t;
 
+        // Architectural state published for other threads (debugger UI)
+        struct state {
+            gpr_array_t gpr;
+            fpr_array_t fpr;
+            u64 pc, sp;
+            u64 pci;
+            u64 cycles;
+            u16 sr;
+            bool halted;
+        };
+
         // This is so we don't need accessor functions
         friend class control_window;
 
@@ -57,6 +87,9 @@ namespace machine {
 #ifdef CPU_STEPPING_ENABLED
         std::atomic<bool> step, stepping_enabled;
 #endif
+        // Set by request_stop() from other threads, the CPU loop returns when it sees it
+        std::atomic<bool> stop_requested = false;
+
         // Thread ID
         size_t thread_id = 0;
 
@@ -66,6 +99,9 @@ namespace machine {
         // Floating Point Registers
         fpr_array_t fpr = { +0.0f };
 
+        // Vector Registers
+        vector::vreg_array_t vr = {};
+
         // Thread-local register
         std::atomic<u64>* tlr = nullptr;
 
@@ -86,7 +122,148 @@ namespace machine {
 
         // Execution state
         decoder::instruction exec;
-        
+
+        // Last published architectural state
+        seqlock <state> published;
+
+#ifdef CPU_TRACE_ENABLED
+        // Instruction tracer, nullptr when tracing is off
+        trace::buffer* tracer = nullptr;
+
+        // Record for the instruction being executed
+        trace::record trace_rec = {};
+
+        // Fill in the rest of the record and push it to the tracer
+        void retire(u64 ipc) {
+            trace_rec.pc = ipc;
+            trace_rec.opcode = exec.opcode;
+            trace_rec.ext64 = exec.ext64;
+            trace_rec.sr = sr;
+            trace_rec.pci = pci;
+
+            if (!(trace_rec.flags & trace::rf_skipped) && decoder::writes_dest(exec)) {
+                trace_rec.flags |= trace::rf_reg_write;
+                trace_rec.reg = exec.dest;
+                trace_rec.reg_value = gpr[exec.dest];
+            }
+
+            tracer->push(trace_rec);
+        }
+#endif
+
+#ifdef CPU_CACHE_MODEL_ENABLED
+        // Cache hierarchy model, nullptr when disabled
+        cache::hierarchy* cache_model = nullptr;
+#endif
+
+        // Interrupt controller, nullptr if interrupts aren't wired up
+        pic* irq_controller = nullptr;
+
+        // Event scheduler advanced by this CPU, nullptr if none
+        scheduler* events = nullptr;
+
+        // Speed governor, nullptr runs unthrottled
+        governor* speed = nullptr;
+
+        // Cycle-cost model, nullptr leaves the cycle counter at 0
+        timing::model* timing = nullptr;
+        u64 cycles = 0;
+
+        // Guest-visible event counters for this hart, nullptr if there's no PMU
+        pmu::bank* counters = nullptr;
+
+        inline bool counting() const { return counters && counters->enabled(); }
+
+        // Instruction memory accesses go through these
+        inline u64 load(u64 addr, size_t size) {
+#ifdef CPU_CACHE_MODEL_ENABLED
+            if (cache_model) cache_model->data(pc, addr, size, false);
+#endif
+            size_t dev;
+            u64 value = bus::read(addr, size, &dev);
+            if (timing) cycles += timing->access(dev, false);
+            if (counting()) {
+                counters->add(pmu::ev_loads);
+                if (!bus::is_memory(dev, addr, size)) counters->add(pmu::ev_mmio);
+            }
+#ifdef CPU_TRACE_ENABLED
+            if (tracer) {
+                trace_rec.flags |= trace::rf_mem_read;
+                trace_rec.mem_addr = addr;
+                trace_rec.mem_value = value;
+                trace_rec.mem_size = size;
+            }
+#endif
+            return value;
+        }
+
+        inline void store(u64 addr, u64 value, size_t size) {
+#ifdef CPU_CACHE_MODEL_ENABLED
+            if (cache_model) cache_model->data(pc, addr, size, true);
+#endif
+#ifdef CPU_TRACE_ENABLED
+            if (tracer) {
+                trace_rec.flags |= trace::rf_mem_write;
+                trace_rec.mem_addr = addr;
+                trace_rec.mem_value = value;
+                trace_rec.mem_size = size;
+            }
+#endif
+            size_t dev;
+            bus::write(addr, value, size, &dev);
+            if (timing) cycles += timing->access(dev, true);
+            if (counting()) {
+                counters->add(pmu::ev_stores);
+                if (!bus::is_memory(dev, addr, size)) counters->add(pmu::ev_mmio);
+            }
+        }
+
+        // Vector loads and stores move up to 32 bytes at once, straight from
+        // host memory when the range is backed by RAM
+        inline void load_block(u64 addr, u8* dst, size_t size) {
+#ifdef CPU_CACHE_MODEL_ENABLED
+            if (cache_model) cache_model->data(pc, addr, size, false);
+#endif
+            size_t dev;
+            u8* p = bus::get_host_pointer(addr, size, &dev);
+            if (p) std::memcpy(dst, p, size); else bus::read_block(addr, dst, size);
+            if (timing) cycles += timing->access(dev, false);
+            if (counting()) {
+                counters->add(pmu::ev_loads);
+                if (!p) counters->add(pmu::ev_mmio);
+            }
+#ifdef CPU_TRACE_ENABLED
+            if (tracer) {
+                trace_rec.flags |= trace::rf_mem_read;
+                trace_rec.mem_addr = addr;
+                std::memcpy(&trace_rec.mem_value, dst, 8);
+                trace_rec.mem_size = size;
+            }
+#endif
+        }
+
+        inline void store_block(u64 addr, const u8* src, size_t size) {
+#ifdef CPU_CACHE_MODEL_ENABLED
+            if (cache_model) cache_model->data(pc, addr, size, true);
+#endif
+#ifdef CPU_TRACE_ENABLED
+            if (tracer) {
+                trace_rec.flags |= trace::rf_mem_write;
+                trace_rec.mem_addr = addr;
+                std::memcpy(&trace_rec.mem_value, src, 8);
+                trace_rec.mem_size = size;
+            }
+#endif
+            size_t dev;
+            u8* p = bus::get_host_pointer(addr, size, &dev);
+            if (p) std::memcpy(p, src, size); else bus::write_block(addr, src, size);
+            if (timing) cycles += timing->access(dev, true);
+            if (counting()) {
+                counters->add(pmu::ev_stores);
+                if (!p) counters->add(pmu::ev_mmio);
+            }
+        }
+
         // sr = 0000 0000 0000 tncz
 
         // SR flags
@@ -167,6 +344,101 @@ namespace machine {
             apply_flags(d, operand_size, sign);
         }
 
+        // FPU instructions, ALU class ids 0x80-0x8f on fD/fS0/fS1 (fpr)
+        // t_operand_register_all:
+        //   0x80 fadd, 0x81 fsub, 0x82 fmul, 0x83 fdiv, 0x84 fmin, 0x85 fmax (fD = fS0 op fS1)
+        //   0x86 fmadd (fD = fS0 * fS1 + f[ext], fused)
+        // d_operand_register_all:
+        //   0x80 fsqrt fD, fS0    0x81 fcmp fD, fS0 (z: equal, n: fD < fS0, c: unordered)
+        //   0x82 fmov fD, fS0     0x83 fneg fD, fS0     0x84 fabs fD, fS0
+        //   0x85 fcvt fD, rS0 (integer to float)    0x86 fcvti rD, fS0 (float to integer)
+        //   0x87 fmvx rD, fS0 (raw bits to GPR)     0x88 fmvf fD, rS0 (raw bits to FPR)
+        // The sign bit selects signed (1) or unsigned (0) integers for conversions
+        // Returns false if the instruction isn't an FPU instruction
+        bool execute_fpu() {
+            using namespace decoder;
+            if ((exec.id & 0xf0) != 0x80) return false;
+
+            float& d = fpr[exec.dest];
+            float a = fpr[exec.operand0 & 0x1f];
+
+            switch (get_subclass(exec)) {
+                case instruction_type::t_operand_register_all: {
+                    float b = fpr[exec.operand1 & 0x1f];
+                    switch (exec.id) {
+                        case 0x80: d = fpu::add(a, b); break;
+                        case 0x81: d = fpu::sub(a, b); break;
+                        case 0x82: d = fpu::mul(a, b); break;
+                        case 0x83: d = fpu::div(a, b); break;
+                        case 0x84: d = fpu::min(a, b); break;
+                        case 0x85: d = fpu::max(a, b); break;
+                        case 0x86: d = fpu::fma(a, b, fpr[exec.ext & 0x1f]); break;
+                    }
+                } return true;
+
+                case instruction_type::d_operand_register_all: {
+                    switch (exec.id) {
+                        case 0x80: d = fpu::sqrt(a); break;
+                        case 0x81: {
+                            reset_flags(flags::zf | flags::nf | flags::cf);
+                            if (fpu::is_nan(d) || fpu::is_nan(a)) set_flags(flags::cf);
+                            else if (d == a) set_flags(flags::zf);
+                            else if (d < a) set_flags(flags::nf);
+                        } break;
+                        case 0x82: d = a; break;
+                        case 0x83: d = fpu::from_bits(fpu::to_bits(a) ^ 0x80000000); break;
+                        case 0x84: d = fpu::from_bits(fpu::to_bits(a) & 0x7fffffff); break;
+                        case 0x85: d = exec.operand_sign ? (float)(s64)operand0_r : (float)operand0_r; break;
+                        case 0x86: dest_r = exec.operand_sign ? (u64)fpu::to_int(a) : fpu::to_uint(a); break;
+                        case 0x87: dest_r = fpu::to_bits(a); break;
+                        case 0x88: d = fpu::from_bits((u32)operand0_r); break;
+                    }
+                } return true;
+            }
+            return false;
+        }
+
+        // Vector instructions, ALU class ids 0x90-0x9f on vD/vS0/vS1 (vector registers)
+        // Ext bit 0 selects 256-bit (1) or 128-bit (0) operations, 128-bit
+        // results clear the upper half. The operand size is the lane size and
+        // the sign bit selects signed lanes for min, max and cmpgt
+        // t_operand_register_all (ext bit 1 selects f32 lanes):
+        //   0x90 vadd, 0x91 vsub, 0x92 vmul, 0x93 vmin, 0x94 vmax, 0x95 vcmpeq, 0x96 vcmpgt,
+        //   0x97 vand, 0x98 vor, 0x99 vxor, 0x9a vshuf (vD.lane[i] = vS0.lane[vS1.lane[i] % lanes])
+        // d_operand_register_all:
+        //   0x90 vmov vD, vS0    0x91 vbcast vD, rS0 (rS0 to every lane)    0x92 vmovr rD, vS0 (lane 0)
+        // Returns false if the instruction isn't a vector instruction
+        bool execute_vector() {
+            using namespace decoder;
+            if ((exec.id & 0xf0) != 0x90) return false;
+
+            vector::vreg& d = vr[exec.dest];
+            const vector::vreg& a = vr[exec.operand0 & 0x1f];
+            bool wide = exec.ext & 1;
+
+            switch (get_subclass(exec)) {
+                case instruction_type::t_operand_register_all: {
+                    if (exec.id - 0x90 >= vector::vo_count) return true;
+                    vector::lane l = (exec.ext & 2) ? vector::vl_f32 : (vector::lane)exec.operand_size;
+                    vector::execute((vector::op)(exec.id - 0x90), l, exec.operand_sign, wide, d, a, vr[exec.operand1 & 0x1f]);
+                } return true;
+
+                case instruction_type::d_operand_register_all: {
+                    size_t lane = decoder::get_operand_sizeof(exec.operand_size);
+                    switch (exec.id) {
+                        case 0x90: { d = a; } break;
+                        case 0x91: {
+                            u64 v = operand0_r;
+                            for (size_t i = 0; i < 32; i += lane) std::memcpy(d.b + i, &v, lane);
+                        } break;
+                        case 0x92: { u64 v = 0; std::memcpy(&v, a.b, lane); dest_r = v; } return true;
+                    }
+                    if (!wide) std::memset(d.b + 16, 0, 16);
+                } return true;
+            }
+            return false;
+        }
+
         // ALU operation s_operand_register overload
         void alu_op(u64& d, std::function<u64(u64&)>& op, size_t operand_size, bool sign) {
             d = op(d);
@@ -184,8 +456,31 @@ namespace machine {
                 step = true;
                 stepping_enabled = true;
         #endif
+                publish();
         };
 
+        // Publish a consistent copy of the architectural state
+        // Only the thread running this CPU may call this
+        void publish() {
+            state s;
+            s.gpr = gpr;
+            s.fpr = fpr;
+            s.pc = pc;
+            s.sp = sp;
+            s.pci = pci;
+            s.cycles = cycles;
+            s.sr = sr;
+            s.halted = is_halted;
+            published.store(s);
+        }
+
+        // Read the last published state, safe from any thread
+        // Returns a sequence number that changes on every publish
+        u64 get_state(state& s) const { return published.load(s); }
+
+        // Sequence number of the last published state
+        u64 get_state_sequence() const { return published.get_sequence(); }
+
         // Get Stack Pointer
         u64& get_sp() { return sp; }
 
@@ -194,6 +489,9 @@ namespace machine {
 
         // Get FPRs array
         fpr_array_t& get_fpr_array() { return fpr; }
+
+        // Get vector registers array
+        vector::vreg_array_t& get_vr_array() { return vr; }
     
         // Get Program Counter
         u64& get_pc() { return pc; }
@@ -210,14 +508,73 @@ namespace machine {
         // Query whether the CPU is halted or not
         bool& cpu_halted() { return is_halted; }
 
+        // Make the CPU loop return after its current quantum, safe from any thread
+        // Wait for the loop's thread before tearing down what it writes to
+        void request_stop() {
+            stop_requested.store(true, std::memory_order_relaxed);
+#ifdef CPU_STEPPING_ENABLED
+            stepping_enabled = false;
+            step = false;
+#endif
+        }
+
+        bool stopping() const { return stop_requested.load(std::memory_order_relaxed); }
+
         // Get a pointer to the execution state struct
         decoder::instruction* get_execution_state() { return &exec; }
 
+#ifdef CPU_TRACE_ENABLED
+        // Attach an instruction tracer, pass nullptr to detach
+        void attach_tracer(trace::buffer* t) { tracer = t; }
+
+        // Get the attached instruction tracer
+        trace::buffer* get_tracer() { return tracer; }
+#endif
+
+#ifdef CPU_CACHE_MODEL_ENABLED
+        // Attach a cache hierarchy model, pass nullptr to detach
+        void attach_cache_model(cache::hierarchy* h) { cache_model = h; }
+#endif
+
+        // Route interrupts from an interrupt controller to this CPU
+        void attach_interrupt_controller(pic* p) { irq_controller = p; }
+
+        // Drive a scheduler's machine time with this CPU's retired instructions
+        void attach_scheduler(scheduler* s) { events = s; }
+        scheduler* get_scheduler() { return events; }
+
+        // Pace this CPU with a speed governor
+        void attach_governor(governor* g) { speed = g; }
+        governor* get_governor() { return speed; }
+
+        // Count cycles with a timing model, the guest reads them with rdcyc
+        void attach_timing_model(timing::model* t) { timing = t; }
+        u64 get_cycles() const { return cycles; }
+
+        // Count events into a PMU bank
+        void attach_pmu(pmu::bank* b) { counters = b; }
+
+        // Take a pending interrupt, call between instructions
+        // Pushes the PC, clears the IRQ flag and jumps to the controller's vector
+        inline void check_interrupts() {
+            if (!irq_controller || !test_flag(flags::tf) || !irq_controller->get_active()) return;
+
+            store(sp, pc, 8);
+            sp -= 8;
+            reset_flags(flags::tf);
+            pc = irq_controller->get_vector();
+        }
+
         // Read an instruction from the bus and decode it
         void fetch_decode() {
-            exec.opcode = bus::read(pc, 8);
-            exec.ext64 = bus::read(pc+8, 2);
+            exec.opcode = bus::fetch(pc, 8);
+            exec.ext64 = bus::fetch(pc+8, 2);
             pci = decoder::decode(exec);
+            if (counting()) counters->add(pmu::ev_decodes);
+
+#ifdef CPU_CACHE_MODEL_ENABLED
+            if (cache_model) cache_model->fetch(pc, pci);
+#endif
         }
 
         // Execute the decoded instruction
@@ -226,31 +583,51 @@ namespace machine {
 
 #ifdef CPU_STEPPING_ENABLED
             if (stepping_enabled) { step = true; }
-            while (step) {}
+            if (step) {
+                TIMELINE_SCOPE("cpu_step_wait");
+                publish();
+                while (step) {}
+            }
 #endif
 
-            bool jump = false;
-            if (!is_executed()) { goto end; }
+#ifdef CPU_TRACE_ENABLED
+            u64 ipc = pc;
+            trace_rec.flags = 0;
+#endif
+
+            bool jump = false, executed = is_executed();
+            u64 start_cycles = cycles;
+            if (!executed) {
+#ifdef CPU_TRACE_ENABLED
+                trace_rec.flags = trace::rf_skipped;
+#endif
+                goto end;
+            }
 
             switch (get_class(exec)) {
                 case instruction_type::sys: {
                     switch (get_subclass(exec)) {
                         case instruction_type::s_operand_register: {
                             switch (exec.id) {
-                                case 0xfd: { size_t op = decoder::get_operand_sizeof(exec.operand_size); bus::write(sp, dest_r, op); sp += op; } break;
-                                case 0xfc: { size_t op = decoder::get_operand_sizeof(exec.operand_size); sp -= op; dest_r = bus::read(sp, op); } break;
+                                case 0xfd: { size_t op = decoder::get_operand_sizeof(exec.operand_size); store(sp, dest_r, op); sp += op; } break;
+                                case 0xfc: { size_t op = decoder::get_operand_sizeof(exec.operand_size); sp -= op; dest_r = load(sp, op); } break;
+                                case 0xfb: { dest_r = cycles; } break; // rdcyc
                             }
                         } break;
                         case instruction_type::s_operand_const: {
                             switch (exec.id) {
                                 case 0xff: { jump = true; pc = exec.target; } break; // fj
                                 case 0xfe: { gpr[exec.dest] = exec.target; } break; // lrq
-                                case 0xfd: { size_t op = decoder::get_operand_sizeof(exec.operand_size); bus::write(sp, operand0_c, op); sp += op; } break;
+                                case 0xfd: { size_t op = decoder::get_operand_sizeof(exec.operand_size); store(sp, operand0_c, op); sp += op; } break;
                             }
                         } break;
                         case instruction_type::no_operand: {
                             switch (exec.id) {
                                 case 0xfe: { is_halted = true; } break; // halt
+                                case 0xfd: { is_halted = semihost::call(gpr); } break; // sh
+                                case 0xfb: { jump = true; sp += 8; pc = load(sp, 8); set_flags(flags::tf); } break; // iret
+                                case 0xfa: { set_flags(flags::tf); } break; // ei
+                                case 0xf9: { reset_flags(flags::tf); } break; // di
                             }
                         } break;
                     }
@@ -258,6 +635,7 @@ namespace machine {
 
                 // ALU Instruction Class
                 case instruction_type::alu: {
+                    if (execute_fpu() || execute_vector()) break;
                     switch (get_subclass(exec)) {
                         case instruction_type::t_operand_register_all: {
                             auto func = alu_binary_operation[exec.id % alu_binary_operation.size()];
@@ -328,7 +706,20 @@ namespace machine {
                         case instruction_type::t_operand_register_all: {
                             switch (exec.id) {
                                 case 0x00: { // l{b, w, d, q} %rD, %rS0, %rS1;
-                                    dest_r = bus::read(operand0_r + operand1_r, decoder::get_operand_sizeof(exec.operand_size));
+                                    dest_r = load(operand0_r + operand1_r, decoder::get_operand_sizeof(exec.operand_size));
+                                } break;
+                                case 0x80: { // fld %fD, %rS0, %rS1;
+                                    fpr[exec.dest] = fpu::from_bits(load(operand0_r + operand1_r, 4));
+                                } break;
+                                case 0x81: { // fst %fD, %rS0, %rS1;
+                                    store(operand0_r + operand1_r, fpu::to_bits(fpr[exec.dest]), 4);
+                                } break;
+                                case 0x90: { // vld %vD, %rS0, %rS1;
+                                    load_block(operand0_r + operand1_r, vr[exec.dest].b, (exec.ext & 1) ? 32 : 16);
+                                    if (!(exec.ext & 1)) std::memset(vr[exec.dest].b + 16, 0, 16);
+                                } break;
+                                case 0x91: { // vst %vD, %rS0, %rS1;
+                                    store_block(operand0_r + operand1_r, vr[exec.dest].b, (exec.ext & 1) ? 32 : 16);
                                 } break;
                             }
                         } break;
@@ -336,15 +727,28 @@ namespace machine {
                         case instruction_type::t_operand_single_const: {
                             switch (exec.id) {
                                 case 0x00: {
-                                    dest_r = bus::read(operand0_r + operand1_c, decoder::get_operand_sizeof(exec.operand_size));
+                                    dest_r = load(operand0_r + operand1_c, decoder::get_operand_sizeof(exec.operand_size));
+                                } break;
+                                case 0x80: { // fld %fD, %rS0, #const;
+                                    fpr[exec.dest] = fpu::from_bits(load(operand0_r + operand1_c, 4));
+                                } break;
+                                case 0x81: { // fst %fD, %rS0, #const;
+                                    store(operand0_r + operand1_c, fpu::to_bits(fpr[exec.dest]), 4);
+                                } break;
+                                case 0x90: { // vld %vD, %rS0, #const;
+                                    load_block(operand0_r + operand1_c, vr[exec.dest].b, (exec.ext & 1) ? 32 : 16);
+                                    if (!(exec.ext & 1)) std::memset(vr[exec.dest].b + 16, 0, 16);
+                                } break;
+                                case 0x91: { // vst %vD, %rS0, #const;
+                                    store_block(operand0_r + operand1_c, vr[exec.dest].b, (exec.ext & 1) ? 32 : 16);
                                 } break;
                             }
                         } break;
 
                         case instruction_type::d_operand_register_all: {
                             switch (exec.id) {
-                                case 0x0: { dest_r = bus::read(operand0_r, decoder::get_operand_sizeof(exec.operand_size)); } break;
-                                case 0x1: { bus::write(operand0_r, dest_r, decoder::get_operand_sizeof(exec.operand_size)); } break;
+                                case 0x0: { dest_r = load(operand0_r, decoder::get_operand_sizeof(exec.operand_size)); } break;
+                                case 0x1: { store(operand0_r, dest_r, decoder::get_operand_sizeof(exec.operand_size)); } break;
                                 case 0x2: { dest_r = operand0_r; } break;
                             }
                         } break;
@@ -374,13 +778,13 @@ namespace machine {
                                 } break;
                                 case 0xd0: { // push %rD;
                                     size_t size = decoder::get_operand_sizeof(exec.operand_size);
-                                    bus::write(sp, dest_r, size);
+                                    store(sp, dest_r, size);
                                     sp -= size;
                                 } break;
                                 case 0xd1: { // pop %rD;
                                     size_t size = decoder::get_operand_sizeof(exec.operand_size);
                                     sp += size;
-                                    dest_r = bus::read(sp, size);
+                                    dest_r = load(sp, size);
                                 } break;
                             }
                         }
@@ -399,7 +803,7 @@ namespace machine {
                                 } break;
                                 // call %rD
                                 case 0xfe: {
-                                    bus::write(sp, pc+3, 8);
+                                    store(sp, pc+3, 8);
                                     sp -= 8;
                                     pc = dest_r;
                                 } break;
@@ -414,7 +818,7 @@ namespace machine {
                                 } break;
                                 // call #const
                                 case 0xfe: {
-                                    bus::write(sp, pc+3+decoder::get_operand_sizeof(exec.operand_size), 8);
+                                    store(sp, pc+3+decoder::get_operand_sizeof(exec.operand_size), 8);
                                     sp -= 8;
                                     pc = operand0_c;
                                 } break;
@@ -426,7 +830,7 @@ namespace machine {
                             switch (exec.id) {
                                 case 0xff: {
                                     sp += 8;
-                                    pc = bus::read(sp, 8);
+                                    pc = load(sp, 8);
                                 } break;
                             }
                         }
@@ -435,6 +839,15 @@ namespace machine {
             }
 
         end:
+            if (timing) cycles += timing->instruction(exec, executed);
+            if (counting()) {
+                counters->add(pmu::ev_instructions);
+                counters->add(pmu::ev_cycles, cycles - start_cycles);
+                if (executed && (get_class(exec) == instruction_type::bnj)) counters->add(pmu::ev_branches);
+            }
+#ifdef CPU_TRACE_ENABLED
+            if (tracer) retire(ipc);
+#endif
             if (!jump) pc += pci; else jump = false;
         }
     };
@@ -1,30 +1,82 @@
 #pragma once
 
 #include "cpu.hpp"
+#include "../timeline.hpp"
+#include "../perf.hpp"
+
+#include <chrono>
+
+// Instructions executed per timeline event
+#define CPU_LOOP_QUANTUM 0x1000
+
+// Minimum time between architectural state publications
+#define CPU_PUBLISH_INTERVAL std::chrono::milliseconds(16)
 
 void cpu_loop(machine::cpu* proc) {
+    TIMELINE_THREAD(proc->get_name().c_str());
+#ifdef PERF_COUNTERS_ENABLED
+    machine::perf::set_thread_name(proc->get_name());
+#endif
+
 #ifdef A64_DEBUG
     auto exec = proc->get_execution_state();
 #endif
 
-    while (!proc->cpu_halted()) {
-        proc->fetch_decode();
+    // Full IEEE 754 subnormal handling for the guest's float instructions
+    machine::fpu::init_thread();
+
+    auto last_publish = std::chrono::steady_clock::now();
+    machine::scheduler* events = proc->get_scheduler();
+    machine::governor* speed = proc->get_governor();
+
+    while (!proc->cpu_halted() && !proc->stopping()) {
+        TIMELINE_SCOPE("cpu_loop");
+
+        size_t i = 0, quantum = speed ? speed->get_quantum(CPU_LOOP_QUANTUM) : CPU_LOOP_QUANTUM;
+        for (; (i < quantum) && !proc->cpu_halted(); i++) {
+            proc->check_interrupts();
+            proc->fetch_decode();
 
-        #ifdef A64_DEBUG
-        std::cout << "memory[pc] = 0x" << std::hex << exec->opcode << std::endl;
-        #endif
-        proc->execute();
+            #ifdef A64_DEBUG
+            std::cout << "memory[pc] = 0x" << std::hex << exec->opcode << std::endl;
+            #endif
+            proc->execute();
+            if (events) events->tick();
 
-        #ifdef A64_DEBUG
+            #ifdef A64_DEBUG
 
-        std::cout << "sr = 0b" << machine::bin(proc->get_sr()) << std::endl;
-        std::cout << "pc = 0x" << std::hex << proc->get_pc() << std::endl << std::endl;
-        std::cout << "pci = 0x" << std::hex << proc->get_pci() << std::endl << std::endl;
+            std::cout << "sr = 0b" << machine::bin(proc->get_sr()) << std::endl;
+            std::cout << "pc = 0x" << std::hex << proc->get_pc() << std::endl << std::endl;
+            std::cout << "pci = 0x" << std::hex << proc->get_pci() << std::endl << std::endl;
 
-        //system("pause");
-        system("clear");
-        #endif
+            //system("pause");
+            system("clear");
+            #endif
+        }
+
+#ifdef PERF_COUNTERS_ENABLED
+        machine::perf::count_instructions(i);
+#endif
+
+        if (speed) speed->end_quantum(i);
+
+        // Publish state for the debugger at a bounded rate
+        auto now = std::chrono::steady_clock::now();
+        if ((now - last_publish) >= CPU_PUBLISH_INTERVAL) {
+            proc->publish();
+            last_publish = now;
+        }
     }
 
+    proc->publish();
+
+#ifdef CPU_TRACE_ENABLED
+    // Flush the last N instructions before the halt
+    if (auto tracer = proc->get_tracer()) {
+        proc->attach_tracer(nullptr);
+        tracer->close();
+    }
+#endif
+
     std::cout << "cpu" << proc->get_thread_id() << " was halted!\n";
 }
\ No newline at end of file
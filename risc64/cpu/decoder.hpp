@@ -100,6 +100,46 @@ namespace machine {
             return i.type & 0x3;
         }
 
+        // Check whether an instruction writes to its destination GPR
+        static inline bool writes_dest(instruction& i) {
+            switch (get_class(i)) {
+                case instruction_type::alu: {
+                    // FPU instructions write FPRs, except conversions and moves to GPRs
+                    if (((i.id & 0xf0) == 0x80) && ((get_subclass(i) == instruction_type::t_operand_register_all) || (get_subclass(i) == instruction_type::d_operand_register_all))) {
+                        return (get_subclass(i) == instruction_type::d_operand_register_all) && ((i.id == 0x86) || (i.id == 0x87));
+                    }
+                    // Vector instructions write vector registers, except vmovr
+                    if (((i.id & 0xf0) == 0x90) && ((get_subclass(i) == instruction_type::t_operand_register_all) || (get_subclass(i) == instruction_type::d_operand_register_all))) {
+                        return (get_subclass(i) == instruction_type::d_operand_register_all) && (i.id == 0x92);
+                    }
+                    switch (get_subclass(i)) {
+                        case instruction_type::d_operand_register_all:
+                        case instruction_type::d_operand_single_const: return i.id < 0xc; // cmp and test only set flags
+                        case instruction_type::s_operand_const: return false;
+                    }
+                    return true;
+                }
+                case instruction_type::lsu: {
+                    switch (get_subclass(i)) {
+                        case instruction_type::t_operand_register_all:
+                        case instruction_type::t_operand_single_const: return i.id == 0x0;
+                        case instruction_type::d_operand_register_all: return (i.id == 0x0) || (i.id == 0x2);
+                        case instruction_type::d_operand_single_const: return i.id == 0x2;
+                        case instruction_type::s_operand_register: return i.id == 0xd1;
+                    }
+                    return false;
+                }
+                case instruction_type::sys: {
+                    switch (get_subclass(i)) {
+                        case instruction_type::s_operand_register: return (i.id == 0xfc) || (i.id == 0xfb);
+                        case instruction_type::s_operand_const: return i.id == 0xfe;
+                    }
+                    return false;
+                }
+            }
+            return false;
+        }
+
         // Decode special-case instructions that have a 64-bit immediate as operand
         static inline std::size_t decode_imm64_instructions(instruction& i) {
             if (get_class(i) == instruction_type::sys) {
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstring>
+#include <limits>
+#include <cmath>
+
+#include "../aliases.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+    #include <immintrin.h>
+    #define FPU_SSE
+#endif
+
+namespace machine {
+    // Single precision FPU operations for the fpr file
+    // Arithmetic rounds to nearest even (the host default, never changed).
+    // Exceptions are masked and produce the IEEE 754 default results, any NaN
+    // result is the canonical quiet NaN 0x7fc00000 so guests see the same bits
+    // on every host. Conversions to integers truncate, saturate out of range
+    // values and turn NaN into 0.
+    // NaNs are detected from the bits, the emulator is built with -Ofast.
+    // -Ofast also starts the process with flush-to-zero and denormals-are-zero
+    // set, init_thread() clears them so subnormals survive on CPU threads
+    namespace fpu {
+        // Call on every thread that runs guest FPU or vector instructions
+        inline void init_thread() {
+#ifdef FPU_SSE
+            // MXCSR bit 15 is FTZ, bit 6 is DAZ
+            _mm_setcsr(_mm_getcsr() & ~0x8040u);
+#endif
+        }
+
+        inline u32 to_bits(float f) { u32 v; std::memcpy(&v, &f, 4); return v; }
+        inline float from_bits(u32 v) { float f; std::memcpy(&f, &v, 4); return f; }
+
+        inline bool is_nan(float f) { return (to_bits(f) & 0x7fffffff) > 0x7f800000; }
+
+        inline float canonical(float f) { return is_nan(f) ? from_bits(0x7fc00000) : f; }
+
+#ifdef FPU_SSE
+        #define FPU_SSE_OP(name, op) \
+            inline float name(float a, float b) { return canonical(_mm_cvtss_f32(op(_mm_set_ss(a), _mm_set_ss(b)))); }
+
+        FPU_SSE_OP(add, _mm_add_ss)
+        FPU_SSE_OP(sub, _mm_sub_ss)
+        FPU_SSE_OP(mul, _mm_mul_ss)
+        FPU_SSE_OP(div, _mm_div_ss)
+        #undef FPU_SSE_OP
+
+        inline float sqrt(float a) { return canonical(_mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ss(a)))); }
+#else
+        inline float add(float a, float b) { return canonical(a + b); }
+        inline float sub(float a, float b) { return canonical(a - b); }
+        inline float mul(float a, float b) { return canonical(a * b); }
+        inline float div(float a, float b) { return canonical(a / b); }
+        inline float sqrt(float a) { return canonical(std::sqrt(a)); }
+#endif
+
+        // a * b + c with a single rounding
+        inline float fma(float a, float b, float c) {
+#if defined(FPU_SSE) && defined(__FMA__)
+            return canonical(_mm_cvtss_f32(_mm_fmadd_ss(_mm_set_ss(a), _mm_set_ss(b), _mm_set_ss(c))));
+#else
+            return canonical(std::fma(a, b, c));
+#endif
+        }
+
+        // NaN if either operand is NaN
+        inline float min(float a, float b) { return (is_nan(a) || is_nan(b)) ? from_bits(0x7fc00000) : ((b < a) ? b : a); }
+        inline float max(float a, float b) { return (is_nan(a) || is_nan(b)) ? from_bits(0x7fc00000) : ((b > a) ? b : a); }
+
+        inline s64 to_int(float a) {
+            if (is_nan(a)) return 0;
+            if (a >= 9223372036854775808.0f) return std::numeric_limits<s64>::max();
+            if (a < -9223372036854775808.0f) return std::numeric_limits<s64>::min();
+            return (s64)a;
+        }
+
+        inline u64 to_uint(float a) {
+            if (is_nan(a) || (a <= 0.0f)) return 0;
+            if (a >= 18446744073709551616.0f) return std::numeric_limits<u64>::max();
+            return (u64)a;
+        }
+    }
+}
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <type_traits>
+#include <cstring>
+#include <string>
+#include <array>
+
+#include "../aliases.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+    #include <immintrin.h>
+    #define VECTOR_SSE2
+#endif
+
+// AVX2 kernels are compiled per function and only used if the host has AVX2
+#if defined(VECTOR_SSE2) && (defined(__GNUC__) || defined(__clang__))
+    #define VECTOR_AVX2
+    #define VECTOR_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace machine {
+    // Packed SIMD extension
+    // 32 256-bit vector registers, operations work on 128 or 256 bits of
+    // integer lanes (8/16/32/64-bit) or single precision float lanes. Every
+    // operation has a scalar kernel, SSE2 and AVX2 kernels replace them where
+    // the host has a matching instruction. The kernel tables are picked once
+    // at startup by select()
+    namespace vector {
+        struct alignas(32) vreg {
+            u8 b[32];
+        };
+
+        typedef std::array <vreg, 32> vreg_array_t;
+
+        enum op {
+            vo_add, vo_sub, vo_mul, vo_min, vo_max,
+            vo_cmpeq, vo_cmpgt, // Lanes become all ones when true, zero otherwise
+            vo_and, vo_or, vo_xor,
+            vo_shuf,            // d.lane[i] = a.lane[b.lane[i] % lanes]
+            vo_count
+        };
+
+        // Lane types, the decoder's operand sizes followed by float
+        enum lane {
+            vl_8, vl_16, vl_32, vl_64, vl_f32,
+            vl_count
+        };
+
+        // d = a op b over n bytes (16 or 32), d may alias a or b
+        typedef void (*kernel_t)(u8* d, const u8* a, const u8* b, size_t n);
+
+        // [op][lane][signed]
+        typedef std::array <std::array <std::array <kernel_t, 2>, vl_count>, vo_count> table_t;
+
+        namespace detail {
+            // Scalar kernels, also the reference semantics
+            // Float min/max return b when either lane is NaN, like the SSE instructions
+            template <class T, class F> void scalar(u8* d, const u8* a, const u8* b, size_t n, F f) {
+                T x[32 / sizeof(T)], y[32 / sizeof(T)];
+                std::memcpy(x, a, n);
+                std::memcpy(y, b, n);
+                for (size_t i = 0; i < n / sizeof(T); i++) x[i] = f(x[i], y[i]);
+                std::memcpy(d, x, n);
+            }
+
+            template <class T> T mask_of(bool v) {
+                if constexpr (std::is_same_v<T, float>) { u32 m = v ? ~0u : 0; float f; std::memcpy(&f, &m, 4); return f; }
+                else return v ? (T)~(T)0 : (T)0;
+            }
+
+            // Type integer lane arithmetic is done in, unsigned so it wraps
+            // (promoted past int so 16-bit multiplies can't overflow either)
+            template <class T> struct wrap { typedef std::conditional_t<(sizeof(T) < sizeof(unsigned)), unsigned, std::make_unsigned_t<T>> type; };
+            template <> struct wrap <float> { typedef float type; };
+            template <class T> using wrap_t = typename wrap<T>::type;
+
+            template <class T> void scalar_kernels(table_t& t, lane l, bool sign) {
+                #define VECTOR_SCALAR(o, expr) \
+                    t[o][l][sign] = [] (u8* d, const u8* a, const u8* b, size_t n) { scalar<T>(d, a, b, n, [] (T x, T y) -> T { return expr; }); };
+
+                // Integer add/sub/mul wrap in the unsigned type, signed overflow is UB
+                VECTOR_SCALAR(vo_add, (T)((wrap_t<T>)x + (wrap_t<T>)y))
+                VECTOR_SCALAR(vo_sub, (T)((wrap_t<T>)x - (wrap_t<T>)y))
+                VECTOR_SCALAR(vo_mul, (T)((wrap_t<T>)x * (wrap_t<T>)y))
+                VECTOR_SCALAR(vo_min, (x < y) ? x : y)
+                VECTOR_SCALAR(vo_max, (x > y) ? x : y)
+                VECTOR_SCALAR(vo_cmpeq, mask_of<T>(x == y))
+                VECTOR_SCALAR(vo_cmpgt, mask_of<T>(x > y))
+                #undef VECTOR_SCALAR
+            }
+
+            // Bitwise operations and shuffles don't depend on the lane's signedness or type
+            template <class T> void shuffle(u8* d, const u8* a, const u8* b, size_t n) {
+                T x[32 / sizeof(T)], y[32 / sizeof(T)], r[32 / sizeof(T)];
+                std::memcpy(x, a, n);
+                std::memcpy(y, b, n);
+                size_t lanes = n / sizeof(T);
+                for (size_t i = 0; i < lanes; i++) r[i] = x[(u64)y[i] % lanes];
+                std::memcpy(d, r, n);
+            }
+
+            inline void bitwise(table_t& t) {
+                for (size_t l = 0; l < vl_count; l++) {
+                    for (size_t s = 0; s < 2; s++) {
+                        t[vo_and][l][s] = [] (u8* d, const u8* a, const u8* b, size_t n) { scalar<u64>(d, a, b, n, [] (u64 x, u64 y) { return x & y; }); };
+                        t[vo_or][l][s]  = [] (u8* d, const u8* a, const u8* b, size_t n) { scalar<u64>(d, a, b, n, [] (u64 x, u64 y) { return x | y; }); };
+                        t[vo_xor][l][s] = [] (u8* d, const u8* a, const u8* b, size_t n) { scalar<u64>(d, a, b, n, [] (u64 x, u64 y) { return x ^ y; }); };
+                    }
+                }
+                t[vo_shuf][vl_8][0]   = t[vo_shuf][vl_8][1]   = &shuffle<u8>;
+                t[vo_shuf][vl_16][0]  = t[vo_shuf][vl_16][1]  = &shuffle<u16>;
+                t[vo_shuf][vl_32][0]  = t[vo_shuf][vl_32][1]  = &shuffle<u32>;
+                t[vo_shuf][vl_64][0]  = t[vo_shuf][vl_64][1]  = &shuffle<u64>;
+                t[vo_shuf][vl_f32][0] = t[vo_shuf][vl_f32][1] = &shuffle<u32>;
+            }
+
+            inline table_t make_scalar() {
+                table_t t;
+                scalar_kernels<u8>(t, vl_8, false);   scalar_kernels<s8>(t, vl_8, true);
+                scalar_kernels<u16>(t, vl_16, false); scalar_kernels<s16>(t, vl_16, true);
+                scalar_kernels<u32>(t, vl_32, false); scalar_kernels<s32>(t, vl_32, true);
+                scalar_kernels<u64>(t, vl_64, false); scalar_kernels<s64>(t, vl_64, true);
+                scalar_kernels<float>(t, vl_f32, false);
+                for (size_t o = 0; o < vo_count; o++) t[o][vl_f32][1] = t[o][vl_f32][0];
+                bitwise(t);
+                return t;
+            }
+
+#ifdef VECTOR_SSE2
+            // SSE2 kernels, 16 bytes per step so they serve both widths
+            #define VECTOR_SSE2_INT(name, expr) \
+                inline void name(u8* d, const u8* a, const u8* b, size_t n) { \
+                    for (size_t i = 0; i < n; i += 16) { \
+                        __m128i x = _mm_loadu_si128((const __m128i*)(a + i)), y = _mm_loadu_si128((const __m128i*)(b + i)); \
+                        _mm_storeu_si128((__m128i*)(d + i), expr); \
+                    } \
+                }
+            #define VECTOR_SSE2_FLOAT(name, expr) \
+                inline void name(u8* d, const u8* a, const u8* b, size_t n) { \
+                    for (size_t i = 0; i < n; i += 16) { \
+                        __m128 x = _mm_loadu_ps((const float*)(a + i)), y = _mm_loadu_ps((const float*)(b + i)); \
+                        _mm_storeu_ps((float*)(d + i), expr); \
+                    } \
+                }
+
+            VECTOR_SSE2_INT(sse2_add8,  _mm_add_epi8(x, y))
+            VECTOR_SSE2_INT(sse2_add16, _mm_add_epi16(x, y))
+            VECTOR_SSE2_INT(sse2_add32, _mm_add_epi32(x, y))
+            VECTOR_SSE2_INT(sse2_add64, _mm_add_epi64(x, y))
+            VECTOR_SSE2_INT(sse2_sub8,  _mm_sub_epi8(x, y))
+            VECTOR_SSE2_INT(sse2_sub16, _mm_sub_epi16(x, y))
+            VECTOR_SSE2_INT(sse2_sub32, _mm_sub_epi32(x, y))
+            VECTOR_SSE2_INT(sse2_sub64, _mm_sub_epi64(x, y))
+            VECTOR_SSE2_INT(sse2_mul16, _mm_mullo_epi16(x, y))
+            VECTOR_SSE2_INT(sse2_minu8, _mm_min_epu8(x, y))
+            VECTOR_SSE2_INT(sse2_maxu8, _mm_max_epu8(x, y))
+            VECTOR_SSE2_INT(sse2_mins16, _mm_min_epi16(x, y))
+            VECTOR_SSE2_INT(sse2_maxs16, _mm_max_epi16(x, y))
+            VECTOR_SSE2_INT(sse2_eq8,  _mm_cmpeq_epi8(x, y))
+            VECTOR_SSE2_INT(sse2_eq16, _mm_cmpeq_epi16(x, y))
+            VECTOR_SSE2_INT(sse2_eq32, _mm_cmpeq_epi32(x, y))
+            VECTOR_SSE2_INT(sse2_gts8,  _mm_cmpgt_epi8(x, y))
+            VECTOR_SSE2_INT(sse2_gts16, _mm_cmpgt_epi16(x, y))
+            VECTOR_SSE2_INT(sse2_gts32, _mm_cmpgt_epi32(x, y))
+            VECTOR_SSE2_INT(sse2_and, _mm_and_si128(x, y))
+            VECTOR_SSE2_INT(sse2_or,  _mm_or_si128(x, y))
+            VECTOR_SSE2_INT(sse2_xor, _mm_xor_si128(x, y))
+            VECTOR_SSE2_FLOAT(sse2_addf, _mm_add_ps(x, y))
+            VECTOR_SSE2_FLOAT(sse2_subf, _mm_sub_ps(x, y))
+            VECTOR_SSE2_FLOAT(sse2_mulf, _mm_mul_ps(x, y))
+            VECTOR_SSE2_FLOAT(sse2_minf, _mm_min_ps(x, y))
+            VECTOR_SSE2_FLOAT(sse2_maxf, _mm_max_ps(x, y))
+            VECTOR_SSE2_FLOAT(sse2_eqf,  _mm_cmpeq_ps(x, y))
+            VECTOR_SSE2_FLOAT(sse2_gtf,  _mm_cmpgt_ps(x, y))
+            #undef VECTOR_SSE2_INT
+            #undef VECTOR_SSE2_FLOAT
+
+            inline void set_both(table_t& t, op o, lane l, kernel_t k) { t[o][l][0] = t[o][l][1] = k; }
+
+            inline void overlay_sse2(table_t& t) {
+                set_both(t, vo_add, vl_8, &sse2_add8);   set_both(t, vo_add, vl_16, &sse2_add16);
+                set_both(t, vo_add, vl_32, &sse2_add32); set_both(t, vo_add, vl_64, &sse2_add64);
+                set_both(t, vo_sub, vl_8, &sse2_sub8);   set_both(t, vo_sub, vl_16, &sse2_sub16);
+                set_both(t, vo_sub, vl_32, &sse2_sub32); set_both(t, vo_sub, vl_64, &sse2_sub64);
+                set_both(t, vo_mul, vl_16, &sse2_mul16);
+                t[vo_min][vl_8][0] = &sse2_minu8;  t[vo_max][vl_8][0] = &sse2_maxu8;
+                t[vo_min][vl_16][1] = &sse2_mins16; t[vo_max][vl_16][1] = &sse2_maxs16;
+                set_both(t, vo_cmpeq, vl_8, &sse2_eq8); set_both(t, vo_cmpeq, vl_16, &sse2_eq16); set_both(t, vo_cmpeq, vl_32, &sse2_eq32);
+                t[vo_cmpgt][vl_8][1] = &sse2_gts8; t[vo_cmpgt][vl_16][1] = &sse2_gts16; t[vo_cmpgt][vl_32][1] = &sse2_gts32;
+                for (size_t l = 0; l < vl_count; l++) {
+                    set_both(t, vo_and, (lane)l, &sse2_and);
+                    set_both(t, vo_or, (lane)l, &sse2_or);
+                    set_both(t, vo_xor, (lane)l, &sse2_xor);
+                }
+                set_both(t, vo_add, vl_f32, &sse2_addf); set_both(t, vo_sub, vl_f32, &sse2_subf);
+                set_both(t, vo_mul, vl_f32, &sse2_mulf); set_both(t, vo_min, vl_f32, &sse2_minf);
+                set_both(t, vo_max, vl_f32, &sse2_maxf); set_both(t, vo_cmpeq, vl_f32, &sse2_eqf);
+                set_both(t, vo_cmpgt, vl_f32, &sse2_gtf);
+            }
+#endif
+
+#ifdef VECTOR_AVX2
+            // AVX2 kernels, 256-bit table only (n is always 32)
+            #define VECTOR_AVX2_INT(name, expr) \
+                VECTOR_TARGET_AVX2 inline void name(u8* d, const u8* a, const u8* b, size_t) { \
+                    __m256i x = _mm256_loadu_si256((const __m256i*)a), y = _mm256_loadu_si256((const __m256i*)b); \
+                    _mm256_storeu_si256((__m256i*)d, expr); \
+                }
+            #define VECTOR_AVX2_FLOAT(name, expr) \
+                VECTOR_TARGET_AVX2 inline void name(u8* d, const u8* a, const u8* b, size_t) { \
+                    __m256 x = _mm256_loadu_ps((const float*)a), y = _mm256_loadu_ps((const float*)b); \
+                    _mm256_storeu_ps((float*)d, expr); \
+                }
+
+            VECTOR_AVX2_INT(avx2_add8,  _mm256_add_epi8(x, y))
+            VECTOR_AVX2_INT(avx2_add16, _mm256_add_epi16(x, y))
+            VECTOR_AVX2_INT(avx2_add32, _mm256_add_epi32(x, y))
+            VECTOR_AVX2_INT(avx2_add64, _mm256_add_epi64(x, y))
+            VECTOR_AVX2_INT(avx2_sub8,  _mm256_sub_epi8(x, y))
+            VECTOR_AVX2_INT(avx2_sub16, _mm256_sub_epi16(x, y))
+            VECTOR_AVX2_INT(avx2_sub32, _mm256_sub_epi32(x, y))
+            VECTOR_AVX2_INT(avx2_sub64, _mm256_sub_epi64(x, y))
+            VECTOR_AVX2_INT(avx2_mul16, _mm256_mullo_epi16(x, y))
+            VECTOR_AVX2_INT(avx2_mul32, _mm256_mullo_epi32(x, y))
+            VECTOR_AVX2_INT(avx2_minu8,  _mm256_min_epu8(x, y))
+            VECTOR_AVX2_INT(avx2_minu16, _mm256_min_epu16(x, y))
+            VECTOR_AVX2_INT(avx2_minu32, _mm256_min_epu32(x, y))
+            VECTOR_AVX2_INT(avx2_mins8,  _mm256_min_epi8(x, y))
+            VECTOR_AVX2_INT(avx2_mins16, _mm256_min_epi16(x, y))
+            VECTOR_AVX2_INT(avx2_mins32, _mm256_min_epi32(x, y))
+            VECTOR_AVX2_INT(avx2_maxu8,  _mm256_max_epu8(x, y))
+            VECTOR_AVX2_INT(avx2_maxu16, _mm256_max_epu16(x, y))
+            VECTOR_AVX2_INT(avx2_maxu32, _mm256_max_epu32(x, y))
+            VECTOR_AVX2_INT(avx2_maxs8,  _mm256_max_epi8(x, y))
+            VECTOR_AVX2_INT(avx2_maxs16, _mm256_max_epi16(x, y))
+            VECTOR_AVX2_INT(avx2_maxs32, _mm256_max_epi32(x, y))
+            VECTOR_AVX2_INT(avx2_eq8,  _mm256_cmpeq_epi8(x, y))
+            VECTOR_AVX2_INT(avx2_eq16, _mm256_cmpeq_epi16(x, y))
+            VECTOR_AVX2_INT(avx2_eq32, _mm256_cmpeq_epi32(x, y))
+            VECTOR_AVX2_INT(avx2_eq64, _mm256_cmpeq_epi64(x, y))
+            VECTOR_AVX2_INT(avx2_gts8,  _mm256_cmpgt_epi8(x, y))
+            VECTOR_AVX2_INT(avx2_gts16, _mm256_cmpgt_epi16(x, y))
+            VECTOR_AVX2_INT(avx2_gts32, _mm256_cmpgt_epi32(x, y))
+            VECTOR_AVX2_INT(avx2_gts64, _mm256_cmpgt_epi64(x, y))
+            VECTOR_AVX2_INT(avx2_and, _mm256_and_si256(x, y))
+            VECTOR_AVX2_INT(avx2_or,  _mm256_or_si256(x, y))
+            VECTOR_AVX2_INT(avx2_xor, _mm256_xor_si256(x, y))
+            VECTOR_AVX2_FLOAT(avx2_addf, _mm256_add_ps(x, y))
+            VECTOR_AVX2_FLOAT(avx2_subf, _mm256_sub_ps(x, y))
+            VECTOR_AVX2_FLOAT(avx2_mulf, _mm256_mul_ps(x, y))
+            VECTOR_AVX2_FLOAT(avx2_minf, _mm256_min_ps(x, y))
+            VECTOR_AVX2_FLOAT(avx2_maxf, _mm256_max_ps(x, y))
+            VECTOR_AVX2_FLOAT(avx2_eqf,  _mm256_cmp_ps(x, y, _CMP_EQ_OQ))
+            VECTOR_AVX2_FLOAT(avx2_gtf,  _mm256_cmp_ps(x, y, _CMP_GT_OQ))
+            #undef VECTOR_AVX2_INT
+            #undef VECTOR_AVX2_FLOAT
+
+            inline void overlay_avx2(table_t& t) {
+                set_both(t, vo_add, vl_8, &avx2_add8);   set_both(t, vo_add, vl_16, &avx2_add16);
+                set_both(t, vo_add, vl_32, &avx2_add32); set_both(t, vo_add, vl_64, &avx2_add64);
+                set_both(t, vo_sub, vl_8, &avx2_sub8);   set_both(t, vo_sub, vl_16, &avx2_sub16);
+                set_both(t, vo_sub, vl_32, &avx2_sub32); set_both(t, vo_sub, vl_64, &avx2_sub64);
+                set_both(t, vo_mul, vl_16, &avx2_mul16); set_both(t, vo_mul, vl_32, &avx2_mul32);
+                t[vo_min][vl_8][0] = &avx2_minu8;  t[vo_min][vl_16][0] = &avx2_minu16; t[vo_min][vl_32][0] = &avx2_minu32;
+                t[vo_min][vl_8][1] = &avx2_mins8;  t[vo_min][vl_16][1] = &avx2_mins16; t[vo_min][vl_32][1] = &avx2_mins32;
+                t[vo_max][vl_8][0] = &avx2_maxu8;  t[vo_max][vl_16][0] = &avx2_maxu16; t[vo_max][vl_32][0] = &avx2_maxu32;
+                t[vo_max][vl_8][1] = &avx2_maxs8;  t[vo_max][vl_16][1] = &avx2_maxs16; t[vo_max][vl_32][1] = &avx2_maxs32;
+                set_both(t, vo_cmpeq, vl_8, &avx2_eq8);   set_both(t, vo_cmpeq, vl_16, &avx2_eq16);
+                set_both(t, vo_cmpeq, vl_32, &avx2_eq32); set_both(t, vo_cmpeq, vl_64, &avx2_eq64);
+                t[vo_cmpgt][vl_8][1] = &avx2_gts8;   t[vo_cmpgt][vl_16][1] = &avx2_gts16;
+                t[vo_cmpgt][vl_32][1] = &avx2_gts32; t[vo_cmpgt][vl_64][1] = &avx2_gts64;
+                for (size_t l = 0; l < vl_count; l++) {
+                    set_both(t, vo_and, (lane)l, &avx2_and);
+                    set_both(t, vo_or, (lane)l, &avx2_or);
+                    set_both(t, vo_xor, (lane)l, &avx2_xor);
+                }
+                set_both(t, vo_add, vl_f32, &avx2_addf); set_both(t, vo_sub, vl_f32, &avx2_subf);
+                set_both(t, vo_mul, vl_f32, &avx2_mulf); set_both(t, vo_min, vl_f32, &avx2_minf);
+                set_both(t, vo_max, vl_f32, &avx2_maxf); set_both(t, vo_cmpeq, vl_f32, &avx2_eqf);
+                set_both(t, vo_cmpgt, vl_f32, &avx2_gtf);
+            }
+#endif
+        }
+
+        // Kernel tables for 128 and 256-bit operations, scalar until select() runs
+        inline table_t kernels[2] = { detail::make_scalar(), detail::make_scalar() };
+
+        inline bool has_avx2() {
+#ifdef VECTOR_AVX2
+            return __builtin_cpu_supports("avx2");
+#else
+            return false;
+#endif
+        }
+
+        // Pick the best kernels the host supports, capped by max ("scalar", "sse2"
+        // or "avx2"), returns the name of the set in use
+        inline std::string select(const std::string& max = "avx2") {
+            kernels[0] = kernels[1] = detail::make_scalar();
+            if (max == "scalar") return "scalar";
+
+#ifdef VECTOR_SSE2
+            detail::overlay_sse2(kernels[0]);
+            detail::overlay_sse2(kernels[1]);
+            if ((max == "sse2") || !has_avx2()) return "sse2";
+    #ifdef VECTOR_AVX2
+            detail::overlay_avx2(kernels[1]);
+    #endif
+            return "avx2";
+#else
+            return "scalar";
+#endif
+        }
+
+        inline void execute(op o, lane l, bool sign, bool wide, vreg& d, const vreg& a, const vreg& b) {
+            size_t n = wide ? 32 : 16;
+            kernels[wide][o][l][sign](d.b, a.b, b.b, n);
+            // 128-bit operations clear the upper half
+            if (!wide) std::memset(d.b + 16, 0, 16);
+        }
+    }
+}
@@ -1,11 +1,15 @@
 #pragma once
 
 #include <utility>
+#include <cstring>
 #include <string>
 
 #include "aliases.hpp"
+#include "symbols.hpp"
 
 namespace machine {
+    namespace heatmap { class region; }
+
     // Hardware device model class
     class device {
     public:
@@ -36,6 +40,20 @@ namespace machine {
 
         // Specify access permissions for the device
         access_mode access = a_none;
+
+        // Bus access counters, nullptr unless the heatmap is enabled
+        heatmap::region* heat = nullptr;
+
+        // Widest read/write the default block transfers issue (1, 2, 4 or 8),
+        // devices with byte-wide registers set 1
+        u8 block_access_size = 8;
+
+        // Largest power of two access that fits in len
+        size_t block_step(u64 len) const {
+            size_t n = block_access_size;
+            while (n > len) n >>= 1;
+            return n;
+        }
     
         device() = default;
         device(
@@ -51,12 +69,50 @@ namespace machine {
         u64 get_size() const { return size; }
         u64 get_hid() const { return hid; }
         u8 get_access_mode() const { return access; }
+        heatmap::region* get_heatmap() const { return heat; }
+        void set_heatmap(heatmap::region* r) { heat = r; }
+
+        // Name of the program symbol covering addr, empty if there's none
+        virtual std::string get_symbol(u64 addr) { return symbols::global.symbolize(addr); };
+
+        // Program the device contents at bus address addr, used by loaders
+        // data == nullptr zero-fills, returns false if the device can't hold the range
+        virtual bool load(u64, const u8*, u64) { return false; };
 
-#ifdef DEBUG    
-        virtual const std::string& get_symbol(u64) { return ""; };
-#endif
         virtual u64 translate(u64 addr) { return addr - base; };
         virtual u64 read(u64, size_t) { return 0xffffffffffffffffull; };
         virtual void write(u64, u64, size_t) {};
+
+        // Host memory backing [addr, addr+len), nullptr if the range isn't
+        // plain memory, lets devices do I/O straight into guest RAM
+        virtual u8* get_host_pointer(u64, u64) { return nullptr; };
+
+        // Whether block transfers on [addr, addr+len) may run on a device
+        // thread (DMA, block I/O) concurrently with the CPU, only plain memory
+        // opts in, register handlers assume they run on the CPU thread
+        virtual bool is_concurrent(u64, u64) { return false; };
+
+        // Block transfers of len bytes at bus address addr
+        // The defaults split the block into naturally sized reads/writes of at
+        // most block_access_size bytes, memory-backed devices override them
+        // with a single copy
+        virtual void read_block(u64 addr, u8* dst, u64 len) {
+            while (len) {
+                size_t n = block_step(len);
+                u64 q = read(addr, n);
+                std::memcpy(dst, &q, n);
+                addr += n; dst += n; len -= n;
+            }
+        };
+
+        virtual void write_block(u64 addr, const u8* src, u64 len) {
+            while (len) {
+                size_t n = block_step(len);
+                u64 q = 0;
+                std::memcpy(&q, src, n);
+                write(addr, q, n);
+                addr += n; src += n; len -= n;
+            }
+        };
     };
 }
\ No newline at end of file
@@ -2,43 +2,220 @@
 
 #include "../aliases.hpp"
 #include "../device.hpp"
+#include "../timeline.hpp"
+#include "../log.hpp"
 
+#include <unordered_map>
+#include <filesystem>
+#include <algorithm>
 #include <fstream>
-#include <array>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <mutex>
+
+#ifdef __linux__
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
 
 namespace machine {
+    // A read-only ROM image file mapped into memory
+    // Every ROM device in the process that loads the same file shares one image
+    class rom_image {
+        const u8* data = nullptr;
+        u64 size = 0;
+
+#ifdef __linux__
+        int fd = -1;
+#else
+        std::vector <u8> contents;
+#endif
+
+        static std::mutex& cache_mutex() { static std::mutex m; return m; }
+        static std::unordered_map <std::string, std::weak_ptr<rom_image>>& cache() {
+            static std::unordered_map <std::string, std::weak_ptr<rom_image>> c;
+            return c;
+        }
+
+        bool map(const std::string& name) {
+#ifdef __linux__
+            fd = ::open(name.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+
+            struct stat st;
+            if (fstat(fd, &st)) return false;
+            size = st.st_size;
+            if (!size) return true;
+
+            void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) return false;
+            data = (const u8*)p;
+#else
+            std::ifstream f(name, std::ios::binary | std::ios::ate);
+            if (!f.is_open()) return false;
+
+            size = f.tellg();
+            contents.resize(size);
+            f.seekg(0);
+            f.read((char*)contents.data(), size);
+            data = contents.data();
+#endif
+            return true;
+        }
+
+    public:
+        rom_image() = default;
+        rom_image(const rom_image&) = delete;
+
+        ~rom_image() {
+#ifdef __linux__
+            if (data) munmap((void*)data, size);
+            if (fd >= 0) ::close(fd);
+#endif
+        }
+
+        const u8* get_data() const { return data; }
+        u64 get_size() const { return size; }
+
+        // Make a private, writable copy-on-write view of the image
+        // Pages that are never written stay shared with the original mapping
+        u8* map_private() const {
+#ifdef __linux__
+            if (!size) return nullptr;
+            void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            return (p == MAP_FAILED) ? nullptr : (u8*)p;
+#else
+            u8* p = new u8[size];
+            std::memcpy(p, data, size);
+            return p;
+#endif
+        }
+
+        void unmap_private(u8* p) const {
+            if (!p) return;
+#ifdef __linux__
+            munmap(p, size);
+#else
+            delete[] p;
+#endif
+        }
+
+        // Open an image, or get the already open one for the same file
+        static std::shared_ptr<rom_image> open(const std::string& name) {
+            std::error_code ec;
+            std::string key = std::filesystem::weakly_canonical(name, ec).string();
+            if (ec) key = name;
+
+            std::lock_guard <std::mutex> lock(cache_mutex());
+
+            if (auto img = cache()[key].lock()) return img;
+
+            auto img = std::make_shared<rom_image>();
+            if (!img->map(name)) return nullptr;
+
+            cache()[key] = img;
+            return img;
+        }
+    };
+
     class bios : public device {
         using device_access = device::access_mode;
-        typedef std::array<u8, 4095> array_t;
 
-        array_t binary = { 0 };
+        std::shared_ptr<rom_image> image;
+
+        // Image bytes visible to the guest, either the shared mapping or
+        // this device's private copy once it has been patched
+        const u8* data = nullptr;
+        u64 data_size = 0;
+        u8* patched = nullptr;
+
+        bool make_private() {
+            if (patched) return true;
+
+            patched = image ? image->map_private() : nullptr;
+            if (!patched) {
+                _log(warning, "Couldn't create a patchable view of the ROM image");
+                return false;
+            }
+            data = patched;
+            return true;
+        }
 
     public:
         bios(std::string name) : device(name, 0ull, 0xfffull, 8u, device_access::a_rx) {}
 
-        array_t& get_binary() { return binary; }
+        ~bios() { if (image) image->unmap_private(patched); }
 
-        void load_binary(const std::string name) {
-            std::ifstream f(name, std::ios::binary);
+        // Map a ROM image, rom_size = 0 sizes the device to the image
+        bool load_binary(const std::string name, u64 rom_base = 0, u64 rom_size = 0) {
+            TIMELINE_SCOPE("bios_load_binary");
 
-            if (!f.is_open()) {
-                // Issue fatal error: couldn't open BIOS
+            auto img = rom_image::open(name);
+            if (!img) {
+                _log(error, "Couldn't open ROM image \"%s\"", name.c_str());
+                return false;
             }
 
-            for (size_t i = 0; (i < binary.size()) && (!f.eof()); i++) {
-                binary[i] = f.get();
+            if (image) image->unmap_private(patched);
+            patched = nullptr;
+
+            image = img;
+            data = image->get_data();
+            data_size = image->get_size();
+
+            base = rom_base;
+            size = rom_size ? rom_size : std::max<u64>(data_size, 1);
+
+            if (data_size > size) {
+                _log(warning, "ROM image \"%s\" is 0x%llx bytes, only the first 0x%llx bytes are mapped", name.c_str(), data_size, size);
+                data_size = size;
             }
 
-            f.close();
+            return true;
+        }
+
+        // Read-only view of the image for the memory editor
+        const u8* get_memory() const { return data; }
+        u64 get_image_size() const { return data_size; }
+
+        // Debugger patch, the first one gives this device a private copy-on-write view
+        void patch(u64 offset, u8 value) {
+            if ((offset >= data_size) || !make_private()) return;
+
+            patched[offset] = value;
+        }
+
+        // Program loaders write through the same copy-on-write view
+        bool load(u64 addr, const u8* src, u64 len) override {
+            addr -= base;
+            if ((addr >= data_size) || (len > data_size - addr) || !make_private()) return false;
+
+            if (src) std::memcpy(patched + addr, src, len);
+            else std::memset(patched + addr, 0, len);
+            return true;
         }
 
         // device-inherited functions
         u64 read(u64 addr, size_t size) override {
+            addr -= base;
+
+            // Bytes past the end of the image read as zero
             u64 q = 0;
-            for (int off = size - 1; off >= 0; off--) {
-                q |= ((u64)binary[addr+off]) << (8 * off);
+            if (addr < data_size) {
+                std::memcpy(&q, data + addr, std::min<u64>(size, data_size - addr));
             }
             return q;
         }
+
+        void read_block(u64 addr, u8* dst, u64 len) override {
+            addr -= base;
+
+            u64 n = (addr < data_size) ? std::min(len, data_size - addr) : 0;
+            if (n) std::memcpy(dst, data + addr, n);
+            std::memset(dst + n, 0, len - n);
+        }
     };
-};
\ No newline at end of file
+};
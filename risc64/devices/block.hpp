@@ -0,0 +1,461 @@
+#pragma once
+
+#include <condition_variable>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+
+#ifdef __linux__
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#include "../aliases.hpp"
+#include "../device.hpp"
+#include "../bus.hpp"
+#include "../timeline.hpp"
+#include "../perf.hpp"
+#include "../log.hpp"
+#include "pic.hpp"
+
+// Sector size of the block device
+#define BLOCK_SECTOR_SIZE 512
+
+// Default number of host I/O threads
+#define BLOCK_IO_THREADS 4
+
+namespace machine {
+    namespace block {
+        // Host file accessed at explicit offsets, safe to use from several threads
+        class host_file {
+#ifdef __linux__
+            int fd = -1;
+#else
+            std::fstream f;
+            std::mutex m;
+#endif
+
+        public:
+            ~host_file() { close(); }
+
+            bool open(const std::string& name, bool writable, bool create = false) {
+#ifdef __linux__
+                fd = ::open(name.c_str(), (writable ? O_RDWR : O_RDONLY) | (create ? O_CREAT : 0), 0644);
+                return fd >= 0;
+#else
+                auto mode = std::ios::binary | std::ios::in | (writable ? std::ios::out : (std::ios::openmode)0);
+                if (create) std::ofstream(name, std::ios::binary | std::ios::app);
+                f.open(name, mode);
+                return f.is_open();
+#endif
+            }
+
+            void close() {
+#ifdef __linux__
+                if (fd >= 0) ::close(fd);
+                fd = -1;
+#else
+                if (f.is_open()) f.close();
+#endif
+            }
+
+            u64 get_size() {
+#ifdef __linux__
+                struct stat st;
+                return fstat(fd, &st) ? 0 : st.st_size;
+#else
+                std::lock_guard <std::mutex> lock(m);
+                f.seekg(0, std::ios::end);
+                return f.tellg();
+#endif
+            }
+
+            // Grow the file without allocating the new blocks (sparse where supported)
+            bool resize(u64 size) {
+#ifdef __linux__
+                return !ftruncate(fd, size);
+#else
+                std::lock_guard <std::mutex> lock(m);
+                f.seekp(size - 1); f.put(0);
+                return f.good();
+#endif
+            }
+
+            // Bytes past the end of the file read as zero
+            bool read_at(u64 offset, u8* dst, u64 len) {
+#ifdef __linux__
+                while (len) {
+                    ssize_t n = pread(fd, dst, len, offset);
+                    if (n < 0) return false;
+                    if (!n) { std::memset(dst, 0, len); return true; }
+                    dst += n; offset += n; len -= n;
+                }
+                return true;
+#else
+                std::lock_guard <std::mutex> lock(m);
+                f.clear();
+                f.seekg(offset);
+                f.read((char*)dst, len);
+                std::memset(dst + f.gcount(), 0, len - f.gcount());
+                return true;
+#endif
+            }
+
+            bool write_at(u64 offset, const u8* src, u64 len) {
+#ifdef __linux__
+                while (len) {
+                    ssize_t n = pwrite(fd, src, len, offset);
+                    if (n <= 0) return false;
+                    src += n; offset += n; len -= n;
+                }
+                return true;
+#else
+                std::lock_guard <std::mutex> lock(m);
+                f.clear();
+                f.seekp(offset);
+                f.write((const char*)src, len);
+                return f.good();
+#endif
+            }
+
+            bool flush() {
+#ifdef __linux__
+                return !fdatasync(fd);
+#else
+                std::lock_guard <std::mutex> lock(m);
+                f.flush();
+                return f.good();
+#endif
+            }
+        };
+
+        // Disk image, optionally with a copy-on-write overlay
+        // The base image is only ever read when an overlay is used, so any number
+        // of machines can share it. Overlay layout: a 4K header, the sector
+        // allocation bitmap padded to 4K, then a sparse copy of the whole disk
+        class image {
+            static constexpr const char* overlay_magic = "R64COW01";
+
+            struct overlay_header {
+                char magic[8];
+                u64 sectors, sector_size;
+            };
+
+            host_file base, overlay;
+            bool has_overlay = false, writable = false;
+
+            u64 sectors = 0, data_offset = 0;
+
+            std::vector <u8> bitmap;
+            std::mutex bitmap_mutex;
+            bool bitmap_dirty = false;
+
+            bool allocated(u64 s) { return bitmap[s >> 3] & (1 << (s & 7)); }
+
+            // Split [sector, sector+count) into runs that live in the same file
+            template <class F> void for_each_run(u64 sector, u64 count, F f) {
+                std::lock_guard <std::mutex> lock(bitmap_mutex);
+                while (count) {
+                    bool a = allocated(sector);
+                    u64 n = 1;
+                    while ((n < count) && (allocated(sector + n) == a)) n++;
+                    f(sector, n, a);
+                    sector += n; count -= n;
+                }
+            }
+
+        public:
+            bool open(const std::string& name, const std::string& overlay_name, bool read_only) {
+                has_overlay = overlay_name.size();
+                writable = !read_only;
+
+                if (!base.open(name, writable && !has_overlay)) {
+                    _log(error, "Couldn't open disk image \"%s\"", name.c_str());
+                    return false;
+                }
+                sectors = base.get_size() / BLOCK_SECTOR_SIZE;
+
+                if (!has_overlay) return true;
+
+                // Read-only disks can use an existing overlay but never create one
+                if (!overlay.open(overlay_name, writable, writable)) {
+                    if (!writable) _log(error, "Overlay image \"%s\" doesn't exist, read-only disks don't create overlays", overlay_name.c_str());
+                    else _log(error, "Couldn't open overlay image \"%s\"", overlay_name.c_str());
+                    return false;
+                }
+
+                u64 bitmap_size = (((sectors + 7) / 8) + 0xfff) & ~0xfffull;
+                data_offset = 0x1000 + bitmap_size;
+                bitmap.assign(bitmap_size, 0);
+
+                overlay_header h;
+                if (overlay.get_size() >= data_offset) {
+                    overlay.read_at(0, (u8*)&h, sizeof(h));
+                    if (std::memcmp(h.magic, overlay_magic, 8) || (h.sectors != sectors) || (h.sector_size != BLOCK_SECTOR_SIZE)) {
+                        _log(error, "Overlay image \"%s\" doesn't belong to \"%s\"", overlay_name.c_str(), name.c_str());
+                        return false;
+                    }
+                    overlay.read_at(0x1000, bitmap.data(), bitmap_size);
+                } else if (!writable) {
+                    _log(error, "Overlay image \"%s\" is incomplete and can't be initialized on a read-only disk", overlay_name.c_str());
+                    return false;
+                } else {
+                    // New overlay, nothing allocated yet
+                    std::memcpy(h.magic, overlay_magic, 8);
+                    h.sectors = sectors;
+                    h.sector_size = BLOCK_SECTOR_SIZE;
+                    if (!overlay.write_at(0, (u8*)&h, sizeof(h)) || !overlay.write_at(0x1000, bitmap.data(), bitmap_size) ||
+                        !overlay.resize(data_offset + sectors * BLOCK_SECTOR_SIZE)) {
+                        _log(error, "Couldn't create overlay image \"%s\"", overlay_name.c_str());
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            u64 get_sectors() const { return sectors; }
+            bool is_writable() const { return writable; }
+
+            bool read(u64 sector, u64 count, u8* dst) {
+                if (!has_overlay) return base.read_at(sector * BLOCK_SECTOR_SIZE, dst, count * BLOCK_SECTOR_SIZE);
+
+                bool ok = true;
+                for_each_run(sector, count, [&](u64 s, u64 n, bool in_overlay) {
+                    u8* p = dst + (s - sector) * BLOCK_SECTOR_SIZE;
+                    ok &= in_overlay ?
+                        overlay.read_at(data_offset + s * BLOCK_SECTOR_SIZE, p, n * BLOCK_SECTOR_SIZE) :
+                        base.read_at(s * BLOCK_SECTOR_SIZE, p, n * BLOCK_SECTOR_SIZE);
+                });
+                return ok;
+            }
+
+            bool write(u64 sector, u64 count, const u8* src) {
+                if (!writable) return false;
+                if (!has_overlay) return base.write_at(sector * BLOCK_SECTOR_SIZE, src, count * BLOCK_SECTOR_SIZE);
+
+                // Whole sectors are copied up, so the base never needs to be read here
+                if (!overlay.write_at(data_offset + sector * BLOCK_SECTOR_SIZE, src, count * BLOCK_SECTOR_SIZE)) return false;
+
+                std::lock_guard <std::mutex> lock(bitmap_mutex);
+                for (u64 s = sector; s < sector + count; s++) bitmap[s >> 3] |= 1 << (s & 7);
+                bitmap_dirty = true;
+                return true;
+            }
+
+            bool flush() {
+                if (!has_overlay) return !writable || base.flush();
+
+                {
+                    std::lock_guard <std::mutex> lock(bitmap_mutex);
+                    if (bitmap_dirty && !overlay.write_at(0x1000, bitmap.data(), bitmap.size())) return false;
+                    bitmap_dirty = false;
+                }
+                return overlay.flush();
+            }
+        };
+    }
+
+    // Paravirtual block storage device
+    // The guest fills a ring of 32-byte requests in RAM and writes the new
+    // producer index to the doorbell register. Requests are read in batches
+    // and serviced by host I/O threads straight into guest RAM, completion
+    // is reported through the used index and one interrupt per batch
+    class block_device : public device {
+        using device_access = device::access_mode;
+
+        // Request operations and completion status
+        enum op { op_read = 0, op_write = 1, op_flush = 2 };
+        enum status { s_ok = 0, s_ioerr = 1, s_unsupported = 2, s_pending = 0xff };
+
+        struct request {
+            u8  op, status;
+            u16 reserved;
+            u32 sectors;
+            u64 sector, buffer, tag;
+        };
+
+        static_assert(sizeof(request) == 32, "Block requests must be 32 bytes");
+
+        // r[0x00] -> ring_base
+        // r[0x08] -> ring_size (entries, power of 2)
+        // r[0x10] -> avail_idx (doorbell, free-running producer index)
+        // r[0x18] -> used_idx (free-running completion count)
+        // r[0x20] -> capacity (sectors)
+        // r[0x28] -> ctrl (bit 0: irq enable, bit 1: read-only, bit 2: ring error, write 1 to clear)
+        // r[0x30] -> sector_size
+        u64 ring_base = 0, ring_size = 0, avail_idx = 0, next_idx = 0;
+        std::atomic<bool> irq = false;
+        bool ring_error = false;
+        std::atomic<u64> used_idx = 0;
+
+        block::image disk;
+        bool attached = false;
+
+        pic* irq_controller = nullptr;
+
+        // Requests of a batch share a counter, the last one to complete raises the interrupt
+        struct job { request r; u64 slot; std::shared_ptr<std::atomic<size_t>> batch; };
+
+        std::deque <job> queue;
+        std::mutex queue_mutex;
+        std::condition_variable queue_cv;
+        std::vector <std::thread> workers;
+        bool running = false;
+
+        // Run a request, buffers in RAM are used directly, anything else is bounced
+        // Workers run concurrently with the CPU, so buffers outside memory fail
+        u8 service(request& r) {
+            if (r.op == op_flush) return disk.flush() ? s_ok : s_ioerr;
+            if ((r.op != op_read) && (r.op != op_write)) return s_unsupported;
+
+            if ((r.sector >= disk.get_sectors()) || (r.sectors > disk.get_sectors() - r.sector)) return s_ioerr;
+
+            u64 len = (u64)r.sectors * BLOCK_SECTOR_SIZE;
+            if (!bus::is_concurrent(r.buffer, len)) return s_ioerr;
+            u8* p = bus::get_host_pointer(r.buffer, len);
+            std::vector <u8> bounce;
+            if (!p) { bounce.resize(len); p = bounce.data(); }
+
+            bool ok;
+            if (r.op == op_read) {
+                TIMELINE_SCOPE("block_read");
+                ok = disk.read(r.sector, r.sectors, p);
+                if (ok && bounce.size()) ok = bus::write_block(r.buffer, p, len);
+            } else {
+                TIMELINE_SCOPE("block_write");
+                if (bounce.size() && !bus::read_block(r.buffer, p, len)) return s_ioerr;
+                ok = disk.write(r.sector, r.sectors, p);
+            }
+            return ok ? s_ok : s_ioerr;
+        }
+
+        void worker_loop(size_t n) {
+            std::string name = "block" + std::to_string(n);
+            TIMELINE_THREAD(name.c_str());
+#ifdef PERF_COUNTERS_ENABLED
+            perf::set_thread_name(name);
+#endif
+            std::unique_lock <std::mutex> lock(queue_mutex);
+            while (true) {
+                queue_cv.wait(lock, [this] { return !running || queue.size(); });
+                if (!running) return;
+
+                job j = std::move(queue.front());
+                queue.pop_front();
+                lock.unlock();
+
+                u8 s = service(j.r);
+                u64 status = j.slot + offsetof(request, status);
+                if (bus::is_concurrent(status, 1)) bus::write_block(status, &s, 1);
+                used_idx.fetch_add(1, std::memory_order_release);
+
+                if ((j.batch->fetch_sub(1, std::memory_order_acq_rel) == 1) && irq && irq_controller) {
+                    irq_controller->raise(irq_block);
+                }
+
+                lock.lock();
+            }
+        }
+
+        // Doorbell, read every new request and queue them as one batch
+        void kick() {
+            TIMELINE_SCOPE("block_kick");
+            if (!attached || !ring_size || (ring_size & (ring_size - 1))) return;
+
+            u64 n = avail_idx - next_idx;
+            if (!n) return;
+
+            // The doorbell skipped past requests that can't be in the ring, drop
+            // them and resync so the next doorbell works, used_idx counts them
+            if (n > ring_size) {
+                _log(warning, "Block ring index jumped by 0x%llx entries (ring size 0x%llx), dropping them", n, ring_size);
+                next_idx = avail_idx;
+                used_idx.fetch_add(n, std::memory_order_release);
+                ring_error = true;
+                if (irq && irq_controller) irq_controller->raise(irq_block);
+                return;
+            }
+
+            auto batch = std::make_shared<std::atomic<size_t>>(n);
+            std::vector <job> jobs;
+            jobs.reserve(n);
+
+            for (; next_idx != avail_idx; next_idx++) {
+                u64 slot = ring_base + (next_idx & (ring_size - 1)) * sizeof(request);
+                job j = { {}, slot, batch };
+                bus::read_block(slot, (u8*)&j.r, sizeof(request));
+                jobs.push_back(j);
+            }
+
+            std::lock_guard <std::mutex> lock(queue_mutex);
+            for (auto& j : jobs) queue.push_back(std::move(j));
+            queue_cv.notify_all();
+        }
+
+    public:
+        block_device(u64 mmio_base, pic* p = nullptr) :
+            device("Block Storage Controller", mmio_base, 0x38, 0xd, device_access::a_rw),
+            irq_controller(p) {};
+
+        ~block_device() { close(); }
+
+        // Attach a disk image, overlay may be empty
+        bool open(const std::string& name, const std::string& overlay = "", bool read_only = false, size_t threads = BLOCK_IO_THREADS) {
+            if (!disk.open(name, overlay, read_only)) return false;
+            attached = true;
+
+            running = true;
+            for (size_t i = 0; i < std::max<size_t>(threads, 1); i++) {
+                workers.emplace_back(&block_device::worker_loop, this, i);
+            }
+            return true;
+        }
+
+        // Stop the I/O threads and flush the image, queued requests are dropped
+        void close() {
+            {
+                std::lock_guard <std::mutex> lock(queue_mutex);
+                if (!running) return;
+                running = false;
+                queue.clear();
+            }
+            queue_cv.notify_all();
+            for (auto& t : workers) t.join();
+            workers.clear();
+            disk.flush();
+        }
+
+        u64 read(u64 addr, size_t) override {
+            switch (addr - base) {
+                case 0x00: return ring_base;
+                case 0x08: return ring_size;
+                case 0x10: return avail_idx;
+                case 0x18: return used_idx.load(std::memory_order_acquire);
+                case 0x20: return disk.get_sectors();
+                case 0x28: return (irq ? 1 : 0) | (disk.is_writable() ? 0 : 2) | (ring_error ? 4 : 0);
+                case 0x30: return BLOCK_SECTOR_SIZE;
+            }
+            return 0xffffffffffffffff;
+        }
+
+        void write(u64 addr, u64 value, size_t) override {
+            switch (addr - base) {
+                case 0x00: ring_base = value; break;
+                case 0x08: ring_size = value; next_idx = avail_idx; break;
+                case 0x10: avail_idx = value; kick(); break;
+                case 0x28: {
+                    irq = value & 1;
+                    if (value & 4) ring_error = false;
+                } break;
+            }
+        }
+    };
+}
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <condition_variable>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <array>
+
+#include "../aliases.hpp"
+#include "../device.hpp"
+#include "../bus.hpp"
+#include "../timeline.hpp"
+#include "../perf.hpp"
+#include "pic.hpp"
+
+// Number of independent DMA channels
+#define DMA_CHANNEL_COUNT 4
+
+// Bounce buffer size for a single bus-to-bus copy
+#define DMA_CHUNK_SIZE 0x10000
+
+namespace machine {
+    // Multi-channel DMA controller, transfers run on a host worker thread
+    // concurrently with the CPU, so they may only touch memory (RAM, VRAM).
+    // Transfers from or to device registers fail with c_error
+    class dma : public device {
+        using device_access = device::access_mode;
+
+        // Channel control/status bits
+        enum ctrl_bits {
+            c_start = 0b0001, // W: start the transfer
+            c_busy  = 0b0001, // R: transfer in progress
+            c_irq   = 0b0010, // RW: raise irq_dma when done
+            c_done  = 0b0100, // R: last transfer finished
+            c_error = 0b1000  // R: last transfer hit an unmapped, protected or register address
+        };
+
+        // A transfer, either programmed through the channel registers or
+        // read from a descriptor in guest memory (same layout, 64 bytes)
+        // Copies count blocks of len bytes, advancing src/dst by their strides
+        struct descriptor {
+            u64 src, dst, len, count, src_stride, dst_stride, next, reserved;
+        };
+
+        static_assert(sizeof(descriptor) == 64, "DMA descriptors must be 64 bytes");
+
+        // Per-channel registers, 0x40 bytes each:
+        // r[0x00] -> src
+        // r[0x08] -> dst
+        // r[0x10] -> len
+        // r[0x18] -> count (0 = 1)
+        // r[0x20] -> src_stride
+        // r[0x28] -> dst_stride
+        // r[0x30] -> desc (guest address of a descriptor chain, 0 = use the registers)
+        // r[0x38] -> ctrl/status
+        struct channel {
+            descriptor regs = {};
+            u64 desc = 0;
+            bool irq = false;
+            std::atomic<u64> status = 0;
+        };
+
+        std::array <channel, DMA_CHANNEL_COUNT> channels;
+
+        pic* irq_controller = nullptr;
+
+        // Started channels waiting for the worker, job snapshots are taken at start
+        struct job { size_t ch; descriptor d; u64 desc; bool irq; };
+        std::deque <job> queue;
+        std::mutex queue_mutex;
+        std::condition_variable queue_cv;
+        std::thread worker;
+        bool running = false;
+
+        // Copy one descriptor's blocks, returns false on a bus error
+        static bool copy(const descriptor& d, std::vector <u8>& buf) {
+            bool ok = true;
+            u64 count = d.count ? d.count : 1;
+
+            for (u64 b = 0; b < count; b++) {
+                u64 src = d.src + b * d.src_stride,
+                    dst = d.dst + b * d.dst_stride;
+
+                for (u64 off = 0; off < d.len; off += DMA_CHUNK_SIZE) {
+                    u64 n = std::min<u64>(DMA_CHUNK_SIZE, d.len - off);
+                    if (!bus::is_concurrent(src + off, n) || !bus::is_concurrent(dst + off, n)) { ok = false; continue; }
+                    ok &= bus::read_block(src + off, buf.data(), n);
+                    ok &= bus::write_block(dst + off, buf.data(), n);
+                }
+            }
+            return ok;
+        }
+
+        void run(job& j) {
+            TIMELINE_SCOPE("dma_transfer");
+
+            std::vector <u8> buf(DMA_CHUNK_SIZE);
+            bool ok = true;
+
+            if (!j.desc) {
+                ok = copy(j.d, buf);
+            } else {
+                // Walk the chain, a cycle stops at the descriptor limit
+                descriptor d;
+                for (u64 a = j.desc, n = 0; a && (n < 0x100000); a = d.next, n++) {
+                    if (!bus::is_concurrent(a, sizeof(d)) || !bus::read_block(a, (u8*)&d, sizeof(d))) { ok = false; break; }
+                    ok &= copy(d, buf);
+                }
+            }
+
+            channels[j.ch].status.store(c_done | (ok ? 0 : c_error) | (j.irq ? c_irq : 0), std::memory_order_release);
+            if (j.irq && irq_controller) irq_controller->raise(irq_dma);
+        }
+
+        void worker_loop() {
+            TIMELINE_THREAD("dma");
+#ifdef PERF_COUNTERS_ENABLED
+            perf::set_thread_name("dma");
+#endif
+            std::unique_lock <std::mutex> lock(queue_mutex);
+            while (true) {
+                queue_cv.wait(lock, [this] { return !running || queue.size(); });
+                if (!running) return;
+
+                job j = queue.front();
+                queue.pop_front();
+
+                lock.unlock();
+                run(j);
+                lock.lock();
+            }
+        }
+
+        void start(size_t ch) {
+            channel& c = channels[ch];
+            if (c.status.load(std::memory_order_acquire) & c_busy) return;
+
+            c.status.store(c_busy | (c.irq ? c_irq : 0), std::memory_order_release);
+
+            std::lock_guard <std::mutex> lock(queue_mutex);
+            if (!running) {
+                running = true;
+                worker = std::thread(&dma::worker_loop, this);
+            }
+            queue.push_back({ ch, c.regs, c.desc, c.irq });
+            queue_cv.notify_one();
+        }
+
+    public:
+        dma(u64 mmio_base, pic* p = nullptr) :
+            device("DMA Controller", mmio_base, DMA_CHANNEL_COUNT * 0x40, 0xc, device_access::a_rw),
+            irq_controller(p) {};
+
+        ~dma() { close(); }
+
+        // Stop the worker, transfers still queued are dropped
+        void close() {
+            {
+                std::lock_guard <std::mutex> lock(queue_mutex);
+                if (!running) return;
+                running = false;
+                queue.clear();
+            }
+            queue_cv.notify_all();
+            worker.join();
+        }
+
+        u64 read(u64 addr, size_t) override {
+            addr -= base;
+            channel& c = channels[addr / 0x40];
+
+            switch (addr % 0x40) {
+                case 0x00: return c.regs.src;
+                case 0x08: return c.regs.dst;
+                case 0x10: return c.regs.len;
+                case 0x18: return c.regs.count;
+                case 0x20: return c.regs.src_stride;
+                case 0x28: return c.regs.dst_stride;
+                case 0x30: return c.desc;
+                case 0x38: return c.status.load(std::memory_order_acquire);
+            }
+            return 0xffffffffffffffff;
+        }
+
+        void write(u64 addr, u64 value, size_t) override {
+            TIMELINE_SCOPE("dma_write");
+            addr -= base;
+            size_t ch = addr / 0x40;
+            channel& c = channels[ch];
+
+            // Registers can't change under a running transfer
+            if (c.status.load(std::memory_order_acquire) & c_busy) return;
+
+            switch (addr % 0x40) {
+                case 0x00: c.regs.src = value; break;
+                case 0x08: c.regs.dst = value; break;
+                case 0x10: c.regs.len = value; break;
+                case 0x18: c.regs.count = value; break;
+                case 0x20: c.regs.src_stride = value; break;
+                case 0x28: c.regs.dst_stride = value; break;
+                case 0x30: c.desc = value; break;
+                case 0x38: {
+                    c.irq = value & c_irq;
+                    if (value & c_start) start(ch);
+                } break;
+            }
+        }
+    };
+}
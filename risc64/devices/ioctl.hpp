@@ -1,10 +1,21 @@
 ﻿#pragma once
 
 #include <iostream>
+#include <fstream>
+#include <iterator>
+#include <atomic>
+#include <thread>
+#include <vector>
 #include <array>
 
 #include "../aliases.hpp"
 #include "../device.hpp"
+#include "../timeline.hpp"
+#include "../perf.hpp"
+#include "../spsc.hpp"
+#include "../terminal.hpp"
+#include "../display.hpp"
+#include "../governor.hpp"
 
 #define LGW_OPTIMIZE
 //#define LGW_ENABLE_MUTEXES
@@ -16,17 +27,55 @@ namespace machine {
 
         using device_access = device::access_mode;
 
-        u8 registers[10] = { 0 };
+        u8 registers[12] = { 0 };
+
+        // Keyboard input, window key events and scripted input each get their
+        // own queue so both stay single-producer
+        typedef spsc_queue <u32, 0x100> key_queue_t;
+        key_queue_t keys, script_keys;
+        std::atomic<bool> key_overflow = false;
+
+        std::thread script_thread;
+        std::atomic<bool> script_running = false;
 
         size_t window_scale = 2;
 
-        std::string data = "";
-        sf::Text str;
+        // Terminal contents, written by the CPU thread
+        terminal_buffer terminal;
+
+        // Copy terminal output to stdout, used when there's no display
+        bool echo = false;
+
+        // Told when the guest polls for keys that aren't there, and when keys arrive
+        governor* speed = nullptr;
+
+        // Renderer state, window thread only
+        static constexpr float cell_w = 640.0f / TERMINAL_COLUMNS,
+                               cell_h = 480.0f / TERMINAL_ROWS;
+
         sf::Font term;
+        const sf::Texture* atlas = nullptr;
+        unsigned font_size = 20;
+        float baseline = 0.0f;
+
+        // Pre-rasterized printable ASCII, quads are relative to the cell origin
+        struct glyph_quad { sf::FloatRect bounds; sf::IntRect tex; };
+        std::array <glyph_quad, 0x7f - 0x20> glyphs;
+
+        // Vertex cache for the lines on screen, indexed by line % TERMINAL_ROWS
+        struct line_cache {
+            u64 line = ~0ull;
+            u32 version = ~0u;
+            sf::VertexArray v = sf::VertexArray(sf::Quads);
+        };
+        std::array <line_cache, TERMINAL_ROWS> lines;
+
+        // Lines scrolled back from the bottom (PageUp/PageDown)
+        u64 scroll = 0;
+        bool scroll_keys[2] = { false, false };
+
         sf::Clock cursor_clk;
         
-        bool cursor_on;
-        
         // r[0] -> term_char_out
         // r[1] -> term_status
         // r[2] -> term_print_x
@@ -37,13 +86,110 @@ namespace machine {
         // r[7] -> mouse_status
         // r[8] -> mouse_x
         // r[9] -> mouse_y
+        // r[10] -> keyb_queue_depth
+        // r[11] -> keyb_queue_status (bit 0: overflow, write 0 to clear, bit 1: key pending)
+
+        size_t get_key_queue_depth() const { return keys.size() + script_keys.size(); }
+
+        // Rasterize every printable character once so the font texture stops changing
+        void build_atlas() {
+            // Largest size up to 20 that fits the cell
+            for (; font_size > 6; font_size--) {
+                if ((term.getGlyph('M', font_size, false).advance <= cell_w) && (term.getLineSpacing(font_size) <= cell_h + 2)) break;
+            }
+
+            for (u32 c = 0x20; c < 0x7f; c++) {
+                const sf::Glyph& g = term.getGlyph(c, font_size, false);
+                glyphs[c - 0x20] = { g.bounds, g.textureRect };
+            }
+
+            float ascent = -term.getGlyph('M', font_size, false).bounds.top;
+            baseline = (cell_h + ascent) / 2.0f;
+            atlas = &term.getTexture(font_size);
+        }
+
+        void build_line(line_cache& lc, const char* text) {
+            lc.v.clear();
+            for (size_t x = 0; x < TERMINAL_COLUMNS; x++) {
+                if (text[x] == ' ') continue;
+
+                const glyph_quad& g = glyphs[text[x] - 0x20];
+                float l = x * cell_w + g.bounds.left, t = baseline + g.bounds.top,
+                      r = l + g.bounds.width, b = t + g.bounds.height;
+                float u0 = g.tex.left, v0 = g.tex.top,
+                      u1 = u0 + g.tex.width, v1 = v0 + g.tex.height;
+
+                sf::Color c(0xfcfcfcff);
+                lc.v.append(sf::Vertex(sf::Vector2f(l, t), c, sf::Vector2f(u0, v0)));
+                lc.v.append(sf::Vertex(sf::Vector2f(r, t), c, sf::Vector2f(u1, v0)));
+                lc.v.append(sf::Vertex(sf::Vector2f(r, b), c, sf::Vector2f(u1, v1)));
+                lc.v.append(sf::Vertex(sf::Vector2f(l, b), c, sf::Vector2f(u0, v1)));
+            }
+        }
+
+        // PageUp/PageDown move through the scrollback a page at a time
+        void poll_scroll_keys(const terminal_buffer::view& v) {
+            if (!get_window()->hasFocus()) return;
+
+            bool up = sf::Keyboard::isKeyPressed(sf::Keyboard::PageUp),
+                 down = sf::Keyboard::isKeyPressed(sf::Keyboard::PageDown);
+
+            u64 max = (v.last - v.first + 1 > TERMINAL_ROWS) ? (v.last - v.first + 1 - TERMINAL_ROWS) : 0;
+            if (up && !scroll_keys[0]) scroll = std::min<u64>(scroll + TERMINAL_ROWS, max);
+            if (down && !scroll_keys[1]) scroll = (scroll > TERMINAL_ROWS) ? scroll - TERMINAL_ROWS : 0;
+            scroll = std::min(scroll, max);
+
+            scroll_keys[0] = up;
+            scroll_keys[1] = down;
+        }
+
+        // Move the next queued key into keyb_key_code
+        void next_key() {
+            u32 k;
+            if (keys.pop(k) || script_keys.pop(k)) registers[5] = k;
+        }
 
     public:
         u8* get_memory() { return &registers[0]; }
 
         ioctl(u64 mmio_base, size_t scale) :
-            device("Generic I/O Controller", mmio_base, 9, 2, device_access::a_rw),
-            window_scale(scale) {};
+            device("Generic I/O Controller", mmio_base, 12, 2, device_access::a_rw),
+            window_scale(scale) {
+                block_access_size = 1;
+        };
+
+        ~ioctl() { stop_input_script(); }
+
+        // Feed keys from a file at full guest speed, blocks only while the queue is full
+        bool start_input_script(const std::string& name) {
+            std::ifstream f(name, std::ios::binary);
+            if (!f.is_open()) {
+                _log(error, "Couldn't open input script \"%s\"", name.c_str());
+                return false;
+            }
+            std::string text((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+
+            script_running = true;
+            script_thread = std::thread([this, text] {
+                std::vector <u32> v(text.begin(), text.end());
+                for (size_t i = 0; (i < v.size()) && script_running; ) {
+                    size_t n = script_keys.push(v.data() + i, v.size() - i);
+                    if (!n) std::this_thread::yield();
+                    else if (speed) speed->input_available();
+                    i += n;
+                }
+            });
+            return true;
+        }
+
+        void stop_input_script() {
+            script_running = false;
+            if (script_thread.joinable()) script_thread.join();
+        }
+
+        void set_echo(bool e) { echo = e; }
+        void attach_governor(governor* g) { speed = g; }
+        terminal_buffer& get_terminal() { return terminal; }
 
         void init_display() {
             init(640, 480, "IOCTL Terminal Display", sf::Style::Default, false, true);
@@ -52,75 +198,108 @@ namespace machine {
         u64 read(u64 addr, size_t size) override {
             // Hardware fault, terminal cannot read more than a byte at once
             if (size > 1) { return 0xffffffffffffffff; }
+
+            switch (addr - base) {
+                case 5: if (!registers[5]) next_key(); break;
+                case 10: registers[10] = std::min<size_t>(get_key_queue_depth(), 0xff); break;
+                case 11: registers[11] = (key_overflow ? 1 : 0) | ((registers[5] || get_key_queue_depth()) ? 2 : 0); break;
+            }
+            if (speed && ((addr - base == 5) || (addr - base == 11)) && !registers[5]) speed->input_polled_empty();
             u64 qword = (u64)registers[addr-base];
  
             return qword;
         }
 
         void write(u64 addr, u64 value, size_t size) override {
+            TIMELINE_SCOPE("ioctl_write");
             //std::cout << "write to _mmio_ioctl_base+0x" << std::hex << (unsigned int)(addr-base) << ", value = 0x" << (unsigned int)value << std::endl;
             // Hardware fault, terminal cannot write more than a byte at once
             if (size > 1) { return; }
             registers[addr - base] = value;
 
             // A0000R00 -> R = READY, A = KEY_ACK
-            // Key acknowledgement
+            // Key acknowledgement, the next queued key (if any) takes its place
             if (registers[6] & 0x80) {
                 registers[5] = 0;
                 registers[6] &= (~0x80);
+                next_key();
             }
+            // Clearing the overflow flag
+            if ((addr - base == 11) && !(value & 1)) key_overflow = false;
             // Check READY bit and react accordingly
             if (registers[1] & 0x4) {
                 if (registers[0] > 0) {
-                    data += (char)registers[0];
-                    str.setString(data);
+                    terminal.put((char)registers[0]);
+                    if (echo) std::cout.put((char)registers[0]);
                 };
                 registers[1] &= (~0x4);
             }
         }
 
         void on_key(sf::Uint32 key) override {
+            TIMELINE_SCOPE("ioctl_on_key");
             switch (key) {
-                case 0xd: registers[5] = 0xa; break;
-                case 0x8: if (data.size()) { data.pop_back(); str.setString(data); }; break;
-                default: registers[5] = key; break;
+                case 0xd: if (!keys.push(0xa)) key_overflow = true; break;
+                case 0x8: terminal.erase(); break;
+                default: if (!keys.push(key)) key_overflow = true; break;
             }
+            if (speed) speed->input_available();
         }
     
         void setup() override {
+            TIMELINE_THREAD("ioctl");
+#ifdef PERF_COUNTERS_ENABLED
+            perf::set_thread_name("ioctl");
+#endif
             scale(window_scale);
 #ifdef _WIN32
             term.loadFromFile("res/terminal.ttf");
 #else
             term.loadFromFile("risc64/res/terminal.ttf");
 #endif
-            str.setCharacterSize(20);
-            str.setPosition(2, -8);
-            str.setFont(term);
-            str.setString(data);
-            str.setFillColor(sf::Color(0xfcfcfcff));
+            build_atlas();
             cursor_clk.restart();
             get_window()->setMouseCursorVisible(false);
             get_window()->setPosition(sf::Vector2i(350, 25));
+            display::apply(get_window());
         }
 
 
         void draw() override {
+            TIMELINE_SCOPE("ioctl_draw");
+#ifdef PERF_COUNTERS_ENABLED
+            perf::frame();
+#endif
             auto w = get_window();
             clear(sf::Color::Black);
 
-            //if (round(cursor_clk.getElapsedTime().asSeconds()) == 0.5f) {
-            //    if (cursor_on) {
-            //        data.pop_back();
-            //    } else {
-            //        data += "_";
-            //    }
-            //    str.setString(data);
-            //    cursor_on = !cursor_on;
-            //    cursor_clk.restart();
-            //}
-
-            get_window()->draw(str);
+            terminal.flush();
+            auto v = terminal.get_view();
+            poll_scroll_keys(v);
+
+            u64 top = (v.last + 1 > TERMINAL_ROWS) ? v.last + 1 - TERMINAL_ROWS : 0;
+            top = std::max(top - std::min(top, scroll), v.first);
+
+            // Only lines whose version changed since the last frame are rebuilt
+            char text[TERMINAL_COLUMNS];
+            sf::RenderStates states(atlas);
+            for (u64 l = top; l < top + TERMINAL_ROWS; l++) {
+                line_cache& lc = lines[l % TERMINAL_ROWS];
+                if (lc.line != l) { lc.line = l; lc.version = ~0u; lc.v.clear(); }
+
+                if (terminal.copy_line(l, lc.version, text)) build_line(lc, text);
+
+                states.transform = sf::Transform().translate(0.0f, (l - top) * cell_h);
+                w->draw(lc.v, states);
+            }
+
+            // Blinking underline cursor
+            if ((v.cursor_line >= top) && (v.cursor_line < top + TERMINAL_ROWS) && (cursor_clk.getElapsedTime().asMilliseconds() % 1000 < 500)) {
+                sf::RectangleShape cursor(sf::Vector2f(cell_w, 2.0f));
+                cursor.setPosition(std::min<size_t>(v.cursor_col, TERMINAL_COLUMNS - 1) * cell_w, (v.cursor_line - top + 1) * cell_h - 3.0f);
+                cursor.setFillColor(sf::Color(0xfcfcfcff));
+                w->draw(cursor);
+            }
         }
 
         void on_close() override {
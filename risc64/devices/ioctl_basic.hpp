@@ -17,7 +17,9 @@ namespace machine {
         // r[4] -> prntc
 
     public:
-        tty(u64 mmio_base) : device("Terminal Controller", mmio_base, 4, 4, device_access::a_rw) {};
+        tty(u64 mmio_base) : device("Terminal Controller", mmio_base, 4, 4, device_access::a_rw) {
+            block_access_size = 1;
+        };
 
         u64 read(u64 addr, size_t size) override {
             #ifdef DEBUG
@@ -1,49 +1,252 @@
 #pragma once
 
-#include <array>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#ifdef __linux__
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #include <Windows.h>
+    #include <atomic>
+    #include <mutex>
+
+    // Guest RAM is committed this many bytes at a time, a multiple of the
+    // 64K allocation granularity
+    #define MEMORY_COMMIT_CHUNK 0x10000
+#endif
 
 #include "../aliases.hpp"
 #include "../device.hpp"
+#include "../log.hpp"
 
 namespace machine {
-    template <size_t a_size> class memory : public machine::device {
+    class memory : public machine::device {
         using device_access = device::access_mode;
 
     public:
-        typedef std::array <machine::u8, a_size> array_t;
+        // Page backing modes
+        enum page_mode {
+            pm_normal,      // Regular 4K pages
+            pm_transparent, // Ask for transparent huge pages
+            pm_hugetlb      // Explicit hugetlbfs pages, falls back to pm_transparent
+        };
 
     private:
-        array_t m = { 0 };
+        u8* m = nullptr;
+        page_mode mode = pm_normal;
+
+        // Size of the host mapping, rounded up to the page size in use
+        u64 reserved = 0;
+
+#ifdef _WIN32
+        // Windows has no overcommit, guest RAM is only reserved and a vectored
+        // exception handler commits chunks the first time any thread touches them
+        static constexpr size_t max_instances = 4;
+        static inline std::atomic<memory*> instances[max_instances] = {};
+        bool lazy_commit = false;
+
+        static LONG CALLBACK commit_on_fault(PEXCEPTION_POINTERS e) {
+            if (e->ExceptionRecord->ExceptionCode != EXCEPTION_ACCESS_VIOLATION) return EXCEPTION_CONTINUE_SEARCH;
+
+            u8* a = (u8*)e->ExceptionRecord->ExceptionInformation[1];
+            for (auto& i : instances) {
+                memory* mem = i.load(std::memory_order_acquire);
+                if (!mem || (a < mem->m) || (a >= mem->m + mem->reserved)) continue;
+
+                u8* chunk = mem->m + ((a - mem->m) & ~(u64)(MEMORY_COMMIT_CHUNK - 1));
+                u64 n = std::min<u64>(MEMORY_COMMIT_CHUNK, mem->m + mem->reserved - chunk);
+                return VirtualAlloc(chunk, n, MEM_COMMIT, PAGE_READWRITE) ? EXCEPTION_CONTINUE_EXECUTION : EXCEPTION_CONTINUE_SEARCH;
+            }
+            return EXCEPTION_CONTINUE_SEARCH;
+        }
+
+        // Returns false if every slot is taken, the caller commits up front then
+        bool register_lazy_commit() {
+            static std::once_flag installed;
+            std::call_once(installed, [] { AddVectoredExceptionHandler(1, &commit_on_fault); });
+
+            for (auto& i : instances) {
+                memory* expected = nullptr;
+                if (i.compare_exchange_strong(expected, this, std::memory_order_acq_rel)) return true;
+            }
+            return false;
+        }
+
+        void unregister_lazy_commit() {
+            for (auto& i : instances) {
+                memory* expected = this;
+                i.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel);
+            }
+        }
+#endif
+
+        void free_memory() {
+            if (!m) return;
+#if defined(__linux__)
+            munmap(m, reserved);
+#elif defined(_WIN32)
+            unregister_lazy_commit();
+            VirtualFree(m, 0, MEM_RELEASE);
+#else
+            std::free(m);
+#endif
+            m = nullptr;
+        }
 
     public:
         memory(u64 mmio_base) :
-            device("Main Memory Controller", mmio_base, a_size, 9, device_access::a_all) {};
+            device("Main Memory Controller", mmio_base, 0, 9, device_access::a_all) {};
+
+        ~memory() { free_memory(); }
+
+        // Reserve mem_size bytes of guest RAM
+        // Only address space is reserved here, host pages are committed
+        // on first touch and read as zero until then
+        bool init(u64 mem_size, page_mode pm = pm_normal) {
+            free_memory();
+            size = mem_size;
+            reserved = mem_size;
+            mode = pm;
+
+#if defined(__linux__)
+            void* p = MAP_FAILED;
+            int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+
+    #ifdef MAP_HUGETLB
+            if (pm == pm_hugetlb) {
+                // hugetlbfs mappings must be a multiple of the (2M) huge page size
+                reserved = (size + 0x1fffff) & ~0x1fffffull;
+                p = mmap(nullptr, reserved, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+                if (p == MAP_FAILED) {
+                    reserved = size;
+                    _log(warning, "Couldn't map guest RAM with hugetlbfs pages, falling back to transparent huge pages");
+                    mode = pm_transparent;
+                }
+            }
+    #endif
+            if (p == MAP_FAILED) p = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+            if (p == MAP_FAILED) {
+                _log(error, "Couldn't reserve 0x%llx bytes of guest RAM", size);
+                size = 0;
+                return false;
+            }
+
+    #ifdef MADV_HUGEPAGE
+            if (mode == pm_transparent) madvise(p, size, MADV_HUGEPAGE);
+    #endif
+            m = (u8*)p;
+#elif defined(_WIN32)
+            m = (u8*)VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_READWRITE);
+            lazy_commit = m && register_lazy_commit();
+            if (m && !lazy_commit) {
+                _log(warning, "Too many guest memories for lazy commit, committing 0x%llx bytes up front", size);
+                if (!VirtualAlloc(m, size, MEM_COMMIT, PAGE_READWRITE)) {
+                    VirtualFree(m, 0, MEM_RELEASE);
+                    m = nullptr;
+                }
+            }
+#else
+            m = (u8*)std::calloc(size, 1);
+#endif
+            if (!m) {
+                _log(error, "Couldn't reserve 0x%llx bytes of guest RAM", size);
+                size = 0;
+                return false;
+            }
+            return true;
+        }
 
-#ifdef DEBUG
-        inline const std::string& get_symbol(u64 addr) override {
+        // Give the host pages backing [addr, addr+len) back to the OS
+        // The range reads as zero afterwards, addr is a bus address
+        // Returns false if the range isn't wholly in this memory
+        bool release(u64 addr, u64 len) {
             addr -= base;
-            if (addr < size) { return "_pbus_main_memory"; }
-        };
+            if ((addr >= size) || (len > size - addr)) return false;
+            if (!len) return true;
+
+#if defined(__linux__)
+            u64 page = sysconf(_SC_PAGESIZE);
+#else
+            u64 page = 0x1000;
+#endif
+            u64 lo = (addr + page - 1) & ~(page - 1),
+                hi = (addr + len) & ~(page - 1);
+
+            // Partial pages at either end are just cleared
+            if (lo >= hi) { std::memset(m + addr, 0, len); return true; }
+            std::memset(m + addr, 0, lo - addr);
+            std::memset(m + hi, 0, (addr + len) - hi);
+
+#if defined(__linux__)
+            madvise(m + lo, hi - lo, MADV_DONTNEED);
+#elif defined(_WIN32)
+            // Decommitted pages are committed again, zeroed, on the next touch
+            VirtualFree(m + lo, hi - lo, MEM_DECOMMIT);
+            if (!lazy_commit) VirtualAlloc(m + lo, hi - lo, MEM_COMMIT, PAGE_READWRITE);
+#else
+            std::memset(m + lo, 0, hi - lo);
 #endif
+            return true;
+        }
+
+        page_mode get_page_mode() const { return mode; }
+
+        u8* get_memory() { return m; }
+
+        bool load(u64 addr, const u8* data, u64 len) override {
+            addr -= base;
+            if ((addr >= size) || (len > size - addr)) return false;
 
-        u8* get_memory() { return m.data(); }
+            if (data) std::memcpy(m + addr, data, len);
+            else std::memset(m + addr, 0, len);
+            return true;
+        }
 
         u64 read(u64 addr, size_t size) override {
             addr -= base;
+            if ((addr >= this->size) || (size > this->size - addr)) return 0xffffffffffffffff;
+
+            // Guest memory is little-endian, so is every host we build on
             u64 q = 0;
-            for (int off = size - 1; off >= 0; off--) {
-                q |= ((u64)m[addr+off]) << (8 * off);
-            }
+            std::memcpy(&q, m + addr, size);
             return q;
         }
 
         void write(u64 addr, u64 value, size_t size) override {
             addr -= base;
-            size_t boff = 0;
-            for (int off = size - 1; off >= 0; off--) {
-                boff = off*8;
-                m[addr+off] = (value & (0xffull << boff)) >> boff;
-            }
+            if ((addr >= this->size) || (size > this->size - addr)) return;
+
+            std::memcpy(m + addr, &value, size);
+        }
+
+        u8* get_host_pointer(u64 addr, u64 len) override {
+            addr -= base;
+            if ((addr >= size) || (len > size - addr)) return nullptr;
+            return m + addr;
+        }
+
+        bool is_concurrent(u64 addr, u64 len) override {
+            addr -= base;
+            return (addr < size) && (len <= size - addr);
+        }
+
+        void read_block(u64 addr, u8* dst, u64 len) override {
+            addr -= base;
+            if ((addr >= size) || (len > size - addr)) { std::memset(dst, 0xff, len); return; }
+
+            std::memcpy(dst, m + addr, len);
+        }
+
+        void write_block(u64 addr, const u8* src, u64 len) override {
+            addr -= base;
+            if ((addr >= size) || (len > size - addr)) return;
+
+            std::memcpy(m + addr, src, len);
         }
     };
-}
\ No newline at end of file
+}
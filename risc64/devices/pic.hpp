@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+
+#include "../aliases.hpp"
+#include "../device.hpp"
+
+namespace machine {
+    // Interrupt lines
+    enum irq_line {
+        irq_dma   = 0,
+        irq_block = 1,
+        irq_timer = 2,
+        irq_perf  = 3
+    };
+
+    // Programmable interrupt controller
+    // Devices on any thread raise lines, cpu0 takes the interrupt between
+    // instructions when the SR IRQ flag is set and the line is unmasked
+    class pic : public device {
+        using device_access = device::access_mode;
+
+        // Set from device threads, cleared by the guest
+        std::atomic<u64> pending = 0;
+
+        u64 mask = 0, vector = 0;
+
+        // r[0x00] -> pending (write 1 to clear)
+        // r[0x08] -> mask
+        // r[0x10] -> vector (handler address)
+        // r[0x18] -> cause (lowest pending unmasked line, 0xff if none)
+        u64 get_register(u64 r) {
+            switch (r) {
+                case 0x00: return pending.load(std::memory_order_acquire);
+                case 0x08: return mask;
+                case 0x10: return vector;
+                case 0x18: {
+                    u64 p = get_active();
+                    return p ? std::countr_zero(p) : 0xff;
+                }
+            }
+            return 0xffffffffffffffff;
+        }
+
+    public:
+        pic(u64 mmio_base) :
+            device("Interrupt Controller", mmio_base, 0x20, 0xb, device_access::a_rw) {};
+
+        // Thread-safe
+        inline void raise(irq_line l) { pending.fetch_or(1ull << l, std::memory_order_release); }
+
+        // Pending, unmasked lines
+        inline u64 get_active() const { return pending.load(std::memory_order_relaxed) & mask; }
+
+        u64 get_vector() const { return vector; }
+
+        u64 read(u64 addr, size_t) override {
+            addr -= base;
+            if (addr & 7) return 0xffffffffffffffff;
+            return get_register(addr);
+        }
+
+        void write(u64 addr, u64 value, size_t) override {
+            addr -= base;
+            switch (addr) {
+                case 0x00: pending.fetch_and(~value, std::memory_order_acq_rel); break;
+                case 0x08: mask = value; break;
+                case 0x10: vector = value; break;
+            }
+        }
+    };
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <array>
+
+#include "../aliases.hpp"
+#include "../device.hpp"
+#include "pic.hpp"
+
+// Harts with a counter bank
+#define PMU_HART_COUNT 8
+
+namespace machine {
+    // Performance monitoring unit
+    // Each hart has a bank of 64-bit event counters, incremented by that hart's
+    // CPU thread while counting is enabled. Counters are writable, so presetting
+    // one to -N raises irq_perf after N events
+    class pmu : public device {
+        using device_access = device::access_mode;
+
+    public:
+        enum event {
+            ev_instructions = 0, // Retired instructions (including ones whose condition failed)
+            ev_cycles,           // Cycles under the timing model, 0 without one
+            ev_branches,         // Executed bnj instructions
+            ev_loads,
+            ev_stores,
+            ev_mmio,             // Loads and stores that didn't hit RAM
+            ev_decodes,          // Instruction decodes, with no decode cache every fetch misses
+            ev_count
+        };
+
+        // Only touched by the owning CPU thread, including the guest's MMIO accesses
+        struct bank {
+            std::array <u64, 8> counters = {};
+            pmu* owner = nullptr;
+            size_t hart = 0;
+
+            inline void add(event e, u64 n = 1) {
+                u64 v = counters[e];
+                counters[e] = v + n;
+                if (counters[e] < v) owner->overflow(hart, e);
+            }
+
+            bool enabled() const { return owner->is_enabled(); }
+        };
+
+    private:
+        enum ctrl_bits {
+            c_enable = 0b001, // RW: counting on (start/stop)
+            c_irq    = 0b010, // RW: raise irq_perf on overflow
+            c_reset  = 0b100  // W: zero every counter
+        };
+
+        // r[0x00] -> ctrl
+        // r[0x08] -> overflow status, bit hart * 8 + event (write 1 to clear)
+        // r[0x40 + hart * 0x40 + event * 8] -> counter
+        u64 ctrl = 0, overflow_status = 0;
+
+        std::array <bank, PMU_HART_COUNT> banks;
+
+        pic* irq_controller = nullptr;
+
+    public:
+        pmu(u64 mmio_base, pic* p) :
+            device("Performance Monitoring Unit", mmio_base, 0x40 + PMU_HART_COUNT * 0x40, 0xf, device_access::a_rw),
+            irq_controller(p) {
+                for (size_t h = 0; h < banks.size(); h++) {
+                    banks[h].owner = this;
+                    banks[h].hart = h;
+                }
+        };
+
+        bank* get_bank(size_t hart) { return (hart < banks.size()) ? &banks[hart] : nullptr; }
+
+        inline bool is_enabled() const { return ctrl & c_enable; }
+
+        void overflow(size_t hart, event e) {
+            overflow_status |= 1ull << (hart * 8 + e);
+            if ((ctrl & c_irq) && irq_controller) irq_controller->raise(irq_perf);
+        }
+
+        u64 read(u64 addr, size_t) override {
+            addr -= base;
+            if (addr & 7) return 0xffffffffffffffff;
+
+            switch (addr) {
+                case 0x00: return ctrl;
+                case 0x08: return overflow_status;
+            }
+            if (addr < 0x40) return 0xffffffffffffffff;
+
+            addr -= 0x40;
+            return banks[addr / 0x40].counters[(addr % 0x40) / 8];
+        }
+
+        void write(u64 addr, u64 value, size_t) override {
+            addr -= base;
+            if (addr & 7) return;
+
+            switch (addr) {
+                case 0x00: {
+                    if (value & c_reset) {
+                        for (bank& b : banks) b.counters.fill(0);
+                    }
+                    ctrl = value & (c_enable | c_irq);
+                } return;
+                case 0x08: overflow_status &= ~value; return;
+            }
+            if (addr < 0x40) return;
+
+            addr -= 0x40;
+            banks[addr / 0x40].counters[(addr % 0x40) / 8] = value;
+        }
+    };
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <chrono>
+
+#include "../aliases.hpp"
+#include "../device.hpp"
+#include "../scheduler.hpp"
+#include "pic.hpp"
+
+namespace machine {
+    // Programmable timer and real-time clock
+    // The counter is the scheduler's machine time, compare matches are
+    // scheduler events that raise irq_timer
+    class timer : public device {
+        using device_access = device::access_mode;
+
+        enum ctrl_bits {
+            c_enable = 0b001, // RW: compare match armed
+            c_irq    = 0b010, // RW: raise irq_timer on match
+            c_match  = 0b100  // R: compare matched, W: write 1 to clear
+        };
+
+        // r[0x00] -> counter (machine time, read-only)
+        // r[0x08] -> frequency (counter ticks per second, read-only)
+        // r[0x10] -> compare
+        // r[0x18] -> period (compare is advanced past the counter by multiples of this on every match, 0 = one-shot)
+        // r[0x20] -> ctrl/status
+        // r[0x28] -> rtc (seconds since the UNIX epoch, writes set the clock)
+        u64 compare = 0, period = 0, ctrl = 0;
+
+        // RTC seconds at counter 0
+        s64 rtc_base = 0;
+
+        pic* irq_controller = nullptr;
+        scheduler* events = nullptr;
+        u64 pending_event = 0;
+
+        void arm() {
+            if (pending_event) events->cancel(pending_event);
+            pending_event = 0;
+
+            if (ctrl & c_enable) pending_event = events->schedule_at(compare, [this] { on_match(); });
+        }
+
+        void on_match() {
+            pending_event = 0;
+            ctrl |= c_match;
+            if ((ctrl & c_irq) && irq_controller) irq_controller->raise(irq_timer);
+
+            if (period) {
+                // Skip every period that has already passed, missed matches
+                // collapse into this one instead of firing back to back
+                u64 now = events->now();
+                compare += (now >= compare) ? ((now - compare) / period + 1) * period : period;
+                arm();
+            } else {
+                ctrl &= ~c_enable;
+            }
+        }
+
+        u64 get_rtc() const {
+            return rtc_base + events->now() / events->get_frequency();
+        }
+
+    public:
+        timer(u64 mmio_base, pic* p, scheduler* s) :
+            device("Timer/RTC", mmio_base, 0x30, 0xe, device_access::a_rw),
+            irq_controller(p),
+            events(s) {
+                reset_rtc();
+        };
+
+        // Sync the RTC with the host's wall clock, call after changing the scheduler mode
+        void reset_rtc() {
+            s64 host = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            rtc_base = host - (s64)(events->now() / events->get_frequency());
+        }
+
+        u64 read(u64 addr, size_t) override {
+            switch (addr - base) {
+                case 0x00: return events->now();
+                case 0x08: return events->get_frequency();
+                case 0x10: return compare;
+                case 0x18: return period;
+                case 0x20: return ctrl;
+                case 0x28: return get_rtc();
+            }
+            return 0xffffffffffffffff;
+        }
+
+        void write(u64 addr, u64 value, size_t) override {
+            switch (addr - base) {
+                case 0x10: compare = value; arm(); break;
+                case 0x18: period = value; break;
+                case 0x20: {
+                    u64 match = (ctrl & c_match) & ~value;
+                    ctrl = (value & (c_enable | c_irq)) | match;
+                    arm();
+                } break;
+                case 0x28: rtc_base += (s64)value - (s64)get_rtc(); break;
+            }
+        }
+    };
+}
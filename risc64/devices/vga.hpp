@@ -1,72 +1,236 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <atomic>
+#include <vector>
 #include <array>
 
 #include "../device.hpp"
 #include "../aliases.hpp"
+#include "../timeline.hpp"
+#include "../perf.hpp"
+#include "../pixel.hpp"
+#include "../triple_buffer.hpp"
+#include "../display.hpp"
 
+#define LGW_OPTIMIZE
 #include "../lgw/threaded_window.hpp"
 
-namespace machine {
-    namespace detail {
-        inline u8 clamp(u16 res) { return res > 0xff ? 0xff : res; }
-    }
+// Bytes per scanline, the same in both video modes
+#define VGA_STRIDE 640
+
+// Highest scanline count of any mode
+#define VGA_MAX_LINES 480
 
+// Text mode geometry
+#define VGA_TEXT_COLUMNS 80
+#define VGA_TEXT_ROWS 25
+
+namespace machine {
     class vga : public device, public lgw::threaded_window {
-        using device::access_mode = device_access;
+        using device_access = device::access_mode;
 
+        // Text mode cell, attr is Bbbbffff (B: blink, b: background, f: foreground)
         struct character {
             u8 ascii, attr;
 
             character(u16 v) : ascii(v & 0xff), attr((v & 0xff00) >> 8) {};
         };
 
+        // Standard 16-color text palette
+        static sf::Color get_text_color(u8 i) {
+            static const u32 palette[16] = {
+                0x000000ff, 0x0000aaff, 0x00aa00ff, 0x00aaaaff, 0xaa0000ff, 0xaa00aaff, 0xaa5500ff, 0xaaaaaaff,
+                0x555555ff, 0x5555ffff, 0x55ff55ff, 0x55ffffff, 0xff5555ff, 0xff55ffff, 0xffff55ff, 0xffffffff
+            };
+            return sf::Color(palette[i & 0xf]);
+        }
+
         // 512K of VRAM, double of what a normal VGA chip would have
         // Supported video modes:
-        // 640x480@8-bit color
-        // 320x240@16-bit color
+        // 640x480@8-bit color (RGB332)
+        // 320x240@16-bit color (RGB565)
         // Both of these video modes use around 300K of video memory
         std::array <u8, 0x80000> vram;
-        
+
         // VGA_CONTROL register:
         // m: Mode select
         //   Video modes:
         //   00 -> 640x480@8-bit color
         //   01 -> 320x240@16-bit color
         //   Text modes:
-        //   00 -> 80x25
+        //   00 -> 80x25, (character, attribute) pairs at the start of VRAM
         // t: Text mode
         //   0  -> Bitmap/video mode
         //   1  -> Text mode
         // r: Frame ready
-        //   Makes the controller raster this frame, when its done, the controller
-        //   will reset this bit. The user will be unable to read or write to/from vram
-        //   during this time.
+        //   Set by the guest, reset by the controller once the frame has been
+        //   presented, so it can be used to wait for the next host frame.
+        //   Setting it snapshots VRAM into a presented frame, once a guest does
+        //   this the display only shows presented frames (no tearing)
         // c: Clear
         //   Makes the controller clear the screen, when its done, this bit will be
         //   reset.
         // 000crtmm
-        u8 r[1] = { 0 };
-
-        // 80x25 Text mode
-        // 80x25x2 (character+attribute) = 4000 = 0xfa0, 0xa0000 + 0xfa0 = 0xa0fa0
-        std::array <0x7d0, character> text_mode_buf;
-
-        inline sf::Color get_rgb32_8bit(u8 c) {
-            u8  r = detail::clamp((((u16)c & 0xe0 /*0b11100000*/) >> 5) * 0x20),
-                g = detail::clamp((((u16)c & 0x1c /*0b00011100*/) >> 2) * 0x20),
-                b = detail::clamp( ((u16)c & 0x03 /*0b00000011*/)       * 0x40);
-            return sf::Color(r, g, b);
-        }
-
-        void render_video_buffer() {
-            u8 video_mode = r[0] & 3;
-            switch (video_mode) {
-                case 0x0: {
-                    for (int y = 0; y < 640; y++) {
-                        for (int x = 0; x < 480; x++) {
-                            buffer_draw(x, y, get_rgb32_8bit(vram[x+(y*480)]));
-                        }
-                    }
-                } break;
+        std::atomic<u8> control = 0;
+
+        // One bit per scanline, set on VRAM writes and collected once per host frame
+        std::array <std::atomic<u64>, VGA_MAX_LINES / 64 + 1> dirty = {};
+
+        // Frames presented by the guest, handed from the CPU thread to the window
+        struct frame {
+            u8 control;
+            std::vector <u8> data;
+        };
+        triple_buffer <frame> frames;
+
+        // Set while a window is consuming frames, nothing is produced otherwise
+        std::atomic<bool> presenting = false;
+        bool use_frames = false;
+
+        // Renderer state, window thread only
+        sf::Texture texture;
+        sf::Sprite sprite;
+        std::vector <u32> rgba;
+        int shown_mode = -1;
+
+        // Text mode renderer, glyphs are rasterized once into a 16x16 atlas of
+        // 8x16 cells, slot 0 is solid and used for backgrounds
+        static constexpr float text_cell_w = 640.0f / VGA_TEXT_COLUMNS,
+                               text_cell_h = 480.0f / VGA_TEXT_ROWS;
+
+        sf::Font font;
+        sf::RenderTexture atlas;
+        bool atlas_ready = false;
+
+        // 8 vertices per cell (background quad, glyph quad), drawn in one call
+        sf::VertexArray text_vertices = sf::VertexArray(sf::Quads, VGA_TEXT_COLUMNS * VGA_TEXT_ROWS * 8);
+        std::array <u16, VGA_TEXT_COLUMNS * VGA_TEXT_ROWS> shadow;
+        bool blink_on = true;
+        sf::Clock blink_clk;
+
+        inline void mark_dirty(u64 offset, u64 len) {
+            u64 first = offset / VGA_STRIDE,
+                last = std::min<u64>((offset + len - 1) / VGA_STRIDE, VGA_MAX_LINES - 1);
+
+            for (u64 l = first; l <= last; l++) {
+                dirty[l >> 6].fetch_or(1ull << (l & 63), std::memory_order_relaxed);
+            }
+        }
+
+        void mark_all_dirty() {
+            for (auto& d : dirty) d.store(~0ull, std::memory_order_relaxed);
+        }
+
+        struct mode_info { unsigned w, h; };
+        static mode_info get_mode_info(u8 mode) {
+            return (mode == 1) ? mode_info { 320, 240 } : mode_info { 640, 480 };
+        }
+
+        // Convert the dirty scanlines and upload them, consecutive lines go in one update
+        // whole converts every line, used for presented frames
+        void render_video_buffer(u8 mode, const u8* src, bool whole) {
+            TIMELINE_SCOPE("vga_render");
+            mode_info m = get_mode_info(mode);
+
+            if (mode != shown_mode) {
+                shown_mode = mode;
+                texture.create(m.w, m.h);
+                sprite.setTexture(texture, true);
+                sprite.setScale(640.0f / m.w, 480.0f / m.h);
+                rgba.assign(m.w * m.h, 0);
+                mark_all_dirty();
+            }
+
+            std::array <u64, VGA_MAX_LINES / 64 + 1> lines;
+            for (size_t i = 0; i < lines.size(); i++) lines[i] = dirty[i].exchange(0, std::memory_order_acquire) | (whole ? ~0ull : 0);
+
+            auto is_dirty = [&](unsigned l) { return (lines[l >> 6] >> (l & 63)) & 1; };
+
+            for (unsigned l = 0; l < m.h; ) {
+                if (!is_dirty(l)) { l++; continue; }
+
+                unsigned first = l;
+                for (; (l < m.h) && is_dirty(l); l++) {
+                    const u8* line = &src[l * VGA_STRIDE];
+                    u32* dst = &rgba[l * m.w];
+                    if (mode == 1) pixel::convert_rgb565(line, dst, m.w);
+                    else pixel::convert_rgb332(line, dst, m.w);
+                }
+                texture.update((const sf::Uint8*)&rgba[first * m.w], m.w, l - first, 0, first);
+            }
+        }
+
+        void build_atlas() {
+#ifdef _WIN32
+            font.loadFromFile("res/terminal.ttf");
+#else
+            font.loadFromFile("risc64/res/terminal.ttf");
+#endif
+            atlas.create(16 * 8, 16 * 16);
+            atlas.clear(sf::Color::Transparent);
+
+            sf::RectangleShape solid(sf::Vector2f(8, 16));
+            solid.setFillColor(sf::Color::White);
+            atlas.draw(solid);
+            solid.setPosition(0xb * 8, 0xd * 16); // 0xdb, full block
+            atlas.draw(solid);
+
+            sf::Text t;
+            t.setFont(font);
+            t.setCharacterSize(14);
+            t.setFillColor(sf::Color::White);
+            for (u8 c = 0x21; c < 0x7f; c++) {
+                t.setString(std::string(1, (char)c));
+                t.setPosition((c & 0xf) * 8, (c >> 4) * 16 - 1);
+                atlas.draw(t);
+            }
+            atlas.display();
+            atlas_ready = true;
+        }
+
+        inline void set_quad(size_t v, float x, float y, float u, float t, sf::Color c) {
+            text_vertices[v + 0] = sf::Vertex(sf::Vector2f(x, y), c, sf::Vector2f(u, t));
+            text_vertices[v + 1] = sf::Vertex(sf::Vector2f(x + text_cell_w, y), c, sf::Vector2f(u + 8, t));
+            text_vertices[v + 2] = sf::Vertex(sf::Vector2f(x + text_cell_w, y + text_cell_h), c, sf::Vector2f(u + 8, t + 16));
+            text_vertices[v + 3] = sf::Vertex(sf::Vector2f(x, y + text_cell_h), c, sf::Vector2f(u, t + 16));
+        }
+
+        void update_cell(size_t i, character ch) {
+            float x = (i % VGA_TEXT_COLUMNS) * text_cell_w,
+                  y = (i / VGA_TEXT_COLUMNS) * text_cell_h;
+
+            bool hidden = (ch.attr & 0x80) && !blink_on;
+
+            set_quad(i * 8, x, y, 0, 0, get_text_color((ch.attr >> 4) & 0x7));
+            set_quad(i * 8 + 4, x, y, (ch.ascii & 0xf) * 8, (ch.ascii >> 4) * 16,
+                hidden ? sf::Color::Transparent : get_text_color(ch.attr & 0xf));
+        }
+
+        // Rebuild the vertices of the cells that changed since the last frame
+        void render_text_buffer(const u8* src, bool whole) {
+            TIMELINE_SCOPE("vga_render_text");
+            if (!atlas_ready) build_atlas();
+
+            bool full = (shown_mode != 0x4) || whole;
+            shown_mode = 0x4;
+
+            // Blinking cells flip twice a second
+            bool blink = (blink_clk.getElapsedTime().asMilliseconds() % 1000) < 500,
+                 blink_flip = (blink != blink_on);
+            blink_on = blink;
+
+            bool any = false;
+            for (auto& d : dirty) any |= (d.exchange(0, std::memory_order_acquire) != 0);
+            if (!any && !full && !blink_flip) return;
+
+            for (size_t i = 0; i < shadow.size(); i++) {
+                u16 v = src[i * 2] | (src[i * 2 + 1] << 8);
+                if (!full && (v == shadow[i]) && !(blink_flip && (v & 0x8000))) continue;
+
+                shadow[i] = v;
+                update_cell(i, character(v));
             }
         }
 
@@ -74,9 +238,20 @@ namespace machine {
         // Default mmio_base maps to the real VGA base
         vga(u64 mmio_base = 0xa0000) :
             device("VGA Display Controller", mmio_base, vram.size() + 1, 0xa, device_access::a_rw) {
+                // Only the control register tail goes through the default block path
+                block_access_size = 1;
                 vram.fill(0xaa);
+                mark_all_dirty();
+                frames.for_each([](frame& f) { f.data.resize(VGA_STRIDE * VGA_MAX_LINES); });
         };
-        
+
+        void init_display() {
+            init(640, 480, "VGA Display", sf::Style::Default, false, true);
+        }
+
+        const u8* get_vram() const { return vram.data(); }
+        u8 get_control() const { return control.load(std::memory_order_relaxed); }
+
         u64 read(u64 addr, size_t size) override {
             addr = addr - base;
             // Handle register reads
@@ -85,18 +260,16 @@ namespace machine {
                     // Reads of size > 1 are invalid on VGA registers
                     return 0xffffffffffffffff;
                 }
-                return r[addr - vram.size()];
+                return control.load(std::memory_order_acquire);
             }
-            u64 q = 0;
 
-            for (int off = size - 1; off >= 0; off--) {
-                q |= ((u64)vram[addr+off]) << (8 * off);
-            }
+            u64 q = 0;
+            std::memcpy(&q, &vram[addr], std::min<u64>(size, vram.size() - addr));
             return q;
         }
 
-        #define test_bit(reg, b) (r[reg] & (1 << b))
-        void write(u64 addr, u64 value, size_t size) {
+        #define test_bit(v, b) ((v) & (1 << b))
+        void write(u64 addr, u64 value, size_t size) override {
             addr = addr - base;
             // Handle register writes
             if (addr >= vram.size()) {
@@ -104,12 +277,109 @@ namespace machine {
                     // Writes of size > 1 are invalid on VGA registers
                     return;
                 }
-                r[addr - vram.size()] = value;
 
                 // Side-effects:
-                if (test_bit(0, 5)) buffer_clear(sf::Color(0, 0, 0));
-                if (test_bit(0, 4)) render_vga_buffer();
+                if (test_bit(value, 5)) {
+                    vram.fill(0);
+                    mark_all_dirty();
+                    value &= ~(1 << 5);
+                }
+                if (test_bit(value, 4)) {
+                    // Without a window the frame counts as presented right away
+                    if (presenting.load(std::memory_order_acquire)) {
+                        TIMELINE_SCOPE("vga_present");
+                        frame& f = frames.get_back();
+                        f.control = value;
+                        std::memcpy(f.data.data(), vram.data(), f.data.size());
+                        frames.publish();
+                    } else {
+                        value &= ~(1 << 4);
+                    }
+                }
+                control.store(value, std::memory_order_release);
+                return;
+            }
+
+            size = std::min<u64>(size, vram.size() - addr);
+            std::memcpy(&vram[addr], &value, size);
+            mark_dirty(addr, size);
+        }
+        #undef test_bit
+
+        // Blits (DMA, loaders) copy straight into VRAM, the dirty bits are
+        // atomic so VRAM blits may come from device threads
+        bool is_concurrent(u64 addr, u64 len) override {
+            addr -= base;
+            return (addr < vram.size()) && (len <= vram.size() - addr);
+        }
+
+        void read_block(u64 addr, u8* dst, u64 len) override {
+            addr -= base;
+            u64 n = (addr < vram.size()) ? std::min(len, vram.size() - addr) : 0;
+            if (n) std::memcpy(dst, &vram[addr], n);
+            if (n < len) device::read_block(base + addr + n, dst + n, len - n);
+        }
+
+        void write_block(u64 addr, const u8* src, u64 len) override {
+            addr -= base;
+            u64 n = (addr < vram.size()) ? std::min(len, vram.size() - addr) : 0;
+            if (n) { std::memcpy(&vram[addr], src, n); mark_dirty(addr, n); }
+            if (n < len) device::write_block(base + addr + n, src + n, len - n);
+        }
+
+        bool load(u64 addr, const u8* src, u64 len) override {
+            addr -= base;
+            if ((addr >= vram.size()) || (len > vram.size() - addr)) return false;
+            if (src) std::memcpy(&vram[addr], src, len); else std::memset(&vram[addr], 0, len);
+            mark_dirty(addr, len);
+            return true;
+        }
+
+        void setup() override {
+            TIMELINE_THREAD("vga");
+#ifdef PERF_COUNTERS_ENABLED
+            perf::set_thread_name("vga");
+#endif
+            get_window()->setPosition(sf::Vector2i(400, 60));
+            display::apply(get_window());
+            presenting.store(true, std::memory_order_release);
+        }
+
+        void draw() override {
+            TIMELINE_SCOPE("vga_draw");
+#ifdef PERF_COUNTERS_ENABLED
+            perf::frame();
+#endif
+            u8 c = control.load(std::memory_order_acquire);
+
+            // Presented frames replace the live VRAM view, a frame is only
+            // converted when a new one arrives
+            bool fresh = frames.acquire();
+            use_frames |= fresh;
+
+            const u8* src = vram.data();
+            if (use_frames) {
+                c = frames.get_front().control;
+                src = frames.get_front().data.data();
+            }
+
+            clear(sf::Color::Black);
+
+            if (c & 0x4) {
+                render_text_buffer(src, fresh);
+                get_window()->draw(text_vertices, sf::RenderStates(&atlas.getTexture()));
+            } else {
+                render_video_buffer(c & 3, src, fresh);
+                get_window()->draw(sprite);
             }
+
+            // Frame presented, let the guest know
+            if (fresh || (!use_frames && (c & 0x10))) control.fetch_and(~0x10, std::memory_order_acq_rel);
+        }
+
+        void on_close() override {
+            presenting.store(false, std::memory_order_release);
+            close();
         }
-    }
-}
\ No newline at end of file
+    };
+}
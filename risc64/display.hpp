@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+
+#include <SFML/Graphics.hpp>
+
+#include "log.hpp"
+
+namespace machine {
+    // Host presentation settings shared by every window
+    // display=vsync (default), display=<Hz> or display=none
+    namespace display {
+        enum mode {
+            dm_vsync,
+            dm_rate,
+            dm_none  // No windows, devices skip frame production entirely
+        };
+
+        mode current = dm_vsync;
+        unsigned rate = 60;
+
+        inline bool parse(const std::string& s) {
+            if (s == "vsync") { current = dm_vsync; return true; }
+            if ((s == "none") || (s == "0")) { current = dm_none; return true; }
+
+            try { rate = std::stoul(s); } catch (...) { rate = 0; }
+            if (!rate) {
+                _log(error, "Invalid display mode \"%s\" (vsync, none or a rate in Hz)", s.c_str());
+                return false;
+            }
+            current = dm_rate;
+            return true;
+        }
+
+        inline bool enabled() { return current != dm_none; }
+
+        // Called by windows from their setup()
+        inline void apply(sf::RenderWindow* w) {
+            if (current == dm_vsync) {
+                w->setVerticalSyncEnabled(true);
+            } else {
+                w->setVerticalSyncEnabled(false);
+                w->setFramerateLimit(rate);
+            }
+        }
+    }
+}
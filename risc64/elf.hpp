@@ -0,0 +1,408 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <vector>
+#include <string>
+
+#include "aliases.hpp"
+#include "symbols.hpp"
+#include "log.hpp"
+
+namespace machine {
+    namespace elf {
+        // ELF64 on-disk structures, little-endian only
+        struct ehdr {
+            u8  ident[16];
+            u16 type, machine;
+            u32 version;
+            u64 entry, phoff, shoff;
+            u32 flags;
+            u16 ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+        };
+
+        struct phdr {
+            u32 type, flags;
+            u64 offset, vaddr, paddr, filesz, memsz, align;
+        };
+
+        struct shdr {
+            u32 name, type;
+            u64 flags, addr, offset, size;
+            u32 link, info;
+            u64 addralign, entsize;
+        };
+
+        struct sym {
+            u32 name;
+            u8  info, other;
+            u16 shndx;
+            u64 value, size;
+        };
+
+        static_assert(sizeof(ehdr) == 64, "Elf64_Ehdr must be 64 bytes");
+        static_assert(sizeof(phdr) == 56, "Elf64_Phdr must be 56 bytes");
+        static_assert(sizeof(shdr) == 64, "Elf64_Shdr must be 64 bytes");
+        static_assert(sizeof(sym) == 24, "Elf64_Sym must be 24 bytes");
+
+        enum : u32 {
+            pt_load = 1,
+            sht_symtab = 2,
+            stt_notype = 0,
+            stt_object = 1,
+            stt_func = 2
+        };
+
+        // A loadable segment, data points into the file image
+        struct segment {
+            u64 addr, filesz, memsz;
+            const u8* data;
+        };
+
+        class file {
+            std::vector <u8> image;
+            ehdr header = {};
+
+            bool in_bounds(u64 offset, u64 len) const {
+                return (offset <= image.size()) && (len <= image.size() - offset);
+            }
+
+            template <class T> bool get(u64 offset, T& out) const {
+                if (!in_bounds(offset, sizeof(T))) return false;
+                std::memcpy(&out, image.data() + offset, sizeof(T));
+                return true;
+            }
+
+            bool get_section(u16 i, shdr& s) const {
+                return (i < header.shnum) && get(header.shoff + (u64)i * header.shentsize, s);
+            }
+
+            const char* get_string(const shdr& strtab, u32 offset) const {
+                if ((offset >= strtab.size) || !in_bounds(strtab.offset, strtab.size)) return "";
+
+                // Make sure the string is terminated inside the table
+                const char* s = (const char*)image.data() + strtab.offset + offset;
+                return std::memchr(s, 0, strtab.size - offset) ? s : "";
+            }
+
+            // DWARF primitives for the line table reader
+            static u64 uleb(const u8*& p, const u8* end) {
+                u64 v = 0; int shift = 0;
+                while (p < end) {
+                    u8 b = *p++;
+                    if (shift < 64) v |= (u64)(b & 0x7f) << shift;
+                    shift += 7;
+                    if (!(b & 0x80)) break;
+                }
+                return v;
+            }
+
+            static s64 sleb(const u8*& p, const u8* end) {
+                s64 v = 0; int shift = 0; u8 b = 0;
+                while (p < end) {
+                    b = *p++;
+                    if (shift < 64) v |= (s64)(b & 0x7f) << shift;
+                    shift += 7;
+                    if (!(b & 0x80)) break;
+                }
+                if ((shift < 64) && (b & 0x40)) v |= -((s64)1 << shift);
+                return v;
+            }
+
+            static u64 fixed(const u8*& p, const u8* end, size_t n) {
+                u64 v = 0;
+                if ((size_t)(end - p) < n) { p = end; return 0; }
+                std::memcpy(&v, p, std::min<size_t>(n, 8));
+                p += n;
+                return v;
+            }
+
+            static std::string cstr(const u8*& p, const u8* end) {
+                const u8* s = p;
+                while ((p < end) && *p) p++;
+                std::string r((const char*)s, p - s);
+                if (p < end) p++;
+                return r;
+            }
+
+            const u8* find_section(const char* name, u64& len) const {
+                shdr names, s;
+                if (!get_section(header.shstrndx, names)) return nullptr;
+
+                for (u16 i = 0; i < header.shnum; i++) {
+                    if (!get_section(i, s) || std::strcmp(get_string(names, s.name), name)) continue;
+                    if (!in_bounds(s.offset, s.size)) return nullptr;
+                    len = s.size;
+                    return image.data() + s.offset;
+                }
+                return nullptr;
+            }
+
+            // Read a DWARF 5 entry format string/number attribute
+            std::string read_form(u64 form, const u8*& p, const u8* end, bool dwarf64, u64& num) const {
+                num = 0;
+                switch (form) {
+                    case 0x08: return cstr(p, end);                 // DW_FORM_string
+                    case 0x0e: case 0x1f: {                         // DW_FORM_strp, DW_FORM_line_strp
+                        u64 off = fixed(p, end, dwarf64 ? 8 : 4), len = 0;
+                        const u8* strs = find_section((form == 0x0e) ? ".debug_str" : ".debug_line_str", len);
+                        if (!strs || (off >= len)) return "";
+                        const u8* s = strs + off;
+                        return cstr(s, strs + len);
+                    }
+                    case 0x0f: num = uleb(p, end); return "";       // DW_FORM_udata
+                    case 0x0b: num = fixed(p, end, 1); return "";   // DW_FORM_data1
+                    case 0x05: num = fixed(p, end, 2); return "";   // DW_FORM_data2
+                    case 0x06: num = fixed(p, end, 4); return "";   // DW_FORM_data4
+                    case 0x07: num = fixed(p, end, 8); return "";   // DW_FORM_data8
+                    case 0x1e: p = std::min(p + 16, end); return "";// DW_FORM_data16
+                    case 0x09: { u64 n = uleb(p, end); p = ((u64)(end - p) < n) ? end : p + n; return ""; } // DW_FORM_block
+                    default: p = end; return "";
+                }
+            }
+
+            // Walk one .debug_line unit, returns a pointer past it
+            const u8* import_line_unit(const u8* p, const u8* end, symbols::table& t) const {
+                bool dwarf64 = false;
+                u64 unit_length = fixed(p, end, 4);
+                if (unit_length == 0xffffffff) { dwarf64 = true; unit_length = fixed(p, end, 8); }
+                if ((u64)(end - p) < unit_length) return end;
+
+                const u8* unit_end = p + unit_length;
+                u16 version = fixed(p, unit_end, 2);
+                if ((version < 2) || (version > 5)) {
+                    _log(warning, "Skipping DWARF %u line table", version);
+                    return unit_end;
+                }
+
+                u8 address_size = 8;
+                if (version >= 5) {
+                    address_size = fixed(p, unit_end, 1);
+                    fixed(p, unit_end, 1); // segment_selector_size
+                }
+
+                u64 header_length = fixed(p, unit_end, dwarf64 ? 8 : 4);
+                if ((u64)(unit_end - p) < header_length) return unit_end;
+                const u8* program = p + header_length;
+
+                u8 min_inst_length = fixed(p, program, 1);
+                if (version >= 4) fixed(p, program, 1); // maximum_operations_per_instruction
+                bool default_is_stmt = fixed(p, program, 1);
+                s8 line_base = (s8)fixed(p, program, 1);
+                u8 line_range = fixed(p, program, 1),
+                   opcode_base = fixed(p, program, 1);
+                if (!line_range || !opcode_base) return unit_end;
+
+                std::vector <u8> opcode_lengths(opcode_base, 0);
+                for (u8 i = 1; i < opcode_base; i++) opcode_lengths[i] = fixed(p, program, 1);
+
+                std::vector <std::string> dirs;
+                std::vector <u32> files; // table file ids
+
+                auto add_file = [&](const std::string& name, u64 dir) {
+                    std::string path = name;
+                    if ((name.size() && (name[0] != '/')) && (dir < dirs.size()) && dirs[dir].size()) {
+                        path = dirs[dir] + "/" + name;
+                    }
+                    files.push_back(t.add_file(path));
+                };
+
+                if (version >= 5) {
+                    // Directory and file tables are described by entry formats
+                    auto read_table = [&](bool is_files) {
+                        u8 format_count = fixed(p, program, 1);
+                        std::vector <std::pair<u64, u64>> format;
+                        for (u8 i = 0; i < format_count; i++) {
+                            u64 type = uleb(p, program);
+                            format.push_back({ type, uleb(p, program) });
+                        }
+
+                        u64 count = uleb(p, program);
+                        for (u64 i = 0; (i < count) && (p < program); i++) {
+                            std::string name; u64 dir = 0, num;
+                            for (auto& f : format) {
+                                std::string s = read_form(f.second, p, program, dwarf64, num);
+                                if (f.first == 1) name = s;     // DW_LNCT_path
+                                if (f.first == 2) dir = num;    // DW_LNCT_directory_index
+                            }
+                            if (is_files) add_file(name, dir); else dirs.push_back(name);
+                        }
+                    };
+
+                    read_table(false);
+                    read_table(true);
+                } else {
+                    // Directory 0 is the compilation directory, which isn't recorded here
+                    dirs.push_back("");
+                    while ((p < program) && *p) dirs.push_back(cstr(p, program));
+                    p++;
+
+                    // File indices start at 1 before DWARF 5
+                    files.push_back(t.add_file("<unknown>"));
+                    while ((p < program) && *p) {
+                        std::string name = cstr(p, program);
+                        u64 dir = uleb(p, program);
+                        uleb(p, program); uleb(p, program); // mtime, length
+                        add_file(name, dir);
+                    }
+                }
+
+                // Line number program state machine
+                p = program;
+
+                u64 address = 0, file = 1, line = 1;
+                bool is_stmt = default_is_stmt;
+
+                auto reset = [&]() { address = 0; file = 1; line = 1; is_stmt = default_is_stmt; };
+                auto row = [&](bool end_sequence) {
+                    u32 id = (file < files.size()) ? files[file] : files.size() ? files[0] : t.add_file("<unknown>");
+                    t.add_line(address, id, end_sequence ? 0 : line);
+                };
+
+                while (p < unit_end) {
+                    u8 op = *p++;
+
+                    if (op >= opcode_base) {
+                        // Special opcode
+                        u8 adj = op - opcode_base;
+                        address += (u64)(adj / line_range) * min_inst_length;
+                        line += line_base + (adj % line_range);
+                        row(false);
+                        continue;
+                    }
+
+                    switch (op) {
+                        case 0: {
+                            // Extended opcode
+                            u64 len = uleb(p, unit_end);
+                            if (!len || ((u64)(unit_end - p) < len)) return unit_end;
+                            const u8* next = p + len;
+                            u8 sub = *p++;
+
+                            switch (sub) {
+                                case 1: row(true); reset(); break;                          // DW_LNE_end_sequence
+                                case 2: address = fixed(p, next, std::min<u64>(len - 1, address_size)); break; // DW_LNE_set_address
+                                case 3: {                                                   // DW_LNE_define_file
+                                    std::string name = cstr(p, next);
+                                    add_file(name, uleb(p, next));
+                                } break;
+                                default: break;
+                            }
+                            p = next;
+                        } break;
+
+                        case 1: row(false); break;                                          // DW_LNS_copy
+                        case 2: address += uleb(p, unit_end) * min_inst_length; break;      // DW_LNS_advance_pc
+                        case 3: line += sleb(p, unit_end); break;                           // DW_LNS_advance_line
+                        case 4: file = uleb(p, unit_end); break;                            // DW_LNS_set_file
+                        case 6: is_stmt = !is_stmt; break;                                  // DW_LNS_negate_stmt
+                        case 8: address += (u64)((255 - opcode_base) / line_range) * min_inst_length; break; // DW_LNS_const_add_pc
+                        case 9: address += fixed(p, unit_end, 2); break;                    // DW_LNS_fixed_advance_pc
+
+                        default:
+                            // Everything else only carries ULEB operands we don't use
+                            for (u8 i = 0; i < opcode_lengths[op]; i++) uleb(p, unit_end);
+                            break;
+                    }
+                }
+
+                return unit_end;
+            }
+
+        public:
+            bool open(const std::string& name) {
+                std::ifstream f(name, std::ios::binary | std::ios::ate);
+                if (!f.is_open()) {
+                    _log(error, "Couldn't open ELF file \"%s\"", name.c_str());
+                    return false;
+                }
+
+                std::streamoff size = f.tellg();
+                if (size < 0) {
+                    _log(error, "Couldn't read ELF file \"%s\"", name.c_str());
+                    return false;
+                }
+                image.resize(size);
+                f.seekg(0);
+                f.read((char*)image.data(), image.size());
+
+                if (!get(0, header) || std::memcmp(header.ident, "\x7f" "ELF", 4)) {
+                    _log(error, "\"%s\" isn't an ELF file", name.c_str());
+                    return false;
+                }
+
+                // ELFCLASS64, ELFDATA2LSB
+                if ((header.ident[4] != 2) || (header.ident[5] != 1)) {
+                    _log(error, "\"%s\" isn't a little-endian ELF64 file", name.c_str());
+                    return false;
+                }
+
+                if ((header.phnum && (header.phentsize < sizeof(phdr))) ||
+                    (header.shnum && (header.shentsize < sizeof(shdr)))) {
+                    _log(error, "\"%s\" has malformed program or section headers", name.c_str());
+                    return false;
+                }
+
+                return true;
+            }
+
+            u64 get_entry() const { return header.entry; }
+
+            // PT_LOAD segments, placed at their physical addresses
+            std::vector <segment> get_segments() const {
+                std::vector <segment> v;
+                phdr ph;
+
+                for (u16 i = 0; i < header.phnum; i++) {
+                    if (!get(header.phoff + (u64)i * header.phentsize, ph) || (ph.type != pt_load)) continue;
+
+                    if (!in_bounds(ph.offset, ph.filesz) || (ph.filesz > ph.memsz)) {
+                        _log(warning, "Skipping malformed ELF segment %u", i);
+                        continue;
+                    }
+                    v.push_back({ ph.paddr, ph.filesz, ph.memsz, image.data() + ph.offset });
+                }
+                return v;
+            }
+
+            // Import function and object symbols from .symtab, returns the count
+            size_t import_symbols(symbols::table& t) const {
+                size_t n = 0;
+                shdr s, strtab;
+
+                for (u16 i = 0; i < header.shnum; i++) {
+                    if (!get_section(i, s) || (s.type != sht_symtab) || !get_section(s.link, strtab)) continue;
+                    if (!in_bounds(s.offset, s.size) || (s.entsize < sizeof(sym))) continue;
+
+                    for (u64 off = 0; off + sizeof(sym) <= s.size; off += s.entsize) {
+                        sym e;
+                        get(s.offset + off, e);
+
+                        u8 type = e.info & 0xf;
+                        if (!e.shndx || ((type != stt_func) && (type != stt_object) && (type != stt_notype))) continue;
+
+                        const char* name = get_string(strtab, e.name);
+                        if (!*name) continue;
+
+                        t.add_symbol(e.value, e.size, name);
+                        n++;
+                    }
+                }
+                return n;
+            }
+
+            // Import .debug_line rows, returns the number of rows added
+            size_t import_lines(symbols::table& t) const {
+                u64 len = 0;
+                const u8* p = find_section(".debug_line", len);
+                if (!p) return 0;
+
+                size_t before = t.get_line_count();
+                const u8* end = p + len;
+                while (p < end) p = import_line_unit(p, end, t);
+                return t.get_line_count() - before;
+            }
+        };
+    }
+}
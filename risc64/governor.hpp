@@ -0,0 +1,152 @@
+#pragma once
+
+#include <condition_variable>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <string>
+
+#include "aliases.hpp"
+#include "timeline.hpp"
+#include "log.hpp"
+
+// Throttled quanta are sized to about this long
+#define GOVERNOR_QUANTUM_US 1000
+
+// Falling further behind than this resets the pace instead of bursting to catch up
+#define GOVERNOR_MAX_LAG std::chrono::milliseconds(100)
+
+// How often the achieved speed is measured
+#define GOVERNOR_REPORT_INTERVAL std::chrono::milliseconds(500)
+
+// Longest a CPU waiting for input sleeps before running a quantum (timers still tick)
+#define GOVERNOR_INPUT_WAIT std::chrono::milliseconds(10)
+
+namespace machine {
+    // Guest clock speed governor, called by the CPU loop between quanta
+    // Settings may be changed from any thread (the control window), the pacing
+    // state belongs to the CPU thread
+    class governor {
+    public:
+        enum mode {
+            gm_turbo,      // Unthrottled
+            gm_throttled,  // Paced to target_hz retired instructions per second
+            gm_input       // Unthrottled, but sleeps while the guest polls for input that isn't there
+        };
+
+    private:
+        typedef std::chrono::steady_clock clock_t;
+
+        std::atomic<mode> m = gm_turbo;
+        std::atomic<u64> target_hz = 10000000;
+
+        // Bumped on every setting change so the CPU thread re-bases its pace
+        std::atomic<u64> generation = 0;
+        u64 seen_generation = ~0ull;
+
+        // Pace, CPU thread only
+        clock_t::time_point base;
+        u64 since_base = 0;
+
+        // Achieved speed, written by the CPU thread
+        std::atomic<u64> achieved_hz = 0;
+        clock_t::time_point report_start = clock_t::now();
+        u64 report_count = 0;
+
+        // Input wait, idle is set by devices when the guest polls an empty input
+        // queue during a quantum, ready when input arrives
+        std::atomic<bool> idle = false, ready = false;
+        std::mutex input_mutex;
+        std::condition_variable input_cv;
+
+        void rebase() {
+            base = clock_t::now();
+            since_base = 0;
+        }
+
+        void pace(size_t retired) {
+            since_base += retired;
+
+            auto due = base + std::chrono::nanoseconds((u64)((double)since_base * 1e9 / target_hz.load(std::memory_order_relaxed)));
+            auto now = clock_t::now();
+
+            if (now - due > GOVERNOR_MAX_LAG) { rebase(); return; }
+            if (due <= now) return;
+
+            TIMELINE_SCOPE("governor_sleep");
+            // Sleep most of the way, then yield to land close to the deadline
+            if (due - now > std::chrono::microseconds(1500)) std::this_thread::sleep_until(due - std::chrono::microseconds(500));
+            while (clock_t::now() < due) std::this_thread::yield();
+        }
+
+        void wait_for_input() {
+            TIMELINE_SCOPE("governor_input_wait");
+            std::unique_lock <std::mutex> lock(input_mutex);
+            input_cv.wait_for(lock, GOVERNOR_INPUT_WAIT, [this] { return ready.load(std::memory_order_relaxed); });
+            ready.store(false, std::memory_order_relaxed);
+        }
+
+    public:
+        void set_mode(mode md) { m = md; generation++; input_available(); }
+        void set_target(u64 hz) { target_hz = std::max<u64>(hz, 1); generation++; }
+
+        mode get_mode() const { return m.load(std::memory_order_relaxed); }
+        u64 get_target() const { return target_hz.load(std::memory_order_relaxed); }
+        u64 get_achieved() const { return achieved_hz.load(std::memory_order_relaxed); }
+
+        // clock=turbo|input|<Hz>
+        bool parse(const std::string& s) {
+            if (s == "turbo") { set_mode(gm_turbo); return true; }
+            if (s == "input") { set_mode(gm_input); return true; }
+
+            u64 hz = 0;
+            try { hz = std::stoull(s, nullptr, 0); } catch (...) {}
+            if (!hz) {
+                _log(error, "Invalid clock setting \"%s\" (turbo, input or a frequency in Hz)", s.c_str());
+                return false;
+            }
+            set_target(hz);
+            set_mode(gm_throttled);
+            return true;
+        }
+
+        // Instructions the CPU should run before calling end_quantum()
+        size_t get_quantum(size_t max) const {
+            if (get_mode() != gm_throttled) return max;
+            return std::clamp<size_t>(get_target() * GOVERNOR_QUANTUM_US / 1000000, 1, max);
+        }
+
+        // Called by devices (keyboard registers) when the guest finds no input
+        void input_polled_empty() { idle.store(true, std::memory_order_relaxed); }
+
+        // Called by whatever produces input, wakes a waiting CPU
+        void input_available() {
+            std::lock_guard <std::mutex> lock(input_mutex);
+            ready.store(true, std::memory_order_relaxed);
+            input_cv.notify_all();
+        }
+
+        // CPU thread, after every quantum
+        void end_quantum(size_t retired) {
+            u64 g = generation.load(std::memory_order_acquire);
+            if (g != seen_generation) { seen_generation = g; rebase(); }
+
+            switch (get_mode()) {
+                case gm_throttled: pace(retired); break;
+                case gm_input: if (idle.exchange(false, std::memory_order_relaxed)) wait_for_input(); break;
+                default: break;
+            }
+
+            report_count += retired;
+            auto now = clock_t::now();
+            if (now - report_start >= GOVERNOR_REPORT_INTERVAL) {
+                double s = std::chrono::duration<double>(now - report_start).count();
+                achieved_hz.store((u64)(report_count / s), std::memory_order_relaxed);
+                report_start = now;
+                report_count = 0;
+            }
+        }
+    };
+}
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#include "aliases.hpp"
+#include "device.hpp"
+#include "log.hpp"
+
+// Comment this out to compile the bus access counters out
+#define BUS_HEATMAP_ENABLED
+
+// Threads with their own counter slot, the rest share the last one
+#ifndef HEATMAP_MAX_THREADS
+#define HEATMAP_MAX_THREADS 8
+#endif
+
+// Cells allocated together on first touch
+#define HEATMAP_CHUNK_CELLS 256
+
+// Cells per device, larger devices get coarser cells
+#define HEATMAP_MAX_CELLS (1 << 20)
+
+namespace machine {
+    namespace heatmap {
+        // Access kinds
+        enum access {
+            h_read,
+            h_write,
+            h_exec,
+            h_count
+        };
+
+        // Sampled counters for a single page (or cache line), written by the sampler
+        struct cell {
+            // Accesses since startup
+            std::atomic<u32> count[h_count] = { 0, 0, 0 };
+
+            // Accesses during the last sampling interval
+            std::atomic<u32> delta[h_count] = { 0, 0, 0 };
+
+            u32 prev[h_count] = { 0, 0, 0 };
+        };
+
+        // The CPU thread and device threads (DMA, block I/O) count into their
+        // own slot so the hot path is a single-writer increment like perf.hpp,
+        // threads past the last slot share it with locked adds
+        inline size_t thread_slot() {
+            static std::atomic<size_t> next = 0;
+            thread_local size_t slot = std::min<size_t>(next.fetch_add(1, std::memory_order_relaxed), HEATMAP_MAX_THREADS - 1);
+            return slot;
+        }
+
+        // Counter array covering a device's bus allocation
+        // Cells are allocated a chunk at a time on first touch, so untouched
+        // memory costs a null pointer per chunk
+        class region {
+            struct chunk {
+                std::atomic<u32> hits[HEATMAP_MAX_THREADS][HEATMAP_CHUNK_CELLS][h_count] = {};
+                cell cells[HEATMAP_CHUNK_CELLS];
+            };
+
+            machine::device* dev = nullptr;
+            std::unique_ptr<std::atomic<chunk*>[]> chunks;
+            size_t cell_count = 0, chunk_count = 0, shift = 12;
+
+            // Cells touched during the last sampling interval
+            std::atomic<size_t> working_set = 0;
+
+            // Racing threads may both allocate, the loser frees its copy
+            chunk* allocate(size_t i) {
+                chunk* c = new chunk();
+                chunk* expected = nullptr;
+                if (!chunks[i].compare_exchange_strong(expected, c, std::memory_order_acq_rel)) {
+                    delete c;
+                    return expected;
+                }
+                return c;
+            }
+
+        public:
+            region(machine::device* d, size_t shift) : dev(d), shift(shift) {
+                // Coarsen cells on large devices to bound the sampler and panel walks
+                while (((d->get_size() >> this->shift) + 1) > HEATMAP_MAX_CELLS) this->shift++;
+                if (this->shift != shift) {
+                    _log(warning, "Heatmap cells for \"%s\" coarsened to %llu bytes", d->get_name().c_str(), 1ull << this->shift);
+                }
+
+                cell_count = (d->get_size() >> this->shift) + 1;
+                chunk_count = (cell_count + HEATMAP_CHUNK_CELLS - 1) / HEATMAP_CHUNK_CELLS;
+                chunks = std::make_unique<std::atomic<chunk*>[]>(chunk_count);
+            }
+
+            ~region() {
+                for (size_t i = 0; i < chunk_count; i++) delete chunks[i].load(std::memory_order_relaxed);
+            }
+
+            machine::device* get_device() { return dev; }
+            size_t get_cell_count() const { return cell_count; }
+            size_t get_shift() const { return shift; }
+            size_t get_working_set() const { return working_set.load(std::memory_order_relaxed); }
+
+            // Cells that were never touched read as zero
+            const cell& get_cell(size_t i) {
+                static const cell empty;
+                chunk* c = chunks[i / HEATMAP_CHUNK_CELLS].load(std::memory_order_acquire);
+                return c ? c->cells[i % HEATMAP_CHUNK_CELLS] : empty;
+            }
+
+            inline void touch(u64 offset, access a) {
+                size_t i = offset >> shift;
+                if (i >= cell_count) return;
+
+                chunk* c = chunks[i / HEATMAP_CHUNK_CELLS].load(std::memory_order_acquire);
+                if (!c) c = allocate(i / HEATMAP_CHUNK_CELLS);
+
+                size_t slot = thread_slot();
+                std::atomic<u32>& h = c->hits[slot][i % HEATMAP_CHUNK_CELLS][a];
+                if (slot == HEATMAP_MAX_THREADS - 1) {
+                    h.fetch_add(1, std::memory_order_relaxed);
+                } else {
+                    h.store(h.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                }
+            }
+
+            // Latch per-cell deltas, returns the number of cells touched since the last sample
+            size_t sample(u64* totals) {
+                size_t touched = 0;
+                for (size_t k = 0; k < chunk_count; k++) {
+                    chunk* ch = chunks[k].load(std::memory_order_acquire);
+                    if (!ch) continue;
+
+                    for (size_t i = 0; i < HEATMAP_CHUNK_CELLS; i++) {
+                        cell& c = ch->cells[i];
+                        bool t = false;
+                        for (int a = 0; a < h_count; a++) {
+                            u32 v = 0;
+                            for (size_t s = 0; s < HEATMAP_MAX_THREADS; s++) v += ch->hits[s][i][a].load(std::memory_order_relaxed);
+
+                            u32 d = v - c.prev[a];
+                            c.prev[a] = v;
+                            c.count[a].store(v, std::memory_order_relaxed);
+                            c.delta[a].store(d, std::memory_order_relaxed);
+                            totals[a] += d;
+                            t |= (d != 0);
+                        }
+                        touched += t;
+                    }
+                }
+                working_set.store(touched, std::memory_order_relaxed);
+                return touched;
+            }
+        };
+
+        bool enabled = false;
+        size_t sample_interval_ms = 100;
+
+        std::vector <std::unique_ptr<region>> regions;
+
+        // Working set time series, streamed as CSV by the sampler so it
+        // doesn't grow in memory over long runs
+        std::string export_file;
+        std::ofstream series;
+        u64 series_rows = 0;
+
+        std::atomic<bool> sampler_running = false;
+        std::thread sampler;
+
+        void sample_all(u64 time_ms) {
+            for (size_t i = 0; i < regions.size(); i++) {
+                region& r = *regions[i];
+                u64 accesses[h_count] = { 0, 0, 0 };
+                u64 touched = r.sample(accesses);
+                if (!series.is_open()) continue;
+
+                series << time_ms << ",\"" << r.get_device()->get_name() << "\","
+                       << touched << "," << (touched << r.get_shift()) << ","
+                       << accesses[h_read] << "," << accesses[h_write] << "," << accesses[h_exec] << "\n";
+                series_rows++;
+            }
+        }
+
+        void sampler_loop() {
+            auto start = std::chrono::steady_clock::now();
+            while (sampler_running.load(std::memory_order_relaxed)) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(sample_interval_ms));
+                auto t = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+                sample_all(t.count());
+            }
+        }
+
+        // Create counter regions for every accessible device on the bus
+        // shift selects the counter granularity, 12 for 4K pages, 6 for 64 byte lines
+        template <class Devices> void init(Devices& devices, size_t shift = 12, size_t interval_ms = 100, const std::string& file = "") {
+            for (auto d : devices) {
+                if (d->get_access_mode() == device::access_mode::a_none) continue;
+                regions.push_back(std::make_unique<region>(d, shift));
+                d->set_heatmap(regions.back().get());
+            }
+
+            sample_interval_ms = std::max<size_t>(interval_ms, 1);
+            export_file = file;
+            if (export_file.size()) {
+                series.open(export_file);
+                if (series.is_open()) series << "time_ms,device,working_set_cells,working_set_bytes,reads,writes,execs\n";
+                else _log(warning, "Couldn't open heatmap export file \"%s\"", export_file.c_str());
+            }
+            enabled = true;
+
+            sampler_running = true;
+            sampler = std::thread(&sampler_loop);
+        }
+
+        void close() {
+            if (!enabled) return;
+
+            sampler_running = false;
+            if (sampler.joinable()) sampler.join();
+
+            if (series.is_open()) {
+                series.close();
+                _log(info, "Wrote %llu heatmap samples to \"%s\"", (unsigned long long)series_rows, export_file.c_str());
+            }
+        }
+    }
+}
@@ -7,19 +7,50 @@
 #include "../risc64/devices/bios.hpp"
 #include "../risc64/devices/memory.hpp"
 #include "../risc64/devices/ioctl.hpp"
+#include "../risc64/devices/pic.hpp"
+#include "../risc64/devices/dma.hpp"
+#include "../risc64/devices/block.hpp"
+#include "../risc64/devices/vga.hpp"
+#include "../risc64/devices/timer.hpp"
+#include "../risc64/devices/pmu.hpp"
+#include "../risc64/scheduler.hpp"
+#include "../risc64/governor.hpp"
+#include "../risc64/elf.hpp"
+#include "../risc64/capture.hpp"
 
 #include "log.hpp"
 
 namespace machine {
     typedef std::array<std::shared_ptr<sf::Thread>, CPU_THREAD_COUNT> cpu_thread_array_t;
-    typedef machine::memory<0xffff> dev_memory_t;
+    typedef machine::memory dev_memory_t;
+
+    // Event scheduler, advanced by cpu0
+    machine::scheduler events;
+
+    // Speed governor for cpu0
+    machine::governor cpu_governor;
+
+    // Cycle-cost model for cpu0
+    timing::model cpu_timing;
 
     // Devices
     machine::ioctl  dev_ioctl(0x2000ull, 1);
     machine::bios   dev_bios ("SimpleBIOS");
     machine::cpu    dev_proc (0);
     dev_memory_t    dev_mmem(0x10000ull);
+    machine::pic    dev_pic (0x3000ull);
+    machine::dma    dev_dma (0x3100ull, &dev_pic);
+    machine::block_device dev_disk(0x3200ull, &dev_pic);
+    machine::vga    dev_vga;
+    machine::timer  dev_timer(0x3300ull, &dev_pic, &events);
+    machine::pmu    dev_pmu  (0x3400ull, &dev_pic);
 
     // Pointers to CPU thread instances
     cpu_thread_array_t cpu_thread_sp_array;
+
+    // Instruction tracer for cpu0
+    trace::buffer cpu_tracer;
+
+    // Cache hierarchy model for cpu0
+    cache::hierarchy cpu_cache;
 }
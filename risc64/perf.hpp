@@ -0,0 +1,199 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <array>
+
+#ifdef __linux__
+    #include <pthread.h>
+    #include <time.h>
+#endif
+
+#include "aliases.hpp"
+
+// Comment this out to compile the performance counters out
+#define PERF_COUNTERS_ENABLED
+
+#ifndef BUS_MAX_DEVICES
+#define BUS_MAX_DEVICES 20
+#endif
+
+// Samples kept for the rolling graphs
+#define PERF_HISTORY_SIZE 120
+
+namespace machine {
+    namespace perf {
+        // Counters owned by a single thread, aligned so shards never share a cache line
+        // Only the owning thread writes them, other threads just read
+        struct alignas(64) shard {
+            std::string name;
+
+#ifdef __linux__
+            clockid_t clock;
+            bool has_clock = false;
+#endif
+
+            std::atomic<u64> instructions = 0,
+                             frames = 0,
+                             frame_ns = 0;
+
+            std::array <std::atomic<u64>, BUS_MAX_DEVICES> reads = {},
+                                                           writes = {};
+
+            u64 last_frame = 0;
+        };
+
+        std::mutex shards_mutex;
+        std::vector <std::unique_ptr<shard>> shards;
+
+        const auto epoch = std::chrono::steady_clock::now();
+
+        inline u64 now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+        }
+
+        inline shard* get_shard() {
+            thread_local shard* s = nullptr;
+            if (!s) {
+                std::lock_guard <std::mutex> lock(shards_mutex);
+                shards.push_back(std::make_unique<shard>());
+                s = shards.back().get();
+                s->name = "thread" + std::to_string(shards.size());
+#ifdef __linux__
+                s->has_clock = !pthread_getcpuclockid(pthread_self(), &s->clock);
+#endif
+            }
+            return s;
+        }
+
+        // Name the calling thread in the performance tab
+        inline void set_thread_name(const std::string& name) {
+            shard* s = get_shard();
+            std::lock_guard <std::mutex> lock(shards_mutex);
+            s->name = name;
+        }
+
+        // Single-writer increment, no locked RMW needed
+        inline void add(std::atomic<u64>& c, u64 v) {
+            c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+        }
+
+        inline void count_instructions(u64 n) { add(get_shard()->instructions, n); }
+
+        inline void count_read(size_t device) {
+            if (device < BUS_MAX_DEVICES) add(get_shard()->reads[device], 1);
+        }
+
+        inline void count_write(size_t device) {
+            if (device < BUS_MAX_DEVICES) add(get_shard()->writes[device], 1);
+        }
+
+        // Call once per presented frame from a window thread
+        inline void frame() {
+            shard* s = get_shard();
+            u64 t = now();
+            if (s->last_frame) s->frame_ns.store(t - s->last_frame, std::memory_order_relaxed);
+            s->last_frame = t;
+            add(s->frames, 1);
+        }
+
+        // CPU time consumed by a shard's thread in ns, 0 if unsupported
+        inline u64 thread_cpu_ns(shard& s) {
+#ifdef __linux__
+            timespec ts;
+            if (s.has_clock && !clock_gettime(s.clock, &ts)) {
+                return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+            }
+#endif
+            return 0;
+        }
+
+        // Rolling history of a single value
+        struct history {
+            std::array <float, PERF_HISTORY_SIZE> values = {};
+            size_t offset = 0;
+
+            void push(float v) {
+                values[offset] = v;
+                offset = (offset + 1) % PERF_HISTORY_SIZE;
+            }
+
+            float last() const { return values[(offset + PERF_HISTORY_SIZE - 1) % PERF_HISTORY_SIZE]; }
+            float max() const { return *std::max_element(values.begin(), values.end()); }
+        };
+
+        // Sums all shards periodically, owned by the UI thread
+        class monitor {
+            u64 last_time = 0, last_instructions = 0;
+            std::array <u64, BUS_MAX_DEVICES> last_reads = {}, last_writes = {};
+            std::vector <u64> last_cpu;
+
+        public:
+            u64 instructions = 0;
+            history mips;
+            std::array <float, BUS_MAX_DEVICES> read_rate = {}, write_rate = {};
+
+            struct thread_info {
+                std::string name;
+                float cpu_usage;
+                float frame_ms;
+                history cpu;
+            };
+
+            std::vector <thread_info> threads;
+
+            // Take a sample if at least interval_ms passed since the last one
+            void update(u64 interval_ms = 250) {
+                u64 t = now();
+                if (last_time && ((t - last_time) < interval_ms * 1000000ull)) return;
+
+                double dt = last_time ? (t - last_time) / 1e9 : 0.0;
+
+                std::lock_guard <std::mutex> lock(shards_mutex);
+
+                u64 ins = 0;
+                std::array <u64, BUS_MAX_DEVICES> reads = {}, writes = {};
+                for (auto& s : shards) {
+                    ins += s->instructions.load(std::memory_order_relaxed);
+                    for (size_t d = 0; d < BUS_MAX_DEVICES; d++) {
+                        reads[d] += s->reads[d].load(std::memory_order_relaxed);
+                        writes[d] += s->writes[d].load(std::memory_order_relaxed);
+                    }
+                }
+
+                instructions = ins;
+                if (dt > 0.0) {
+                    mips.push((ins - last_instructions) / dt / 1e6);
+                    for (size_t d = 0; d < BUS_MAX_DEVICES; d++) {
+                        read_rate[d] = (reads[d] - last_reads[d]) / dt;
+                        write_rate[d] = (writes[d] - last_writes[d]) / dt;
+                    }
+                }
+
+                last_instructions = ins;
+                last_reads = reads;
+                last_writes = writes;
+
+                threads.resize(shards.size());
+                last_cpu.resize(shards.size(), 0);
+                for (size_t i = 0; i < shards.size(); i++) {
+                    u64 c = thread_cpu_ns(*shards[i]);
+                    threads[i].name = shards[i]->name;
+                    threads[i].frame_ms = shards[i]->frame_ns.load(std::memory_order_relaxed) / 1e6f;
+                    if (dt > 0.0) {
+                        threads[i].cpu_usage = (c - last_cpu[i]) / (dt * 1e7);
+                        threads[i].cpu.push(threads[i].cpu_usage);
+                    }
+                    last_cpu[i] = c;
+                }
+
+                last_time = t;
+            }
+        };
+    }
+}
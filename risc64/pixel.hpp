@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstring>
+#include <array>
+
+#include "aliases.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+    #include <emmintrin.h>
+    #define PIXEL_SSE2
+#endif
+
+namespace machine {
+    // Guest pixel formats to host RGBA8888 (r in the lowest byte, as SFML expects)
+    namespace pixel {
+        // RGB332: rrrgggbb, components are scaled by 0x20/0x20/0x40
+        inline u32 rgb332(u8 c) {
+            u32 r = ((c >> 5) & 7) * 0x20,
+                g = ((c >> 2) & 7) * 0x20,
+                b = (c & 3) * 0x40;
+            return r | (g << 8) | (b << 16) | 0xff000000;
+        }
+
+        // RGB565: rrrrrggggggbbbbb, components are expanded to 8 bits
+        inline u32 rgb565(u16 c) {
+            u32 r = (c >> 11) & 0x1f,
+                g = (c >> 5) & 0x3f,
+                b = c & 0x1f;
+            r = (r << 3) | (r >> 2);
+            g = (g << 2) | (g >> 4);
+            b = (b << 3) | (b >> 2);
+            return r | (g << 8) | (b << 16) | 0xff000000;
+        }
+
+        namespace detail {
+            inline const std::array <u32, 256>& rgb332_lut() {
+                static const std::array <u32, 256> lut = [] {
+                    std::array <u32, 256> l;
+                    for (size_t i = 0; i < 256; i++) l[i] = rgb332(i);
+                    return l;
+                }();
+                return lut;
+            }
+
+#ifdef PIXEL_SSE2
+            // Interleave 8 lanes of r|g<<8 and b|a<<8 into 8 RGBA pixels
+            inline void store_rgba(u32* dst, __m128i rg, __m128i ba) {
+                _mm_storeu_si128((__m128i*)dst,       _mm_unpacklo_epi16(rg, ba));
+                _mm_storeu_si128((__m128i*)(dst + 4), _mm_unpackhi_epi16(rg, ba));
+            }
+
+            // 8 RGB332 pixels in the low bytes of 16-bit lanes
+            inline void convert_rgb332_8(__m128i v, u32* dst) {
+                const __m128i m3 = _mm_set1_epi16(7), m2 = _mm_set1_epi16(3), alpha = _mm_set1_epi16((short)0xff00);
+                __m128i r = _mm_slli_epi16(_mm_and_si128(_mm_srli_epi16(v, 5), m3), 5),
+                        g = _mm_slli_epi16(_mm_and_si128(_mm_srli_epi16(v, 2), m3), 5),
+                        b = _mm_slli_epi16(_mm_and_si128(v, m2), 6);
+                store_rgba(dst, _mm_or_si128(r, _mm_slli_epi16(g, 8)), _mm_or_si128(b, alpha));
+            }
+#endif
+        }
+
+        // Convert n RGB332 pixels
+        inline void convert_rgb332(const u8* src, u32* dst, size_t n) {
+            size_t i = 0;
+#ifdef PIXEL_SSE2
+            const __m128i zero = _mm_setzero_si128();
+            for (; i + 16 <= n; i += 16) {
+                __m128i c = _mm_loadu_si128((const __m128i*)(src + i));
+                detail::convert_rgb332_8(_mm_unpacklo_epi8(c, zero), dst + i);
+                detail::convert_rgb332_8(_mm_unpackhi_epi8(c, zero), dst + i + 8);
+            }
+#endif
+            auto& lut = detail::rgb332_lut();
+            for (; i < n; i++) dst[i] = lut[src[i]];
+        }
+
+        // Convert n RGB565 pixels, src may be unaligned
+        inline void convert_rgb565(const u8* src, u32* dst, size_t n) {
+            size_t i = 0;
+#ifdef PIXEL_SSE2
+            const __m128i m5 = _mm_set1_epi16(0x1f), m6 = _mm_set1_epi16(0x3f), alpha = _mm_set1_epi16((short)0xff00);
+            for (; i + 8 <= n; i += 8) {
+                __m128i c = _mm_loadu_si128((const __m128i*)(src + i * 2));
+                __m128i r = _mm_and_si128(_mm_srli_epi16(c, 11), m5),
+                        g = _mm_and_si128(_mm_srli_epi16(c, 5), m6),
+                        b = _mm_and_si128(c, m5);
+                r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+                g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+                b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+                detail::store_rgba(dst + i, _mm_or_si128(r, _mm_slli_epi16(g, 8)), _mm_or_si128(b, alpha));
+            }
+#endif
+            for (; i < n; i++) {
+                u16 c;
+                std::memcpy(&c, src + i * 2, 2);
+                dst[i] = rgb565(c);
+            }
+        }
+    }
+}
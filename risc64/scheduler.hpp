@@ -0,0 +1,115 @@
+#pragma once
+
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "aliases.hpp"
+
+// Retired instructions between host clock reads in real-time mode
+#define SCHEDULER_POLL_INTERVAL 0x100
+
+namespace machine {
+    // Machine-wide event scheduler for deferred device work
+    // Events are kept in a min-heap keyed by machine time and run on the CPU
+    // thread between instructions. In deterministic mode machine time is the
+    // retired instruction count, so runs are reproducible; in real-time mode
+    // it's nanoseconds of host monotonic time since start.
+    // Only the CPU thread (and device code it calls) may use the scheduler
+    class scheduler {
+    public:
+        enum mode {
+            sm_deterministic,
+            sm_realtime
+        };
+
+        typedef std::function<void()> callback_t;
+
+    private:
+        struct event {
+            u64 when, id;
+            callback_t f;
+
+            // Later events (then later ids) sink, so the heap top is the next one due
+            bool operator<(const event& o) const { return (when != o.when) ? when > o.when : id > o.id; }
+        };
+
+        std::vector <event> heap;
+        u64 next_id = 1;
+
+        mode m = sm_realtime;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        // Ticks per guest second, fixed at 1GHz in real-time mode
+        u64 frequency = 1000000000;
+
+        // Instruction count at which check() runs next
+        u64 retired = 0, next_check = 0;
+
+        void update_next_check() {
+            if (m == sm_realtime) {
+                next_check = retired + SCHEDULER_POLL_INTERVAL;
+            } else {
+                next_check = heap.empty() ? ~0ull : heap.front().when;
+            }
+        }
+
+        void check() {
+            u64 t = now();
+            while (!heap.empty() && (heap.front().when <= t)) {
+                std::pop_heap(heap.begin(), heap.end());
+                event e = std::move(heap.back());
+                heap.pop_back();
+                e.f();
+            }
+            update_next_check();
+        }
+
+    public:
+        // freq is the nominal instructions per second in deterministic mode, used
+        // to convert machine time to seconds
+        void set_mode(mode md, u64 freq = 10000000) {
+            m = md;
+            frequency = (m == sm_realtime) ? 1000000000 : std::max<u64>(freq, 1);
+            start = std::chrono::steady_clock::now();
+            update_next_check();
+        }
+
+        mode get_mode() const { return m; }
+        u64 get_frequency() const { return frequency; }
+        u64 get_retired() const { return retired; }
+
+        // Current machine time
+        u64 now() const {
+            if (m == sm_deterministic) return retired;
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        // Run f once machine time reaches when, returns an id for cancel()
+        u64 schedule_at(u64 when, callback_t f) {
+            heap.push_back({ when, next_id, std::move(f) });
+            std::push_heap(heap.begin(), heap.end());
+            update_next_check();
+            return next_id++;
+        }
+
+        u64 schedule_in(u64 delay, callback_t f) { return schedule_at(now() + delay, std::move(f)); }
+
+        // Returns false if the event already ran or doesn't exist
+        bool cancel(u64 id) {
+            auto it = std::find_if(heap.begin(), heap.end(), [id](const event& e) { return e.id == id; });
+            if (it == heap.end()) return false;
+
+            heap.erase(it);
+            std::make_heap(heap.begin(), heap.end());
+            update_next_check();
+            return true;
+        }
+
+        // Called by the CPU loop after every retired instruction
+        inline void tick() {
+            if (++retired >= next_check) check();
+        }
+    };
+}
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <array>
+
+#ifdef __linux__
+    #include <fcntl.h>
+    #include <unistd.h>
+#else
+    #include <cstdio>
+#endif
+
+#include "aliases.hpp"
+#include "bus.hpp"
+#include "timeline.hpp"
+#include "log.hpp"
+#include "devices/memory.hpp"
+
+// Buffers outside RAM are bounced through host memory in chunks of at most this size
+#define SEMIHOST_BOUNCE_SIZE 0x10000
+
+namespace machine {
+    // Host calls for test harnesses, issued by the "sh" sys instruction (0xfd)
+    // r0 selects the call, r1-r3 are its arguments, the result goes back
+    // into r0 (0xffffffffffffffff on failure). Guest buffers are accessed
+    // through the bus bulk path, straight in RAM when possible
+    namespace semihost {
+        enum call_id {
+            sh_exit  = 0, // r1 = exit code
+            sh_open  = 1, // r1 = path (NUL-terminated), r2 = mode, returns a handle
+            sh_close = 2, // r1 = handle
+            sh_read  = 3, // r1 = handle, r2 = buffer, r3 = length, returns bytes read
+            sh_write = 4, // r1 = handle, r2 = buffer, r3 = length, returns bytes written
+            sh_seek  = 5, // r1 = handle, r2 = offset, r3 = whence (0 set, 1 cur, 2 end), returns position
+            sh_clock = 6, // returns host monotonic time in nanoseconds
+            sh_argc  = 7, // returns the number of guest arguments
+            sh_argv  = 8, // r1 = index, r2 = buffer, r3 = length, returns the full argument length
+            sh_release = 9 // r1 = address, r2 = length, frees the host pages behind guest RAM
+                           // the guest no longer uses, the range reads as zero afterwards
+        };
+
+        // sh_open modes
+        enum open_mode {
+            om_read   = 0,
+            om_write  = 1, // create/truncate
+            om_rw     = 2,
+            om_append = 3
+        };
+
+        static constexpr u64 failure = 0xffffffffffffffff;
+
+        // Host file access is off unless enabled, clock/argv/exit always work
+        bool files_enabled = false;
+
+        // Guest arguments, the program name first
+        std::vector <std::string> args;
+
+        // Exit code requested by the guest, valid once exited is set
+        std::atomic<int> exit_status = 0;
+        std::atomic<bool> exited = false;
+
+        namespace detail {
+#ifdef __linux__
+            typedef int handle_t;
+            static constexpr handle_t invalid = -1;
+#else
+            typedef std::FILE* handle_t;
+            static constexpr handle_t invalid = nullptr;
+#endif
+            // Guest handles 0-2 are the host's standard streams
+            std::vector <handle_t> handles;
+
+            inline handle_t get(u64 h) {
+                if (h < 3) {
+#ifdef __linux__
+                    return (handle_t)h;
+#else
+                    return (h == 0) ? stdin : (h == 1) ? stdout : stderr;
+#endif
+                }
+                return ((h - 3) < handles.size()) ? handles[h - 3] : invalid;
+            }
+
+            // Read a NUL-terminated string out of guest memory
+            // RAM is scanned in place up to the end of the device, anything
+            // else is read a byte at a time so nothing past the NUL is touched
+            inline std::string get_string(u64 addr, size_t max = 0x1000) {
+                std::string s;
+                while (s.size() < max) {
+                    u64 a = addr + s.size();
+                    size_t i = bus::detail::find(a);
+                    if (i == bus::devices.size()) break;
+
+                    auto d = bus::devices[i];
+                    u64 n = std::min<u64>(max - s.size(), d->get_base() + d->get_size() - a);
+                    if (const char* p = (const char*)d->get_host_pointer(a, n)) {
+                        size_t len = strnlen(p, n);
+                        s.append(p, len);
+                        if (len < n) break;
+                        continue;
+                    }
+
+                    char c = (char)bus::read(a, 1);
+                    if (!c) break;
+                    s.push_back(c);
+                }
+                return s;
+            }
+
+            // Run f(p, n) over host memory for [addr, addr+len), f returns the
+            // bytes it transferred or failure. Non-RAM buffers are bounced in
+            // chunks, stopping at a short transfer or at unmapped guest memory
+            // Returns the total transferred, failure if nothing was
+            template <class F> inline u64 with_buffer(u64 addr, u64 len, bool to_guest, F f) {
+                if (u8* p = bus::get_host_pointer(addr, len)) return f(p, len);
+
+                std::vector <u8> bounce(std::min<u64>(len, SEMIHOST_BOUNCE_SIZE));
+                u64 done = 0;
+                while (done < len) {
+                    u64 n = std::min<u64>(len - done, bounce.size());
+                    if (!to_guest && !bus::read_block(addr + done, bounce.data(), n)) break;
+
+                    u64 r = f(bounce.data(), n);
+                    if (r == failure) break;
+                    if (to_guest && !bus::write_block(addr + done, bounce.data(), r)) break;
+
+                    done += r;
+                    if (r < n) return done;
+                }
+                return (done || !len) ? done : failure;
+            }
+        }
+
+        inline u64 open(u64 path, u64 mode) {
+            if (!files_enabled) return failure;
+
+            std::string name = detail::get_string(path);
+#ifdef __linux__
+            static constexpr int flags[] = { O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC, O_RDWR | O_CREAT, O_WRONLY | O_CREAT | O_APPEND };
+            if (mode > om_append) return failure;
+            detail::handle_t h = ::open(name.c_str(), flags[mode], 0644);
+#else
+            static constexpr const char* modes[] = { "rb", "wb", "r+b", "ab" };
+            if (mode > om_append) return failure;
+            detail::handle_t h = std::fopen(name.c_str(), modes[mode]);
+#endif
+            if (h == detail::invalid) return failure;
+
+            auto it = std::find(detail::handles.begin(), detail::handles.end(), detail::invalid);
+            if (it == detail::handles.end()) it = detail::handles.insert(it, h); else *it = h;
+            return (it - detail::handles.begin()) + 3;
+        }
+
+        inline u64 close(u64 h) {
+            if ((h < 3) || (detail::get(h) == detail::invalid)) return failure;
+#ifdef __linux__
+            ::close(detail::handles[h - 3]);
+#else
+            std::fclose(detail::handles[h - 3]);
+#endif
+            detail::handles[h - 3] = detail::invalid;
+            return 0;
+        }
+
+        inline u64 read(u64 h, u64 buf, u64 len) {
+            detail::handle_t f = detail::get(h);
+            if ((f == detail::invalid) || (!files_enabled && h)) return failure;
+
+            return detail::with_buffer(buf, len, true, [&](u8* p, u64 n) -> u64 {
+#ifdef __linux__
+                ssize_t r = ::read(f, p, n);
+                return (r < 0) ? failure : r;
+#else
+                return std::fread(p, 1, n, f);
+#endif
+            });
+        }
+
+        inline u64 write(u64 h, u64 buf, u64 len) {
+            detail::handle_t f = detail::get(h);
+            if ((f == detail::invalid) || (!files_enabled && (h > 2))) return failure;
+
+            return detail::with_buffer(buf, len, false, [&](u8* p, u64 n) -> u64 {
+#ifdef __linux__
+                ssize_t r = ::write(f, p, n);
+                return (r < 0) ? failure : r;
+#else
+                return std::fwrite(p, 1, n, f);
+#endif
+            });
+        }
+
+        inline u64 seek(u64 h, u64 offset, u64 whence) {
+            detail::handle_t f = detail::get(h);
+            if ((h < 3) || (f == detail::invalid) || (whence > 2)) return failure;
+#ifdef __linux__
+            off_t r = lseek(f, (off_t)offset, (whence == 0) ? SEEK_SET : (whence == 1) ? SEEK_CUR : SEEK_END);
+            return (r < 0) ? failure : r;
+#else
+            if (std::fseek(f, (long)offset, (whence == 0) ? SEEK_SET : (whence == 1) ? SEEK_CUR : SEEK_END)) return failure;
+            return std::ftell(f);
+#endif
+        }
+
+        inline u64 argv(u64 index, u64 buf, u64 len) {
+            if (index >= args.size()) return failure;
+
+            const std::string& a = args[index];
+            u64 n = std::min<u64>(len, a.size() + 1);
+            if (n) bus::write_block(buf, (const u8*)a.c_str(), n);
+            return a.size();
+        }
+
+        inline u64 release(u64 addr, u64 len) {
+            memory* ram = bus::get_device<memory>(9);
+            return (ram && ram->release(addr, len)) ? 0 : failure;
+        }
+
+        // Dispatch a call, r is the caller's GPR file, returns true if the CPU should halt
+        template <class GPRs> inline bool call(GPRs& r) {
+            TIMELINE_SCOPE("semihost_call");
+
+            switch (r[0]) {
+                case sh_exit: {
+                    exit_status = (int)r[1];
+                    exited = true;
+                    _log(info, "Guest exited with code %i", (int)r[1]);
+                    return true;
+                }
+                case sh_open:  r[0] = open(r[1], r[2]); break;
+                case sh_close: r[0] = close(r[1]); break;
+                case sh_read:  r[0] = read(r[1], r[2], r[3]); break;
+                case sh_write: r[0] = write(r[1], r[2], r[3]); break;
+                case sh_seek:  r[0] = seek(r[1], r[2], r[3]); break;
+                case sh_clock: {
+                    r[0] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()
+                    ).count();
+                } break;
+                case sh_argc:  r[0] = args.size(); break;
+                case sh_argv:  r[0] = argv(r[1], r[2], r[3]); break;
+                case sh_release: r[0] = release(r[1], r[2]); break;
+                default:       r[0] = failure; break;
+            }
+            return false;
+        }
+
+        // Host process status for the guest's exit code, 0 if it never exited
+        inline int process_status() {
+            if (!exited) return 0;
+#ifdef _WIN32
+            return exit_status;
+#else
+            // Only the low 8 bits reach the parent, keep failures nonzero
+            int s = exit_status & 0xff;
+            return (s || !exit_status) ? s : 1;
+#endif
+        }
+
+        // Close every handle the guest left open
+        inline void close_all() {
+            for (size_t i = 0; i < detail::handles.size(); i++) {
+                if (detail::handles[i] != detail::invalid) close(i + 3);
+            }
+        }
+    }
+}
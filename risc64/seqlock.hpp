@@ -0,0 +1,66 @@
+#pragma once
+
+#include <type_traits>
+#include <cstring>
+#include <atomic>
+#include <array>
+
+#include "aliases.hpp"
+
+namespace machine {
+    // Single-writer sequence lock, readers never block the writer
+    // The payload is kept in relaxed atomic words so torn reads are detected
+    // by the sequence number instead of being undefined behavior
+    template <class T> class seqlock {
+        static_assert(std::is_trivially_copyable_v<T>, "seqlock payload must be trivially copyable");
+
+        static constexpr size_t words = (sizeof(T) + 7) / 8;
+
+        std::atomic<u64> seq = 0;
+        std::array <std::atomic<u64>, words> data = {};
+
+    public:
+        seqlock() = default;
+
+        // Publish a new value, only one thread may call this
+        void store(const T& v) {
+            u64 buf[words] = { 0 };
+            std::memcpy(buf, &v, sizeof(T));
+
+            u64 s = seq.load(std::memory_order_relaxed);
+            seq.store(s + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            for (size_t i = 0; i < words; i++) {
+                data[i].store(buf[i], std::memory_order_relaxed);
+            }
+
+            seq.store(s + 2, std::memory_order_release);
+        }
+
+        // Read a consistent copy, returns the sequence number it belongs to
+        u64 load(T& out) const {
+            u64 buf[words], s0, s1;
+
+            while (true) {
+                s0 = seq.load(std::memory_order_acquire);
+                if (s0 & 1) continue;
+
+                for (size_t i = 0; i < words; i++) {
+                    buf[i] = data[i].load(std::memory_order_relaxed);
+                }
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                s1 = seq.load(std::memory_order_relaxed);
+
+                if (s0 == s1) break;
+            }
+
+            std::memcpy(&out, buf, sizeof(T));
+            return s0;
+        }
+
+        // Changes every time a new value is published
+        u64 get_sequence() const { return seq.load(std::memory_order_acquire); }
+    };
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <array>
+
+#include "aliases.hpp"
+
+namespace machine {
+    // Bounded lock-free single-producer/single-consumer FIFO
+    // One thread may push and one other thread may pop, N must be a power of 2
+    template <class T, size_t N> class spsc_queue {
+        static_assert(N && !(N & (N - 1)), "spsc_queue size must be a power of 2");
+
+        // Producer and consumer indices live on separate cache lines
+        alignas(64) std::atomic<u64> tail = 0;
+        alignas(64) std::atomic<u64> head = 0;
+
+        std::array <T, N> items;
+
+    public:
+        // Producer side, returns false if the queue is full
+        bool push(const T& v) {
+            u64 t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) >= N) return false;
+
+            items[t & (N - 1)] = v;
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Producer side, push as many of the n items as fit, returns how many did
+        size_t push(const T* v, size_t n) {
+            u64 t = tail.load(std::memory_order_relaxed);
+            n = std::min<size_t>(n, N - (t - head.load(std::memory_order_acquire)));
+
+            for (size_t i = 0; i < n; i++) items[(t + i) & (N - 1)] = v[i];
+            tail.store(t + n, std::memory_order_release);
+            return n;
+        }
+
+        // Consumer side, returns false if the queue is empty
+        bool pop(T& v) {
+            u64 h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire)) return false;
+
+            v = items[h & (N - 1)];
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Approximate when called from a third thread
+        size_t size() const {
+            u64 h = head.load(std::memory_order_acquire);
+            return tail.load(std::memory_order_acquire) - h;
+        }
+
+        static constexpr size_t capacity() { return N; }
+    };
+}
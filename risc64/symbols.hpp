@@ -0,0 +1,151 @@
+#pragma once
+
+#include <algorithm>
+#include <queue>
+#include <vector>
+#include <string>
+#include <cstdio>
+
+#include "aliases.hpp"
+
+namespace machine {
+    namespace symbols {
+        struct symbol {
+            u64 addr, size;
+            std::string name;
+        };
+
+        // One row of a line table, line == 0 marks the end of a sequence
+        struct line {
+            u64 addr;
+            u32 file, line;
+        };
+
+        // Sorted interval index over symbols and source lines
+        // Built once by a loader, lookups are binary searches
+        class table {
+            std::vector <symbol> syms;
+            std::vector <line> lines;
+            std::vector <std::string> files;
+
+            // Symbols flattened into non-overlapping spans, each one covers
+            // [start, next span's start) and maps to a symbol index or none
+            static constexpr size_t none = ~(size_t)0;
+            struct span { u64 start; size_t sym; };
+            std::vector <span> spans;
+
+            bool sorted = true;
+
+            static u64 end_of(const symbol& s) { return (s.addr + s.size < s.addr) ? ~0ull : s.addr + s.size; }
+
+            // Sweep over every symbol start and end. A zero-sized symbol covers
+            // up to the next symbol, otherwise the innermost (latest starting)
+            // sized symbol that's still open wins
+            void build_spans() {
+                spans.clear();
+
+                std::vector <u64> points;
+                points.reserve(syms.size() * 2);
+                for (auto& s : syms) {
+                    points.push_back(s.addr);
+                    if (s.size) points.push_back(end_of(s));
+                }
+                std::sort(points.begin(), points.end());
+                points.erase(std::unique(points.begin(), points.end()), points.end());
+
+                // Open sized symbols by index, expired ones are dropped when they reach the top
+                std::priority_queue <size_t> open;
+                size_t next = 0, last = none;
+                for (u64 p : points) {
+                    for (; (next < syms.size()) && (syms[next].addr <= p); next++) {
+                        last = next;
+                        if (syms[next].size) open.push(next);
+                    }
+                    while (open.size() && (end_of(syms[open.top()]) <= p)) open.pop();
+
+                    size_t sym = (last == none) ? none : (!syms[last].size ? last : (open.size() ? open.top() : none));
+                    if (spans.empty() || (spans.back().sym != sym)) spans.push_back({ p, sym });
+                }
+            }
+
+            void sort() {
+                std::stable_sort(syms.begin(), syms.end(), [](const symbol& a, const symbol& b) { return a.addr < b.addr; });
+                std::stable_sort(lines.begin(), lines.end(), [](const line& a, const line& b) { return a.addr < b.addr; });
+                build_spans();
+                sorted = true;
+            }
+
+        public:
+            void clear() {
+                syms.clear();
+                lines.clear();
+                files.clear();
+                spans.clear();
+                sorted = true;
+            }
+
+            void add_symbol(u64 addr, u64 size, const std::string& name) {
+                syms.push_back({ addr, size, name });
+                sorted = false;
+            }
+
+            // Returns an index to pass to add_line
+            u32 add_file(const std::string& name) {
+                files.push_back(name);
+                return files.size() - 1;
+            }
+
+            void add_line(u64 addr, u32 file, u32 ln) {
+                lines.push_back({ addr, file, ln });
+                sorted = false;
+            }
+
+            // Call after adding entries, lookups on an unsorted table sort it first
+            void finalize() { if (!sorted) sort(); }
+
+            size_t get_symbol_count() const { return syms.size(); }
+            size_t get_line_count() const { return lines.size(); }
+
+            // Find the symbol containing addr
+            // Zero-sized symbols extend up to the next symbol
+            const symbol* lookup(u64 addr) {
+                finalize();
+
+                auto it = std::upper_bound(spans.begin(), spans.end(), addr, [](u64 a, const span& s) { return a < s.start; });
+                if (it == spans.begin()) return nullptr;
+                --it;
+
+                return (it->sym == none) ? nullptr : &syms[it->sym];
+            }
+
+            // Find the source line for addr, returns false if there's none
+            bool lookup_line(u64 addr, std::string& file, u32& ln) {
+                finalize();
+
+                auto it = std::upper_bound(lines.begin(), lines.end(), addr, [](u64 a, const line& l) { return a < l.addr; });
+                if (it == lines.begin()) return false;
+                --it;
+
+                if (!it->line) return false;
+                file = files[it->file];
+                ln = it->line;
+                return true;
+            }
+
+            // "name+0xoff", or an empty string when addr isn't covered
+            std::string symbolize(u64 addr) {
+                const symbol* s = lookup(addr);
+                if (!s) return "";
+
+                if (addr == s->addr) return s->name;
+
+                char off[24];
+                std::snprintf(off, sizeof(off), "+0x%llx", (unsigned long long)(addr - s->addr));
+                return s->name + off;
+            }
+        };
+
+        // Symbols of the loaded program
+        table global;
+    }
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include <mutex>
+
+#include "aliases.hpp"
+#include "spsc.hpp"
+
+// Visible terminal grid
+#define TERMINAL_COLUMNS 64
+#define TERMINAL_ROWS 24
+
+// Lines kept in total, including the visible ones
+#define TERMINAL_SCROLLBACK 2000
+
+// Characters the CPU can output before it has to apply them itself
+#define TERMINAL_PENDING 0x1000
+
+namespace machine {
+    // Character grid with a ring-buffered scrollback
+    // Written by the CPU thread, read once per frame by the renderer. Output is
+    // queued lock-free and applied in one batch when the renderer flushes. Each
+    // line carries a version so the renderer only rebuilds lines that changed
+    class terminal_buffer {
+        // CPU output not applied to the grid yet, popped with m held
+        spsc_queue <char, TERMINAL_PENDING> pending;
+
+        std::vector <char> cells;
+        std::vector <u32> versions;
+
+        // Absolute line numbers, first is the oldest line still in the ring
+        u64 first = 0, cursor_line = 0;
+        size_t cursor_col = 0;
+
+        // Bumped on every change, lets the renderer skip idle frames
+        u64 generation = 0;
+
+        mutable std::mutex m;
+
+        char* line_ptr(u64 l) { return &cells[(l % TERMINAL_SCROLLBACK) * TERMINAL_COLUMNS]; }
+        void touch(u64 l) { versions[l % TERMINAL_SCROLLBACK]++; generation++; }
+
+        void newline() {
+            cursor_line++;
+            cursor_col = 0;
+            if (cursor_line - first >= TERMINAL_SCROLLBACK) first++;
+
+            std::fill_n(line_ptr(cursor_line), TERMINAL_COLUMNS, ' ');
+            touch(cursor_line);
+        }
+
+        void put_locked(char c) {
+            switch (c) {
+                case '\n': newline(); return;
+                case '\r': cursor_col = 0; return;
+                case '\b': {
+                    if (cursor_col) { line_ptr(cursor_line)[--cursor_col] = ' '; touch(cursor_line); }
+                } return;
+                case '\t': {
+                    size_t n = 8 - (cursor_col & 7);
+                    for (size_t i = 0; i < n; i++) put_locked(' ');
+                } return;
+            }
+
+            if (cursor_col == TERMINAL_COLUMNS) newline();
+            line_ptr(cursor_line)[cursor_col++] = ((c < 0x20) || (c > 0x7e)) ? '?' : c;
+            touch(cursor_line);
+        }
+
+        void flush_locked() {
+            char c;
+            while (pending.pop(c)) put_locked(c);
+        }
+
+    public:
+        terminal_buffer() :
+            cells(TERMINAL_SCROLLBACK * TERMINAL_COLUMNS, ' '),
+            versions(TERMINAL_SCROLLBACK, 0) {}
+
+        // CPU thread only, applies the queue itself when it's full
+        void put(char c) {
+            if (pending.push(c)) return;
+
+            std::lock_guard <std::mutex> lock(m);
+            flush_locked();
+            put_locked(c);
+        }
+
+        // Apply queued output, call once per frame before reading the grid
+        void flush() {
+            std::lock_guard <std::mutex> lock(m);
+            flush_locked();
+        }
+
+        // Erase the character before the cursor (local echo editing)
+        void erase() {
+            std::lock_guard <std::mutex> lock(m);
+            flush_locked();
+            put_locked('\b');
+        }
+
+        u64 get_generation() const {
+            std::lock_guard <std::mutex> lock(m);
+            return generation;
+        }
+
+        // Snapshot of what the renderer needs, taken under the lock
+        struct view {
+            u64 first, last, cursor_line;
+            size_t cursor_col;
+        };
+
+        view get_view() const {
+            std::lock_guard <std::mutex> lock(m);
+            return { first, cursor_line, cursor_line, cursor_col };
+        }
+
+        // Copy line l out if its version differs from the one given
+        // Returns false if the line is unchanged or has left the scrollback
+        bool copy_line(u64 l, u32& version, char* out) {
+            std::lock_guard <std::mutex> lock(m);
+            if ((l < first) || (l > cursor_line)) return false;
+
+            u32 v = versions[l % TERMINAL_SCROLLBACK];
+            if (v == version) return false;
+
+            version = v;
+            std::copy_n(line_ptr(l), TERMINAL_COLUMNS, out);
+            return true;
+        }
+    };
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+// Uncomment this (or build with -DTIMELINE_ENABLED) to record host timeline
+// events, when it's not defined every TIMELINE_* macro expands to nothing
+//#define TIMELINE_ENABLED
+
+#ifdef TIMELINE_ENABLED
+
+#include <memory>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <fstream>
+
+#include "aliases.hpp"
+#include "log.hpp"
+
+// Events kept per thread, older events are overwritten
+#define TIMELINE_BUFFER_SIZE 0x10000
+
+namespace machine {
+    namespace timeline {
+        // A complete ("X" phase) event
+        struct event {
+            const char* name;
+            u64 begin, end;
+        };
+
+        // Single-writer event ring owned by one thread
+        struct thread_buffer {
+            std::string name;
+            size_t tid = 0;
+            std::unique_ptr<event[]> events = std::make_unique<event[]>(TIMELINE_BUFFER_SIZE);
+            std::atomic<u64> head = 0;
+
+            inline void push(const char* n, u64 b, u64 e) {
+                u64 h = head.load(std::memory_order_relaxed);
+                events[h & (TIMELINE_BUFFER_SIZE - 1)] = { n, b, e };
+                head.store(h + 1, std::memory_order_release);
+            }
+        };
+
+        const auto epoch = std::chrono::steady_clock::now();
+
+        // Registration is the only locked path, it happens once per thread
+        std::mutex buffers_mutex;
+        std::vector <std::unique_ptr<thread_buffer>> buffers;
+
+        inline u64 now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+        }
+
+        inline thread_buffer* get_buffer() {
+            thread_local thread_buffer* b = nullptr;
+            if (!b) {
+                std::lock_guard <std::mutex> lock(buffers_mutex);
+                buffers.push_back(std::make_unique<thread_buffer>());
+                b = buffers.back().get();
+                b->tid = buffers.size();
+                b->name = "thread" + std::to_string(b->tid);
+            }
+            return b;
+        }
+
+        // Name the calling thread in the exported trace
+        inline void set_thread_name(const char* name) {
+            thread_buffer* b = get_buffer();
+            std::lock_guard <std::mutex> lock(buffers_mutex);
+            b->name = name;
+        }
+
+        // Records the lifetime of the enclosing scope
+        class scope {
+            const char* name;
+            u64 begin;
+
+        public:
+            scope(const char* name) : name(name), begin(now()) {}
+            ~scope() { get_buffer()->push(name, begin, now()); }
+        };
+
+        // Write every recorded event as Chrome/Perfetto trace JSON
+        void export_json(const std::string& file) {
+            std::ofstream f(file);
+            if (!f.is_open()) {
+                _log(warning, "Couldn't open timeline file \"%s\"", file.c_str());
+                return;
+            }
+
+            std::lock_guard <std::mutex> lock(buffers_mutex);
+
+            u64 count = 0;
+            bool first = true;
+            f << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+            for (auto& b : buffers) {
+                f << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b->tid
+                  << ",\"args\":{\"name\":\"" << b->name << "\"}}";
+                first = false;
+
+                u64 h = b->head.load(std::memory_order_acquire),
+                    s = (h > TIMELINE_BUFFER_SIZE) ? h - TIMELINE_BUFFER_SIZE : 0;
+
+                for (u64 i = s; i < h; i++) {
+                    event& e = b->events[i & (TIMELINE_BUFFER_SIZE - 1)];
+                    f << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid
+                      << ",\"ts\":" << (e.begin / 1000) << "." << (e.begin % 1000) / 100
+                      << ",\"dur\":" << ((e.end - e.begin) / 1000) << "." << ((e.end - e.begin) % 1000) / 100 << "}";
+                    count++;
+                }
+            }
+            f << "\n]}\n";
+
+            _log(info, "Wrote %llu timeline events to \"%s\"", (unsigned long long)count, file.c_str());
+        }
+    }
+}
+
+#define TIMELINE_CONCAT_IMPL(a, b) a##b
+#define TIMELINE_CONCAT(a, b) TIMELINE_CONCAT_IMPL(a, b)
+
+#define TIMELINE_SCOPE(name) machine::timeline::scope TIMELINE_CONCAT(timeline_scope_, __LINE__)(name)
+#define TIMELINE_THREAD(name) machine::timeline::set_thread_name(name)
+#define TIMELINE_EXPORT(file) machine::timeline::export_json(file)
+
+#else
+
+#define TIMELINE_SCOPE(name)
+#define TIMELINE_THREAD(name)
+#define TIMELINE_EXPORT(file)
+
+#endif
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <array>
+
+#include "aliases.hpp"
+#include "device.hpp"
+#include "log.hpp"
+#include "cpu/decoder.hpp"
+
+namespace machine {
+    // Cycle-cost timing model
+    // Costs are read from a table file and flattened into a lookup indexed by
+    // the decoded type (class | subclass) and operand size, so charging an
+    // instruction is one load. Table file syntax, later lines override earlier
+    // ones, '*' matches anything, '#' starts a comment:
+    //   <class> <subclass> <size> <cycles>   class: alu lsu bnj sys
+    //                                        subclass: t_reg t_const d_reg d_const d_dconst s_reg s_const none
+    //                                        size: 8 16 32 64
+    //   skipped <cycles>                     instructions whose condition failed
+    //   taken <cycles>                       extra for every executed bnj instruction
+    //   device <hid|name> <read> <write>     per bus access by load/store instructions,
+    //                                        names with spaces are quoted: device "Main Memory Controller" 2 2
+    // Instructions default to 1 cycle, accesses to 0
+    namespace timing {
+        class model {
+            std::array <u32, 32 * 4> instruction_cost;
+            u32 skipped_cost = 1, taken_cost = 0;
+
+            // Read and write cost per bus device index, the device that takes
+            // an access is the one that's charged
+            std::vector <std::array<u32, 2>> device_cost;
+
+            static bool match(const std::string& pattern, const std::vector <std::string>& names, size_t i) {
+                return (pattern == "*") || (pattern == names[i]);
+            }
+
+            bool parse_instruction(const std::string& cls, const std::string& sub, const std::string& size, u32 cycles) {
+                static const std::vector <std::string> classes = { "alu", "lsu", "bnj", "sys" },
+                    subclasses = { "t_reg", "t_const", "d_reg", "d_const", "d_dconst", "s_reg", "s_const", "none" },
+                    sizes = { "8", "16", "32", "64" };
+
+                bool any = false;
+                for (size_t c = 0; c < classes.size(); c++) {
+                    if (!match(cls, classes, c)) continue;
+                    for (size_t s = 0; s < subclasses.size(); s++) {
+                        if (!match(sub, subclasses, s)) continue;
+                        for (size_t z = 0; z < sizes.size(); z++) {
+                            if (!match(size, sizes, z)) continue;
+                            instruction_cost[(((s << 2) | c) << 2) | z] = cycles;
+                            any = true;
+                        }
+                    }
+                }
+                return any;
+            }
+
+        public:
+            model() { instruction_cost.fill(1); }
+
+            // devices are matched against "device" lines, normally bus::devices
+            template <class Devices> bool load(const std::string& file, Devices& devices) {
+                std::ifstream f(file);
+                if (!f.is_open()) {
+                    _log(error, "Couldn't open timing table \"%s\"", file.c_str());
+                    return false;
+                }
+
+                std::string line;
+                for (size_t n = 1; std::getline(f, line); n++) {
+                    line = line.substr(0, line.find('#'));
+                    std::istringstream ss(line);
+                    std::vector <std::string> t;
+                    for (std::string w; ss >> std::quoted(w); ) t.push_back(w);
+                    if (t.empty()) continue;
+
+                    bool ok = false;
+                    try {
+                        if ((t[0] == "skipped") && (t.size() == 2)) { skipped_cost = std::stoul(t[1]); ok = true; }
+                        else if ((t[0] == "taken") && (t.size() == 2)) { taken_cost = std::stoul(t[1]); ok = true; }
+                        else if ((t[0] == "device") && (t.size() == 4)) {
+                            bool is_hid = std::isdigit((unsigned char)t[1][0]);
+                            std::array <u32, 2> cost = { (u32)std::stoul(t[2]), (u32)std::stoul(t[3]) };
+                            for (size_t i = 0; i < devices.size(); i++) {
+                                auto d = devices[i];
+                                if (is_hid ? (d->get_hid() == std::stoull(t[1], nullptr, 0)) : (d->get_name() == t[1])) {
+                                    device_cost.resize(std::max(device_cost.size(), i + 1), { 0, 0 });
+                                    device_cost[i] = cost;
+                                    ok = true;
+                                }
+                            }
+                        }
+                        else if (t.size() == 4) ok = parse_instruction(t[0], t[1], t[2], std::stoul(t[3]));
+                    } catch (...) { ok = false; }
+
+                    if (!ok) _log(warning, "Ignoring timing table line %zu: \"%s\"", n, line.c_str());
+                }
+                return true;
+            }
+
+            // Cycles for a decoded instruction
+            inline u32 instruction(const decoder::instruction& i, bool executed) const {
+                if (!executed) return skipped_cost;
+
+                u32 c = instruction_cost[(i.type << 2) | i.operand_size];
+                if ((i.type & 0x3) == decoder::instruction_type::bnj) c += taken_cost;
+                return c;
+            }
+
+            // Cycles for a load (write = false) or store that hit bus device i
+            inline u32 access(size_t i, bool write) const {
+                return (i < device_cost.size()) ? device_cost[i][write] : 0;
+            }
+        };
+    }
+}
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#if defined(__linux__) || defined(__APPLE__)
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+
+    #define TRACE_USE_MMAP
+#endif
+
+#include "aliases.hpp"
+#include "log.hpp"
+
+namespace machine {
+    namespace trace {
+        // Trace modes
+        enum mode {
+            m_off,  // Tracing disabled
+            m_last, // Keep the last N instructions in a file-backed ring
+            m_full  // Stream every retired instruction to a file
+        };
+
+        // Record flags
+        enum record_flags {
+            rf_reg_write = 0b0001,  // reg/reg_value are valid
+            rf_mem_read  = 0b0010,  // mem_addr/mem_value hold a load
+            rf_mem_write = 0b0100,  // mem_addr/mem_value hold a store
+            rf_skipped   = 0b1000   // Condition failed, instruction didn't execute
+        };
+
+        // One retired instruction, 48 bytes
+        struct record {
+            u64 pc;
+            u64 opcode;
+            u16 ext64;
+            u16 sr;
+            u8  pci;
+            u8  flags;
+            u8  reg;
+            u8  mem_size;
+            u64 reg_value;
+            u64 mem_addr;
+            u64 mem_value;
+        };
+
+        static_assert(sizeof(record) == 48, "trace::record must be 48 bytes");
+
+        // Trace file header
+        // capacity == 0 -> records are stored linearly (full mode)
+        // capacity != 0 -> records are a ring, the oldest one is at (head % capacity)
+        struct header {
+            char magic[8];
+            u32  version;
+            u32  record_size;
+            u64  capacity;
+            u64  head;
+        };
+
+        static const char* magic = "R64TRACE";
+        static const u32 version = 1;
+
+        // Lock-free single-producer ring buffer of trace records
+        // The CPU thread is the only producer, in full mode a writer thread
+        // drains the ring into the trace file
+        class buffer {
+            mode m = m_off;
+
+            record* ring = nullptr;
+            header* hdr = nullptr;
+            u64 capacity = 0, mask = 0;
+
+            std::atomic<u64> head = 0, tail = 0;
+            std::atomic<bool> running = false;
+
+            std::thread writer;
+            std::FILE* file = nullptr;
+            std::string name;
+
+#ifdef TRACE_USE_MMAP
+            void* map = nullptr;
+            size_t map_size = 0;
+            int fd = -1;
+#endif
+
+            static u64 round_pow2(u64 v) {
+                u64 p = 1;
+                while (p < v) p <<= 1;
+                return p;
+            }
+
+            void write_header(header& h, u64 cap, u64 hd) {
+                std::memcpy(h.magic, magic, 8);
+                h.version = version;
+                h.record_size = sizeof(record);
+                h.capacity = cap;
+                h.head = hd;
+            }
+
+            // Full mode writer, copies [tail, head) to the file in at most two chunks
+            void drain() {
+                while (true) {
+                    bool stop = !running.load(std::memory_order_acquire);
+                    u64 h = head.load(std::memory_order_acquire),
+                        t = tail.load(std::memory_order_relaxed);
+
+                    if (h == t) {
+                        if (stop) break;
+                        std::this_thread::sleep_for(std::chrono::microseconds(200));
+                        continue;
+                    }
+
+                    u64 first = t & mask,
+                        count = std::min(h - t, capacity - first);
+
+                    std::fwrite(&ring[first], sizeof(record), count, file);
+                    tail.store(t + count, std::memory_order_release);
+                }
+            }
+
+            bool alloc_ring() {
+#ifdef TRACE_USE_MMAP
+                map_size = capacity * sizeof(record);
+                map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (map == MAP_FAILED) { map = nullptr; return false; }
+                ring = (record*)map;
+#else
+                ring = new record[capacity];
+#endif
+                return true;
+            }
+
+            bool open_last() {
+#ifdef TRACE_USE_MMAP
+                // The ring lives in a shared file mapping, so the kernel keeps
+                // the last N records even if the emulator crashes
+                fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0) return false;
+
+                map_size = sizeof(header) + capacity * sizeof(record);
+                if (ftruncate(fd, map_size)) { ::close(fd); fd = -1; return false; }
+
+                map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (map == MAP_FAILED) { map = nullptr; ::close(fd); fd = -1; return false; }
+
+                hdr = (header*)map;
+                ring = (record*)((u8*)map + sizeof(header));
+                write_header(*hdr, capacity, 0);
+                return true;
+#else
+                hdr = new header;
+                write_header(*hdr, capacity, 0);
+                return alloc_ring();
+#endif
+            }
+
+            bool open_full() {
+                file = std::fopen(name.c_str(), "wb");
+                if (!file) return false;
+
+                if (!alloc_ring()) { std::fclose(file); file = nullptr; return false; }
+
+                header h;
+                write_header(h, 0, 0);
+                std::fwrite(&h, sizeof(header), 1, file);
+
+                running = true;
+                writer = std::thread(&buffer::drain, this);
+                return true;
+            }
+
+        public:
+            buffer() = default;
+            ~buffer() { close(); }
+
+            bool is_enabled() const { return m != m_off; }
+            mode get_mode() const { return m; }
+            u64 get_count() const { return head.load(std::memory_order_relaxed); }
+
+            // Open a trace file, capacity is the ring size in records
+            bool open(const std::string& file_name, mode md, u64 cap = 0x100000) {
+                close();
+
+                name = file_name;
+                capacity = round_pow2(std::max<u64>(cap, 64));
+                mask = capacity - 1;
+                head = 0;
+                tail = 0;
+
+                bool ok = false;
+                switch (md) {
+                    case m_last: ok = open_last(); break;
+                    case m_full: ok = open_full(); break;
+                    default: break;
+                }
+
+                if (!ok) {
+                    _log(warning, "Couldn't open trace file \"%s\"", file_name.c_str());
+                    return false;
+                }
+
+                m = md;
+                return true;
+            }
+
+            // Append a record, called once per retired instruction
+            inline void push(const record& r) {
+                u64 h = head.load(std::memory_order_relaxed);
+
+                if (m == m_full) {
+                    // Full mode can't drop records, wait for the writer to catch up
+                    while ((h - tail.load(std::memory_order_acquire)) >= capacity) {
+                        std::this_thread::yield();
+                    }
+                }
+
+                ring[h & mask] = r;
+                head.store(h + 1, std::memory_order_release);
+
+                if (hdr) hdr->head = h + 1;
+            }
+
+            // Flush and release everything, in last mode this is the halt dump
+            void close() {
+                if (m == m_off) return;
+
+                if (m == m_full) {
+                    running.store(false, std::memory_order_release);
+                    if (writer.joinable()) writer.join();
+
+                    header h;
+                    write_header(h, 0, head);
+                    std::fseek(file, 0, SEEK_SET);
+                    std::fwrite(&h, sizeof(header), 1, file);
+                    std::fclose(file);
+                    file = nullptr;
+                }
+
+#ifdef TRACE_USE_MMAP
+                if (map) {
+                    if (fd >= 0) msync(map, map_size, MS_SYNC);
+                    munmap(map, map_size);
+                    map = nullptr;
+                }
+                if (fd >= 0) { ::close(fd); fd = -1; }
+#else
+                if (m == m_last) {
+                    std::FILE* f = std::fopen(name.c_str(), "wb");
+                    if (f) {
+                        std::fwrite(hdr, sizeof(header), 1, f);
+                        std::fwrite(ring, sizeof(record), capacity, f);
+                        std::fclose(f);
+                    }
+                    delete hdr;
+                }
+                delete[] ring;
+#endif
+                _log(info, "Wrote %llu trace records to \"%s\"", (unsigned long long)head.load(), name.c_str());
+
+                ring = nullptr;
+                hdr = nullptr;
+                m = m_off;
+            }
+        };
+
+        // Parse a mode name as passed on the command line
+        inline mode get_mode(const std::string& s) {
+            if (s == "full") return m_full;
+            if (s == "last") return m_last;
+            return m_off;
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+
+#include "aliases.hpp"
+
+namespace machine {
+    // Lock-free triple buffer for handing frames from one producer to one consumer
+    // The producer fills the back slot and publishes it, the consumer picks up the
+    // newest published slot. Neither side ever waits, frames the consumer didn't
+    // get to in time are overwritten
+    template <class T> class triple_buffer {
+        std::array <T, 3> slots;
+
+        // Index of the middle slot, with fresh_bit set while it holds an unread frame
+        static constexpr u8 fresh_bit = 0x4;
+        alignas(64) std::atomic<u8> middle = 1;
+
+        // Owned by the producer and consumer respectively
+        alignas(64) u8 back = 0;
+        alignas(64) u8 front = 2;
+
+    public:
+        // Producer side
+        T& get_back() { return slots[back]; }
+
+        void publish() {
+            back = middle.exchange(back | fresh_bit, std::memory_order_acq_rel) & ~fresh_bit;
+        }
+
+        // Consumer side, returns true if a new frame replaced the front slot
+        bool acquire() {
+            if (!(middle.load(std::memory_order_relaxed) & fresh_bit)) return false;
+
+            front = middle.exchange(front, std::memory_order_acq_rel) & ~fresh_bit;
+            return true;
+        }
+
+        const T& get_front() const { return slots[front]; }
+
+        // Slots are only touched by their owner, so this is safe before the threads start
+        template <class F> void for_each(F f) { for (T& s : slots) f(s); }
+    };
+}
@@ -1,6 +1,10 @@
 #pragma once
 
 #include <iomanip>
+#include <sstream>
+#include <string>
+
+#include "aliases.hpp"
 
 #ifdef _WIN32
     #define WIN32_LEAN_AND_MEAN
@@ -10,6 +14,20 @@
 
 namespace machine {
     namespace utility {
+        // Parse a byte count, accepts K, M and G suffixes (e.g. "64K", "4G")
+        inline u64 parse_size(const std::string& s) {
+            size_t end = 0;
+            u64 v = std::stoull(s, &end, 0);
+            if (end < s.size()) {
+                switch (s[end]) {
+                    case 'k': case 'K': v <<= 10; break;
+                    case 'm': case 'M': v <<= 20; break;
+                    case 'g': case 'G': v <<= 30; break;
+                }
+            }
+            return v;
+        }
+
         // Round a float to 1 decimal place
         float round(float var) { 
             float value = (int)(var * 10 + .5); 